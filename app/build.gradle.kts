@@ -57,6 +57,9 @@ dependencies {
     // Javalin for HTTP server with reliable streaming support
     implementation("io.javalin:javalin:5.6.3")
     
+    // Cleartext HTTP/2 (h2c) for the Javalin server; must match Javalin's Jetty version
+    implementation("org.eclipse.jetty.http2:http2-server:11.0.17")
+    
     // SLF4J for Javalin logging (required dependency)
     implementation("org.slf4j:slf4j-android:1.7.36")
     
@@ -52,6 +52,7 @@ class ApiServerService : Service() {
     
     override fun onCreate() {
         super.onCreate()
+        LogManager.setMinLevel(SettingsManager(this).getLogLevel())
         createNotificationChannel()
     }
     
@@ -146,8 +147,8 @@ class ApiServerService : Service() {
                 LogManager.i(TAG, "API server started successfully")
 
                 // Now load the model in the background.  Non-inference endpoints
-                // (/health, /, /chat) respond immediately; inference endpoints
-                // will return an appropriate error until the model is ready.
+                // (/health, /, /chat) respond immediately; inference requests wait
+                // for the load to finish (bounded) and then get 503 with Retry-After.
                 LogManager.i(TAG, "Loading model: $modelPath")
                 val modelLoaded = llamaModel.loadModel(modelPath)
                 if (!modelLoaded) {
@@ -175,10 +176,42 @@ class ApiServerService : Service() {
         return true
     }
     
+    /**
+     * Replace the served model with the one at [modelPath] without stopping the server.
+     * In-flight requests finish on the old model; new ones go to the new model as soon
+     * as it is loaded (see [ModelRegistry.swapPrimary]).  Runs in the background and
+     * reports the outcome to [onComplete] on a background thread.
+     */
+    fun swapModel(
+        modelPath: String,
+        mode: ModelRegistry.SwapMode = ModelRegistry.SwapMode.AUTO,
+        onComplete: ((Boolean) -> Unit)? = null
+    ) {
+        val server = apiServer
+        if (server == null) {
+            LogManager.w(TAG, "Cannot swap model: server not running")
+            onComplete?.invoke(false)
+            return
+        }
+        serviceScope.launch {
+            val success = try {
+                model = server.swapModel(modelPath, mode)
+                LogManager.i(TAG, "Model swapped to ${model?.getModelName()}")
+                true
+            } catch (e: Exception) {
+                LogManager.e(TAG, "Failed to swap model", e)
+                false
+            }
+            onComplete?.invoke(success)
+        }
+    }
+    
     fun stopServer() {
         LogManager.i(TAG, "Stopping API server")
+        // The server may have swapped models since startup (e.g. via /admin/model)
+        val current = apiServer?.getPrimaryModel() ?: model
         apiServer?.stop()
-        model?.close()  // Explicitly close to free native resources
+        current?.close()  // Explicitly close to free native resources
         apiServer = null
         model = null
         isRunning = false
@@ -189,7 +222,7 @@ class ApiServerService : Service() {
     
     fun getServerPort(): Int = currentPort
     
-    fun getLoadedModel(): LlamaModel? = model
+    fun getLoadedModel(): LlamaModel? = apiServer?.getPrimaryModel() ?: model
     
     fun getApiServer(): OpenAIApiServer? = apiServer
     
@@ -227,6 +260,23 @@ class ApiServerService : Service() {
             .build()
     }
     
+    /**
+     * Hand memory pressure to the server, which sheds caches, engines and finally the
+     * model so that the low-memory killer does not take the whole server down.
+     */
+    override fun onTrimMemory(level: Int) {
+        super.onTrimMemory(level)
+        LogManager.w(TAG, "onTrimMemory($level)")
+        apiServer?.onMemoryPressure(MemoryPressure.levelFor(level))
+    }
+
+    @Deprecated("Deprecated in Java")
+    override fun onLowMemory() {
+        super.onLowMemory()
+        LogManager.w(TAG, "onLowMemory()")
+        apiServer?.onMemoryPressure(MemoryPressure.Level.CRITICAL)
+    }
+    
     override fun onDestroy() {
         super.onDestroy()
         stopServer()
@@ -0,0 +1,526 @@
+package com.wannaphong.hostai
+
+import android.content.Context
+import com.google.gson.Gson
+import com.google.gson.GsonBuilder
+import com.google.gson.JsonObject
+import kotlinx.coroutines.CancellationException
+import kotlinx.coroutines.CoroutineScope
+import kotlinx.coroutines.Dispatchers
+import kotlinx.coroutines.Job
+import kotlinx.coroutines.SupervisorJob
+import kotlinx.coroutines.cancel
+import kotlinx.coroutines.channels.Channel
+import kotlinx.coroutines.delay
+import kotlinx.coroutines.isActive
+import kotlinx.coroutines.launch
+import kotlinx.coroutines.withTimeoutOrNull
+import java.io.File
+import java.util.UUID
+import java.util.concurrent.Semaphore
+
+/**
+ * State of one batch created through /v1/batches.
+ * Timestamps are in seconds; a null timestamp means the batch has not reached that state.
+ */
+data class BatchJob(
+    val id: String,
+    val endpoint: String,
+    val inputFileId: String,
+    val completionWindow: String,
+    val createdAt: Long,
+    val expiresAt: Long,
+    val metadata: Map<String, Any>?,
+    var status: String,
+    var total: Int = 0,
+    var completed: Int = 0,
+    var failed: Int = 0,
+    var errors: List<Map<String, Any>>? = null,
+    var outputFileId: String? = null,
+    var errorFileId: String? = null,
+    var inProgressAt: Long? = null,
+    var finalizingAt: Long? = null,
+    var completedAt: Long? = null,
+    var failedAt: Long? = null,
+    var expiredAt: Long? = null,
+    var cancellingAt: Long? = null,
+    var cancelledAt: Long? = null,
+    // Status the batch moves to once finalizing is done; lets a restart finish the job
+    var pendingStatus: String? = null
+)
+
+/**
+ * Runs batches of chat completion requests (OpenAI Batch API) in the background.
+ *
+ * A batch reads its requests from a JSONL file in [FileStore] and works through them
+ * one at a time, only when interactive traffic leaves capacity unused: before each
+ * request the worker checks that nobody is waiting on the server's request semaphore
+ * and that the server could start it right away (see [isIdle]), then takes a permit
+ * with tryAcquire.  An interactive request therefore never queues behind more than
+ * one batch request.
+ *
+ * Results are appended to a per-batch JSONL file as each request finishes, and the
+ * batch state is saved to `files/batches/<id>.json`.  On restart the number of result
+ * lines already written is the checkpoint, so a batch resumes where it stopped.  When
+ * the batch finishes the result files are moved into [FileStore] as `batch_output`
+ * files and referenced from the batch as output_file_id / error_file_id.
+ *
+ * @param isIdle Whether a request with the given body could start now: memory
+ *   pressure admits it and the model it routes to has an idle engine
+ * @param semaphore Returns the server's current request semaphore
+ * @param execute Runs one request body against [BatchJob.endpoint] and returns the
+ *   response body; throw IllegalArgumentException for invalid requests
+ */
+class BatchManager(
+    context: Context,
+    private val fileStore: FileStore,
+    private val isIdle: (body: JsonObject) -> Boolean,
+    private val semaphore: () -> Semaphore,
+    private val execute: (endpoint: String, body: JsonObject) -> Map<String, Any>
+) {
+    /**
+     * One page of [list] results; [hasMore] is true when further batches follow the last one.
+     */
+    data class Page(
+        val data: List<BatchJob>,
+        val hasMore: Boolean
+    )
+
+    private val dir = File(context.filesDir, BATCHES_DIR_NAME)
+    private val gson: Gson = GsonBuilder().disableHtmlEscaping().create()
+    private val lock = Any()
+    // All known batches by id; guarded by [lock]
+    private val jobs = LinkedHashMap<String, BatchJob>()
+
+    private val scope = CoroutineScope(Dispatchers.IO + SupervisorJob())
+    private val wakeups = Channel<Unit>(Channel.CONFLATED)
+    private var worker: Job? = null
+
+    companion object {
+        private const val TAG = "BatchManager"
+        private const val BATCHES_DIR_NAME = "batches"
+        private const val ID_PREFIX = "batch_"
+        private const val OUTPUT_SUFFIX = ".output.jsonl"
+        private const val ERRORS_SUFFIX = ".errors.jsonl"
+
+        const val STATUS_VALIDATING = "validating"
+        const val STATUS_FAILED = "failed"
+        const val STATUS_IN_PROGRESS = "in_progress"
+        const val STATUS_FINALIZING = "finalizing"
+        const val STATUS_COMPLETED = "completed"
+        const val STATUS_EXPIRED = "expired"
+        const val STATUS_CANCELLING = "cancelling"
+        const val STATUS_CANCELLED = "cancelled"
+
+        val SUPPORTED_ENDPOINTS = setOf("/v1/chat/completions")
+        const val COMPLETION_WINDOW_24H = "24h"
+        private const val COMPLETION_WINDOW_SECONDS = 24L * 60L * 60L
+
+        // Same limit as OpenAI
+        const val MAX_REQUESTS_PER_BATCH = 50_000
+        // Validation errors reported per batch
+        private const val MAX_REPORTED_ERRORS = 100
+        // How long the worker sleeps when there is nothing to do
+        private const val IDLE_POLL_MS = 5_000L
+        // How often the worker re-checks for spare capacity while interactive requests run
+        private const val SLOT_POLL_MS = 250L
+    }
+
+    /**
+     * Load saved batches and start the background worker.
+     */
+    fun start() {
+        val count = synchronized(lock) {
+            if (worker?.isActive == true) return
+            loadJobs()
+            jobs.size
+        }
+        worker = scope.launch { runWorker() }
+        LogManager.i(TAG, "Batch worker started ($count known batch(es))")
+    }
+
+    /**
+     * Stop the worker.  An in-progress batch keeps its state on disk and resumes on the
+     * next start(); the request being executed, if any, is finished first by the model.
+     */
+    fun stop() {
+        worker?.cancel()
+        worker = null
+    }
+
+    /**
+     * Create a batch for the requests in file [inputFileId].  The file is validated by
+     * the worker, so this returns immediately with status "validating".
+     * @throws IllegalArgumentException if the parameters are invalid
+     */
+    fun create(
+        inputFileId: String,
+        endpoint: String,
+        completionWindow: String,
+        metadata: Map<String, Any>?
+    ): BatchJob {
+        require(endpoint in SUPPORTED_ENDPOINTS) {
+            "Unsupported endpoint '$endpoint'. Supported: ${SUPPORTED_ENDPOINTS.joinToString()}"
+        }
+        require(completionWindow == COMPLETION_WINDOW_24H) {
+            "Unsupported completion_window '$completionWindow'. Only '24h' is supported"
+        }
+        val inputFile = fileStore.get(inputFileId)
+            ?: throw IllegalArgumentException("Input file not found: $inputFileId")
+        require(inputFile.purpose == FileStore.PURPOSE_BATCH) {
+            "Input file $inputFileId must have purpose 'batch'"
+        }
+
+        val now = nowSeconds()
+        val job = BatchJob(
+            id = ID_PREFIX + UUID.randomUUID().toString().replace("-", "").take(24),
+            endpoint = endpoint,
+            inputFileId = inputFileId,
+            completionWindow = completionWindow,
+            createdAt = now,
+            expiresAt = now + COMPLETION_WINDOW_SECONDS,
+            metadata = metadata,
+            status = STATUS_VALIDATING
+        )
+        synchronized(lock) {
+            jobs[job.id] = job
+            save(job)
+        }
+        wakeups.trySend(Unit)
+        LogManager.i(TAG, "Created batch ${job.id} for file $inputFileId")
+        return job.copy()
+    }
+
+    fun get(id: String): BatchJob? = synchronized(lock) { jobs[id]?.copy() }
+
+    /**
+     * Batches newest first, starting after batch [after] (cursor pagination).
+     */
+    fun list(after: String? = null, limit: Int = 20): Page {
+        val sorted = synchronized(lock) {
+            jobs.values.sortedByDescending { it.createdAt }.map { it.copy() }
+        }
+        val start = if (after != null) {
+            val index = sorted.indexOfFirst { it.id == after }
+            if (index < 0) sorted.size else index + 1
+        } else {
+            0
+        }
+        val page = sorted.drop(start).take(limit + 1)
+        return Page(page.take(limit), page.size > limit)
+    }
+
+    /**
+     * Request cancellation of batch [id].  Requests already completed are kept and
+     * written to the output file.  Batches that already finished are returned unchanged.
+     * @return The updated batch, or null if it does not exist
+     */
+    fun cancel(id: String): BatchJob? {
+        val job = synchronized(lock) {
+            val job = jobs[id] ?: return null
+            if (job.status == STATUS_VALIDATING || job.status == STATUS_IN_PROGRESS) {
+                job.status = STATUS_CANCELLING
+                job.cancellingAt = nowSeconds()
+                save(job)
+            }
+            job.copy()
+        }
+        wakeups.trySend(Unit)
+        LogManager.i(TAG, "Cancel requested for batch $id (status: ${job.status})")
+        return job
+    }
+
+    private suspend fun runWorker() {
+        while (scope.isActive) {
+            val job = nextRunnableJob()
+            if (job == null) {
+                withTimeoutOrNull(IDLE_POLL_MS) { wakeups.receive() }
+                continue
+            }
+            try {
+                process(job)
+            } catch (e: CancellationException) {
+                throw e
+            } catch (e: Exception) {
+                LogManager.e(TAG, "Batch ${job.id} failed", e)
+                synchronized(lock) {
+                    job.status = STATUS_FAILED
+                    job.failedAt = nowSeconds()
+                    job.errors = listOf(mapOf("code" to "internal_error", "message" to (e.message ?: "Batch failed")))
+                    save(job)
+                }
+            }
+        }
+    }
+
+    // Oldest unfinished batch first
+    private fun nextRunnableJob(): BatchJob? = synchronized(lock) {
+        jobs.values
+            .filter {
+                it.status == STATUS_VALIDATING || it.status == STATUS_IN_PROGRESS ||
+                    it.status == STATUS_CANCELLING || it.status == STATUS_FINALIZING
+            }
+            .minByOrNull { it.createdAt }
+    }
+
+    private suspend fun process(job: BatchJob) {
+        // Interrupted while finalizing: the result files are partly moved already
+        if (job.status == STATUS_FINALIZING) {
+            finish(job, job.pendingStatus ?: STATUS_COMPLETED)
+            return
+        }
+        if (job.status == STATUS_VALIDATING && !validate(job)) return
+
+        val input = fileStore.contentFile(job.inputFileId)
+        if (input == null) {
+            synchronized(lock) {
+                job.status = STATUS_FAILED
+                job.failedAt = nowSeconds()
+                job.errors = listOf(mapOf("code" to "missing_file", "message" to "Input file ${job.inputFileId} was deleted"))
+                save(job)
+            }
+            return
+        }
+
+        val outputFile = File(dir, job.id + OUTPUT_SUFFIX)
+        val errorFile = File(dir, job.id + ERRORS_SUFFIX)
+        // Checkpoint: every finished request has exactly one line in one of the two files
+        synchronized(lock) {
+            job.completed = countLines(outputFile)
+            job.failed = countLines(errorFile)
+            save(job)
+        }
+        var skip = job.completed + job.failed
+        if (skip > 0) {
+            LogManager.i(TAG, "Resuming batch ${job.id} after $skip request(s)")
+        }
+
+        input.bufferedReader().use { reader ->
+            while (true) {
+                val line = reader.readLine() ?: break
+                if (line.isBlank()) continue
+                if (skip > 0) {
+                    skip--
+                    continue
+                }
+
+                val request = gson.fromJson(line, JsonObject::class.java)
+                val customId = request.get("custom_id").asString
+                val permits = awaitIdleSlot(job, request.getAsJsonObject("body")) ?: return
+                val resultLine = try {
+                    val body = execute(job.endpoint, request.getAsJsonObject("body"))
+                    mapOf(
+                        "id" to newRequestId(),
+                        "custom_id" to customId,
+                        "response" to mapOf(
+                            "status_code" to 200,
+                            "request_id" to newRequestId(),
+                            "body" to body
+                        )
+                    )
+                } catch (e: Exception) {
+                    LogManager.w(TAG, "Batch ${job.id} request $customId failed: ${e.message}")
+                    mapOf(
+                        "id" to newRequestId(),
+                        "custom_id" to customId,
+                        "error" to mapOf(
+                            "code" to if (e is IllegalArgumentException) "invalid_request" else "server_error",
+                            "message" to (e.message ?: "Request failed")
+                        )
+                    )
+                } finally {
+                    permits.release()
+                }
+
+                val succeeded = !resultLine.containsKey("error")
+                (if (succeeded) outputFile else errorFile).appendText(gson.toJson(resultLine) + "\n")
+                synchronized(lock) {
+                    if (succeeded) job.completed++ else job.failed++
+                    save(job)
+                }
+            }
+        }
+
+        finish(job, STATUS_COMPLETED)
+    }
+
+    /**
+     * Check every line of the input file before running anything, as OpenAI does.
+     * @return True if the batch can run
+     */
+    private fun validate(job: BatchJob): Boolean {
+        val input = fileStore.contentFile(job.inputFileId)
+        val errors = mutableListOf<Map<String, Any>>()
+        val customIds = HashSet<String>()
+        var total = 0
+
+        fun error(lineNumber: Int, code: String, message: String) {
+            if (errors.size < MAX_REPORTED_ERRORS) {
+                errors.add(mapOf("code" to code, "message" to message, "line" to lineNumber))
+            }
+        }
+
+        if (input == null) {
+            errors.add(mapOf("code" to "missing_file", "message" to "Input file ${job.inputFileId} not found"))
+        } else {
+            input.bufferedReader().useLines { lines ->
+                lines.forEachIndexed { index, line ->
+                    if (line.isBlank()) return@forEachIndexed
+                    val lineNumber = index + 1
+                    total++
+                    val request = try {
+                        gson.fromJson(line, JsonObject::class.java)
+                    } catch (e: Exception) {
+                        null
+                    }
+                    if (request == null) {
+                        error(lineNumber, "invalid_json", "Line is not a JSON object")
+                        return@forEachIndexed
+                    }
+                    val customId = request.get("custom_id")?.takeIf { it.isJsonPrimitive }?.asString
+                    when {
+                        customId.isNullOrEmpty() ->
+                            error(lineNumber, "missing_required_parameter", "custom_id is required")
+                        !customIds.add(customId) ->
+                            error(lineNumber, "duplicate_custom_id", "Duplicate custom_id '$customId'")
+                    }
+                    if (request.get("method")?.takeIf { it.isJsonPrimitive }?.asString != "POST") {
+                        error(lineNumber, "invalid_method", "method must be POST")
+                    }
+                    if (request.get("url")?.takeIf { it.isJsonPrimitive }?.asString != job.endpoint) {
+                        error(lineNumber, "mismatched_url", "url must match the batch endpoint ${job.endpoint}")
+                    }
+                    if (request.get("body")?.isJsonObject != true) {
+                        error(lineNumber, "missing_required_parameter", "body must be a JSON object")
+                    }
+                }
+            }
+            if (total == 0) {
+                errors.add(mapOf("code" to "empty_file", "message" to "Input file contains no requests"))
+            } else if (total > MAX_REQUESTS_PER_BATCH) {
+                errors.add(mapOf("code" to "too_many_requests", "message" to "A batch may contain at most $MAX_REQUESTS_PER_BATCH requests"))
+            }
+        }
+
+        synchronized(lock) {
+            if (errors.isNotEmpty()) {
+                job.status = STATUS_FAILED
+                job.failedAt = nowSeconds()
+                job.errors = errors
+            } else {
+                job.total = total
+                if (job.status == STATUS_VALIDATING) {
+                    job.status = STATUS_IN_PROGRESS
+                    job.inProgressAt = nowSeconds()
+                }
+            }
+            save(job)
+        }
+        LogManager.i(TAG, "Validated batch ${job.id}: $total request(s), ${errors.size} error(s)")
+        return errors.isEmpty()
+    }
+
+    /**
+     * Wait until the request with [body] could run without delaying interactive traffic,
+     * then take a permit.  Finishes the batch and returns null if it is cancelled or
+     * expires meanwhile.
+     */
+    private suspend fun awaitIdleSlot(job: BatchJob, body: JsonObject): Semaphore? {
+        while (true) {
+            val status = synchronized(lock) { job.status }
+            if (status == STATUS_CANCELLING) {
+                finish(job, STATUS_CANCELLED)
+                return null
+            }
+            if (nowSeconds() >= job.expiresAt) {
+                finish(job, STATUS_EXPIRED)
+                return null
+            }
+
+            val permits = semaphore()
+            if (!permits.hasQueuedThreads() && isIdle(body) && permits.tryAcquire()) {
+                return permits
+            }
+            delay(SLOT_POLL_MS)
+        }
+    }
+
+    /**
+     * Move the result files into [FileStore] and put the batch in its final [status].
+     */
+    private fun finish(job: BatchJob, status: String) {
+        synchronized(lock) {
+            job.status = STATUS_FINALIZING
+            job.pendingStatus = status
+            if (job.finalizingAt == null) job.finalizingAt = nowSeconds()
+            save(job)
+        }
+
+        // Each moved file is recorded immediately so a restart does not move it twice
+        val outputFile = File(dir, job.id + OUTPUT_SUFFIX)
+        if (job.outputFileId == null && outputFile.length() > 0) {
+            val id = fileStore.createFrom(outputFile, "${job.id}_output.jsonl", FileStore.PURPOSE_BATCH_OUTPUT).id
+            synchronized(lock) {
+                job.outputFileId = id
+                save(job)
+            }
+        }
+        val errorFile = File(dir, job.id + ERRORS_SUFFIX)
+        if (job.errorFileId == null && errorFile.length() > 0) {
+            val id = fileStore.createFrom(errorFile, "${job.id}_error.jsonl", FileStore.PURPOSE_BATCH_OUTPUT).id
+            synchronized(lock) {
+                job.errorFileId = id
+                save(job)
+            }
+        }
+        outputFile.delete()
+        errorFile.delete()
+
+        val now = nowSeconds()
+        synchronized(lock) {
+            job.pendingStatus = null
+            job.status = status
+            when (status) {
+                STATUS_COMPLETED -> job.completedAt = now
+                STATUS_CANCELLED -> job.cancelledAt = now
+                STATUS_EXPIRED -> job.expiredAt = now
+            }
+            save(job)
+        }
+        LogManager.i(TAG, "Batch ${job.id} $status: ${job.completed} completed, ${job.failed} failed")
+    }
+
+    private fun loadJobs() {
+        jobs.clear()
+        val files = dir.listFiles { file ->
+            file.name.startsWith(ID_PREFIX) && file.name.endsWith(".json")
+        } ?: return
+        for (file in files) {
+            try {
+                val job = gson.fromJson(file.readText(), BatchJob::class.java) ?: continue
+                jobs[job.id] = job
+            } catch (e: Exception) {
+                LogManager.w(TAG, "Skipping unreadable batch file ${file.name}: ${e.message}")
+            }
+        }
+    }
+
+    // Must be called with [lock] held
+    private fun save(job: BatchJob) {
+        if (!dir.exists()) dir.mkdirs()
+        val tmp = File(dir, "${job.id}.json.tmp")
+        tmp.writeText(gson.toJson(job))
+        if (!tmp.renameTo(File(dir, "${job.id}.json"))) {
+            LogManager.w(TAG, "Failed to save state for batch ${job.id}")
+        }
+    }
+
+    private fun countLines(file: File): Int {
+        if (!file.exists()) return 0
+        return file.bufferedReader().useLines { lines -> lines.count { it.isNotBlank() } }
+    }
+
+    private fun newRequestId(): String = "batch_req_" + UUID.randomUUID().toString().replace("-", "").take(24)
+
+    private fun nowSeconds(): Long = System.currentTimeMillis() / 1000
+}
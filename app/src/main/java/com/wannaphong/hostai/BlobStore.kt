@@ -0,0 +1,228 @@
+package com.wannaphong.hostai
+
+import android.content.Context
+import android.util.Base64
+import com.google.gson.Gson
+import com.google.gson.GsonBuilder
+import com.google.gson.JsonArray
+import com.google.gson.JsonElement
+import com.google.gson.JsonObject
+import java.io.File
+import java.security.MessageDigest
+
+/**
+ * Content-addressed store for media (images, audio) found in logged requests and
+ * stored completions.
+ *
+ * Base64 payloads are decoded, hashed with SHA-256 and written once to
+ * `files/blobs/<aa>/<hash>`; identical media sent many times is stored once.  In the
+ * JSON that is kept by the logging and storage features the payload is replaced with
+ * a reference, keeping any data-URL header intact:
+ *
+ *   "data:image/png;base64,iVBOR..."  ->  "data:image/png;base64,hostai-blob:sha256:<hash>"
+ *   "UklGRi..." (input_audio.data)    ->  "hostai-blob:sha256:<hash>"
+ *
+ * [rehydrate] reverses the substitution on demand when a stored item is retrieved.
+ * Singleton so the app and the server share one store.
+ */
+class BlobStore private constructor(context: Context) {
+    private val dir = File(context.filesDir, BLOBS_DIR_NAME)
+    private val gson: Gson = GsonBuilder().disableHtmlEscaping().create()
+
+    companion object {
+        private const val TAG = "BlobStore"
+        private const val BLOBS_DIR_NAME = "blobs"
+        const val REF_PREFIX = "hostai-blob:sha256:"
+        private const val BASE64_MARKER = ";base64,"
+        // Media smaller than this stays inline; a reference would not save anything.
+        private const val MIN_OFFLOAD_CHARS = 1024
+        // Matches the request log retention window
+        const val DEFAULT_MAX_AGE_MS = 90L * 24L * 60L * 60L * 1000L
+        const val DEFAULT_MAX_TOTAL_BYTES = 256L * 1024L * 1024L
+
+        @Volatile
+        private var instance: BlobStore? = null
+
+        fun getInstance(context: Context): BlobStore {
+            return instance ?: synchronized(this) {
+                instance ?: BlobStore(context.applicationContext).also { instance = it }
+            }
+        }
+    }
+
+    /**
+     * Store [bytes] and return their SHA-256 hex digest.  If the blob already exists
+     * only its modification time is refreshed (used by [sweep]).
+     */
+    fun put(bytes: ByteArray): String {
+        val hash = sha256Hex(bytes)
+        val file = fileFor(hash)
+        if (file.exists()) {
+            file.setLastModified(System.currentTimeMillis())
+            return hash
+        }
+        file.parentFile?.mkdirs()
+        val tmp = File(file.parentFile, "$hash.tmp")
+        tmp.writeBytes(bytes)
+        if (!tmp.renameTo(file)) {
+            // Another thread stored the same blob concurrently
+            tmp.delete()
+        }
+        return hash
+    }
+
+    /**
+     * Read a blob by hash, or null if it is missing (e.g. removed by [sweep]).
+     */
+    fun get(hash: String): ByteArray? {
+        if (!isValidHash(hash)) return null
+        val file = fileFor(hash)
+        return if (file.exists()) file.readBytes() else null
+    }
+
+    /**
+     * Return [requestJson] with media payloads in `messages` replaced by blob
+     * references.  Bodies without base64 media are returned unchanged without parsing.
+     */
+    fun offloadRequestJson(requestJson: String): String {
+        if (requestJson.length < MIN_OFFLOAD_CHARS ||
+            (!requestJson.contains(BASE64_MARKER) && !requestJson.contains("\"input_audio\""))) {
+            return requestJson
+        }
+        return try {
+            val request = gson.fromJson(requestJson, JsonObject::class.java) ?: return requestJson
+            val messages = request.get("messages")
+            if (messages == null || !messages.isJsonArray) return requestJson
+            request.add("messages", offloadMessages(messages.asJsonArray))
+            gson.toJson(request)
+        } catch (e: Exception) {
+            LogManager.w(TAG, "Could not offload media from request body: ${e.message}")
+            requestJson
+        }
+    }
+
+    /**
+     * Return a copy of OpenAI-format [messages] with `image_url.url` data URLs and
+     * `input_audio.data` payloads replaced by blob references.
+     */
+    fun offloadMessages(messages: JsonArray): JsonArray {
+        val copy = messages.deepCopy()
+        for (message in copy) {
+            if (!message.isJsonObject) continue
+            val content = message.asJsonObject.get("content")
+            if (content == null || !content.isJsonArray) continue
+            for (part in content.asJsonArray) {
+                if (!part.isJsonObject) continue
+                val partObj = part.asJsonObject
+                when (partObj.get("type")?.takeIf { it.isJsonPrimitive }?.asString) {
+                    "image_url" -> offloadField(partObj.get("image_url"), "url")
+                    "input_audio" -> offloadField(partObj.get("input_audio"), "data")
+                }
+            }
+        }
+        return copy
+    }
+
+    /**
+     * Recursively replace blob references in a Gson-parsed structure (Map / List /
+     * String) with the original base64 payloads.  Missing blobs are left as references.
+     */
+    fun rehydrate(value: Any?): Any? {
+        return when (value) {
+            is String -> rehydrateString(value)
+            is Map<*, *> -> value.entries.associate { (k, v) -> k to rehydrate(v) }
+            is List<*> -> value.map { rehydrate(it) }
+            else -> value
+        }
+    }
+
+    /**
+     * Delete blobs not written or referenced for [maxAgeMs], then the least recently
+     * used blobs while the store exceeds [maxTotalBytes].  Blobs whose hash is in
+     * [pinned] (still referenced by a stored completion) are never deleted.  Temp
+     * files left by interrupted writes are deleted once older than [maxAgeMs].
+     * @return Number of blobs deleted
+     */
+    fun sweep(
+        maxAgeMs: Long = DEFAULT_MAX_AGE_MS,
+        maxTotalBytes: Long = DEFAULT_MAX_TOTAL_BYTES,
+        pinned: Set<String> = emptySet()
+    ): Int {
+        val files = dir.walkTopDown().filter { it.isFile && it.name !in pinned }.toMutableList()
+        val cutoff = System.currentTimeMillis() - maxAgeMs
+        var deleted = 0
+
+        files.removeAll { file ->
+            val expired = file.lastModified() < cutoff
+            if (expired && file.delete()) deleted++
+            // A newer temp file may belong to a put() still in progress: leave it alone,
+            // including in the size pass below; it expires with the same cutoff
+            expired || file.name.endsWith(".tmp")
+        }
+
+        var total = files.sumOf { it.length() }
+        if (total > maxTotalBytes) {
+            for (file in files.sortedBy { it.lastModified() }) {
+                if (total <= maxTotalBytes) break
+                val size = file.length()
+                if (file.delete()) {
+                    total -= size
+                    deleted++
+                }
+            }
+        }
+
+        if (deleted > 0) {
+            LogManager.i(TAG, "Swept $deleted blob(s)")
+        }
+        return deleted
+    }
+
+    private fun offloadField(container: JsonElement?, field: String) {
+        if (container == null || !container.isJsonObject) return
+        val obj = container.asJsonObject
+        val element = obj.get(field) ?: return
+        if (!element.isJsonPrimitive || !element.asJsonPrimitive.isString) return
+        val value = element.asString
+        if (value.length < MIN_OFFLOAD_CHARS || value.contains(REF_PREFIX)) return
+
+        val header: String
+        val payload: String
+        if (value.startsWith("data:")) {
+            val markerIndex = value.indexOf(BASE64_MARKER)
+            if (markerIndex < 0) return
+            header = value.substring(0, markerIndex + BASE64_MARKER.length)
+            payload = value.substring(markerIndex + BASE64_MARKER.length)
+        } else {
+            header = ""
+            payload = value
+        }
+
+        try {
+            val hash = put(Base64.decode(payload, Base64.DEFAULT))
+            obj.addProperty(field, "$header$REF_PREFIX$hash")
+        } catch (e: Exception) {
+            // Not valid base64 (or disk error); keep the original value inline
+            LogManager.w(TAG, "Keeping media inline: ${e.message}")
+        }
+    }
+
+    private fun rehydrateString(value: String): String {
+        val refIndex = value.indexOf(REF_PREFIX)
+        if (refIndex < 0) return value
+        val hash = value.substring(refIndex + REF_PREFIX.length)
+        val bytes = get(hash) ?: return value
+        return value.substring(0, refIndex) + Base64.encodeToString(bytes, Base64.NO_WRAP)
+    }
+
+    private fun fileFor(hash: String): File = File(File(dir, hash.substring(0, 2)), hash)
+
+    private fun isValidHash(hash: String): Boolean {
+        return hash.length == 64 && hash.all { it in '0'..'9' || it in 'a'..'f' }
+    }
+
+    private fun sha256Hex(bytes: ByteArray): String {
+        val digest = MessageDigest.getInstance("SHA-256").digest(bytes)
+        return digest.joinToString("") { "%02x".format(it) }
+    }
+}
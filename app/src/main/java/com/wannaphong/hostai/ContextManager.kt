@@ -0,0 +1,336 @@
+package com.wannaphong.hostai
+
+import android.util.LruCache
+import com.google.ai.edge.litertlm.Content
+import com.google.gson.JsonArray
+import com.google.gson.JsonElement
+import com.google.gson.JsonObject
+import java.security.MessageDigest
+import java.util.concurrent.atomic.AtomicLong
+
+/**
+ * Thrown when a request does not fit in the model's context window even after the
+ * context policy has removed everything it may (the system prompt and the last turn
+ * are always kept).  Reported to clients as 400 context_length_exceeded.
+ */
+class ContextLengthExceededException(message: String) : IllegalArgumentException(message)
+
+/**
+ * Fits a chat history into the model's context window before it is turned into a
+ * prompt, so that long conversations get a shorter prompt (and a faster prefill)
+ * instead of an engine error.
+ *
+ * The room for the prompt is the context length minus the tokens reserved for the
+ * completion (max_tokens, at most half the context) and for any instruction the
+ * server adds.  When the messages need more, whole turns (a user message with the
+ * assistant and tool messages that answer it) are removed according to [Policy].
+ * System and developer messages and the last turn are always kept.
+ *
+ * LiteRT-LM does not expose its tokenizer, so tokens are counted with
+ * [estimateTokens], which errs on the high side for SentencePiece vocabularies:
+ * a prompt it accepts fits, at the cost of sometimes removing a turn that would
+ * have fitted.
+ *
+ * Thread-safe.
+ */
+class ContextManager {
+
+    /** What to do with the turns that do not fit. */
+    enum class Policy(val value: String) {
+        /** Remove the oldest turns until the rest fits. */
+        DROP_OLDEST("drop_oldest"),
+        /** Keep at most the last [SLIDING_WINDOW_TURNS] turns, and fewer if they do not fit. */
+        SLIDING_WINDOW("sliding_window"),
+        /** Remove the oldest turns and replace them with a summary written by the model. */
+        SUMMARIZE("summarize");
+
+        companion object {
+            fun fromValue(value: String?): Policy = values().firstOrNull { it.value == value } ?: DROP_OLDEST
+        }
+    }
+
+    /**
+     * Result of [fit].
+     * @property messages The messages to build the prompt from ([fit]'s input if nothing was removed)
+     * @property promptTokens Estimated tokens of [messages]
+     * @property droppedMessages Number of messages removed (summarized ones included)
+     * @property summarized Whether a summary replaces the removed messages
+     */
+    data class Result(
+        val messages: JsonArray,
+        val promptTokens: Int,
+        val droppedMessages: Int,
+        val summarized: Boolean
+    )
+
+    /** Counters for /metrics. */
+    data class Snapshot(
+        val requests: Long,
+        val truncatedRequests: Long,
+        val droppedMessages: Long,
+        val summaries: Long,
+        val summaryCacheHits: Long,
+        val rejectedRequests: Long
+    )
+
+    // Summaries by digest of the messages they replace, so that the following turns of
+    // a conversation do not summarize the same history again
+    private val summaryCache = LruCache<String, String>(SUMMARY_CACHE_SIZE)
+    private val requests = AtomicLong(0)
+    private val truncatedRequests = AtomicLong(0)
+    private val droppedMessages = AtomicLong(0)
+    private val summaries = AtomicLong(0)
+    private val summaryCacheHits = AtomicLong(0)
+    private val rejectedRequests = AtomicLong(0)
+
+    companion object {
+        private const val TAG = "ContextManager"
+
+        /** Turns kept by [Policy.SLIDING_WINDOW]. */
+        const val SLIDING_WINDOW_TURNS = 8
+        /** Largest summary written by [Policy.SUMMARIZE]. */
+        const val SUMMARY_MAX_TOKENS = 256
+        private const val SUMMARY_CACHE_SIZE = 32
+        private const val SUMMARY_PREFIX = "Summary of the earlier conversation: "
+
+        // Role prefix and newline the prompt adds around each message
+        private const val MESSAGE_OVERHEAD_TOKENS = 4
+        // ASCII text: SentencePiece vocabularies average about 4 characters per token; 3 errs high
+        private const val ASCII_CHARS_PER_TOKEN = 3
+        // Gemma 3n encodes an image as 256 soft tokens
+        private const val IMAGE_TOKENS = 256
+        // Audio: about 6.25 tokens per second; 16 kHz 16-bit mono is 32000 bytes per second
+        private const val AUDIO_BYTES_PER_TOKEN = 5120
+        private const val MIN_AUDIO_TOKENS = 64
+
+        /**
+         * Estimated token count of [text]: ASCII characters at [ASCII_CHARS_PER_TOKEN]
+         * per token, any other character (Thai, CJK, emoji) one token each.
+         */
+        fun estimateTokens(text: String): Int {
+            var ascii = 0
+            var other = 0
+            for (c in text) {
+                if (c.code < 0x80) ascii++ else if (!c.isLowSurrogate()) other++
+            }
+            return (ascii + ASCII_CHARS_PER_TOKEN - 1) / ASCII_CHARS_PER_TOKEN + other
+        }
+
+        /** Estimated tokens of one chat message, including media parts. */
+        fun estimateMessageTokens(message: JsonElement): Int {
+            val obj = message.takeIf { it.isJsonObject }?.asJsonObject ?: return MESSAGE_OVERHEAD_TOKENS
+            val content = obj.get("content")
+            val contentTokens = when {
+                content == null || content.isJsonNull -> 0
+                content.isJsonPrimitive -> estimateTokens(content.asString)
+                content.isJsonArray -> content.asJsonArray.sumOf { estimatePartTokens(it) }
+                else -> estimateTokens(content.toString())
+            }
+            return MESSAGE_OVERHEAD_TOKENS + estimateTokens(role(obj)) + contentTokens
+        }
+
+        /**
+         * Estimated tokens of contents built for a multimodal request.  Audio length is
+         * not visible here, so each clip counts as [MIN_AUDIO_TOKENS].
+         */
+        fun estimateContentTokens(contents: List<Content>): Int = contents.sumOf { content ->
+            when (content) {
+                is Content.Text -> estimateTokens(content.toString())
+                is Content.ImageBytes -> IMAGE_TOKENS
+                is Content.AudioBytes -> MIN_AUDIO_TOKENS
+                else -> 0
+            }
+        }
+
+        /** Whether [contents] include an image or audio clip, i.e. need the encoders. */
+        fun isMultimodal(contents: List<Content>): Boolean = contents.any { it !is Content.Text }
+
+        private fun estimatePartTokens(part: JsonElement): Int {
+            val obj = part.takeIf { it.isJsonObject }?.asJsonObject ?: return 0
+            return when (obj.get("type")?.takeIf { it.isJsonPrimitive }?.asString) {
+                "text" -> estimateTokens(obj.get("text")?.takeIf { it.isJsonPrimitive }?.asString ?: "")
+                "image_url" -> IMAGE_TOKENS
+                "input_audio" -> {
+                    val data = obj.getAsJsonObject("input_audio")?.get("data")?.takeIf { it.isJsonPrimitive }?.asString
+                    // Base64: 4 characters per 3 bytes
+                    val bytes = (data?.length ?: 0) / 4L * 3L
+                    maxOf(MIN_AUDIO_TOKENS, (bytes / AUDIO_BYTES_PER_TOKEN).toInt())
+                }
+                else -> 0
+            }
+        }
+
+        private fun role(message: JsonObject): String =
+            message.get("role")?.takeIf { it.isJsonPrimitive }?.asString ?: ""
+
+        private fun isSystem(message: JsonElement): Boolean {
+            val role = message.takeIf { it.isJsonObject }?.let { role(it.asJsonObject) }
+            return role == "system" || role == "developer"
+        }
+    }
+
+    /**
+     * Fit [messages] into [contextLength] tokens, leaving room for [maxTokens] of
+     * completion and [reservedTokens] of server-added instructions.
+     * @param summarize Writes a summary of the given transcript in at most
+     *   [SUMMARY_MAX_TOKENS] tokens, or returns null on failure (the removed turns
+     *   are then dropped without a summary).  Only called for [Policy.SUMMARIZE].
+     * @throws ContextLengthExceededException if the system messages and the last turn
+     *   alone do not fit
+     */
+    fun fit(
+        messages: JsonArray,
+        contextLength: Int,
+        maxTokens: Int,
+        reservedTokens: Int,
+        policy: Policy,
+        summarize: (String) -> String?
+    ): Result {
+        requests.incrementAndGet()
+        val completionTokens = maxTokens.coerceIn(0, contextLength / 2)
+        val budget = contextLength - completionTokens - reservedTokens
+        val tokens = messages.map { estimateMessageTokens(it) }
+        val total = tokens.sum()
+
+        // Turns: indices of the non-system messages, split before each user message
+        val turns = ArrayList<MutableList<Int>>()
+        messages.forEachIndexed { index, message ->
+            if (isSystem(message)) return@forEachIndexed
+            val isUser = message.isJsonObject && role(message.asJsonObject) == "user"
+            if (isUser || turns.isEmpty()) turns.add(mutableListOf())
+            turns.last().add(index)
+        }
+
+        val overWindow = policy == Policy.SLIDING_WINDOW && turns.size > SLIDING_WINDOW_TURNS
+        if (total <= budget && !overWindow) {
+            return Result(messages, total, 0, false)
+        }
+
+        // A summary takes room from the turns that are kept
+        val keptBudget = if (policy == Policy.SUMMARIZE) budget - SUMMARY_MAX_TOKENS - MESSAGE_OVERHEAD_TOKENS else budget
+        var keptTokens = total
+        var dropTurns = if (overWindow) turns.size - SLIDING_WINDOW_TURNS else 0
+        for (i in 0 until dropTurns) keptTokens -= turns[i].sumOf { tokens[it] }
+        while (keptTokens > keptBudget && dropTurns < turns.size - 1) {
+            keptTokens -= turns[dropTurns].sumOf { tokens[it] }
+            dropTurns++
+        }
+        if (keptTokens > keptBudget) {
+            rejectedRequests.incrementAndGet()
+            throw ContextLengthExceededException(
+                "This model's maximum context length is $contextLength tokens. However, your messages " +
+                    "need about ${keptTokens + reservedTokens} tokens without the earlier turns, with " +
+                    "$completionTokens more reserved for the completion. Please reduce the length of the " +
+                    "system prompt or the last message, or max_tokens."
+            )
+        }
+
+        val dropped = turns.take(dropTurns).flatten().toSet()
+        val summary = if (policy == Policy.SUMMARIZE && dropped.isNotEmpty()) {
+            summaryFor(messages, dropped, contextLength, summarize)
+        } else {
+            null
+        }
+
+        // The summary goes where the first removed turn was, after the system messages before it
+        val summaryMessage = summary?.let { summaryMessage(it) }
+        val firstDropped = dropped.minOrNull()
+        val fitted = JsonArray()
+        messages.forEachIndexed { index, message ->
+            if (summaryMessage != null && index == firstDropped) fitted.add(summaryMessage)
+            if (index !in dropped) fitted.add(message)
+        }
+        if (summaryMessage != null) {
+            keptTokens += estimateMessageTokens(summaryMessage)
+        }
+
+        truncatedRequests.incrementAndGet()
+        droppedMessages.addAndGet(dropped.size.toLong())
+        LogManager.i(TAG, "Context: removed ${dropped.size} of ${messages.size()} message(s) (${policy.value}" +
+            "${if (summary != null) ", summarized" else ""}); about $keptTokens of $budget prompt tokens")
+        return Result(fitted, keptTokens, dropped.size, summary != null)
+    }
+
+    fun snapshot(): Snapshot = Snapshot(
+        requests = requests.get(),
+        truncatedRequests = truncatedRequests.get(),
+        droppedMessages = droppedMessages.get(),
+        summaries = summaries.get(),
+        summaryCacheHits = summaryCacheHits.get(),
+        rejectedRequests = rejectedRequests.get()
+    )
+
+    private fun summaryMessage(summary: String): JsonObject = JsonObject().apply {
+        addProperty("role", "system")
+        addProperty("content", SUMMARY_PREFIX + summary)
+    }
+
+    /**
+     * Summary of the messages at [dropped] indices, from the cache or [summarize].
+     * The transcript given to the model is cut to its most recent part if it would
+     * not fit in the context with the summary.
+     */
+    private fun summaryFor(
+        messages: JsonArray,
+        dropped: Set<Int>,
+        contextLength: Int,
+        summarize: (String) -> String?
+    ): String? {
+        val lines = dropped.sorted().map { index ->
+            val message = messages[index].asJsonObject
+            val content = message.get("content")
+            val text = when {
+                content == null || content.isJsonNull -> ""
+                content.isJsonPrimitive -> content.asString
+                content.isJsonArray -> content.asJsonArray.joinToString(" ") { part ->
+                    val obj = part.takeIf { it.isJsonObject }?.asJsonObject
+                    when (obj?.get("type")?.takeIf { it.isJsonPrimitive }?.asString) {
+                        "text" -> obj.get("text")?.takeIf { it.isJsonPrimitive }?.asString ?: ""
+                        "image_url" -> "[image]"
+                        "input_audio" -> "[audio]"
+                        else -> ""
+                    }
+                }
+                else -> content.toString()
+            }
+            "${role(message)}: $text"
+        }
+
+        val key = digest(lines)
+        summaryCache.get(key)?.let {
+            summaryCacheHits.incrementAndGet()
+            return it
+        }
+
+        // Newest lines first until the transcript would leave no room for the summary
+        val transcriptBudget = contextLength - SUMMARY_MAX_TOKENS * 2
+        val kept = ArrayDeque<String>()
+        var used = 0
+        for (line in lines.asReversed()) {
+            val cost = estimateTokens(line) + 1
+            if (used + cost > transcriptBudget) break
+            kept.addFirst(line)
+            used += cost
+        }
+        if (kept.isEmpty()) return null
+
+        val summary = try {
+            summarize(kept.joinToString("\n"))?.trim()?.takeIf { it.isNotEmpty() }
+        } catch (e: Exception) {
+            LogManager.w(TAG, "Summarizing earlier turns failed: ${e.message}")
+            null
+        } ?: return null
+        summaries.incrementAndGet()
+        summaryCache.put(key, summary)
+        return summary
+    }
+
+    private fun digest(lines: List<String>): String {
+        val md = MessageDigest.getInstance("SHA-256")
+        for (line in lines) {
+            md.update(line.toByteArray(Charsets.UTF_8))
+            md.update(0)
+        }
+        return md.digest().joinToString("") { "%02x".format(it) }
+    }
+}
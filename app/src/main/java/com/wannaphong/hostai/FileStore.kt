@@ -0,0 +1,158 @@
+package com.wannaphong.hostai
+
+import android.content.Context
+import com.google.gson.Gson
+import java.io.File
+import java.io.IOException
+import java.io.InputStream
+import java.util.UUID
+
+/**
+ * A file uploaded through (or produced for) the /v1/files endpoints.
+ * [createdAt] is in seconds, like the other OpenAI timestamps.
+ */
+data class ApiFile(
+    val id: String,
+    val bytes: Long,
+    val createdAt: Long,
+    val filename: String,
+    val purpose: String
+)
+
+/**
+ * On-disk store backing the /v1/files endpoints.
+ *
+ * Each file is kept as `files/api_files/<id>` with its [ApiFile] record next to it in
+ * `<id>.json`.  Uploads are written to a temporary file and renamed into place, so a
+ * file is either fully present or absent after a crash.  Used for batch input files
+ * and the output/error files that [BatchManager] produces.
+ *
+ * Thread-safe: record updates are synchronised; file contents are immutable once stored.
+ */
+class FileStore(context: Context) {
+    private val dir = File(context.filesDir, FILES_DIR_NAME)
+    private val gson = Gson()
+    private val lock = Any()
+
+    companion object {
+        private const val TAG = "FileStore"
+        private const val FILES_DIR_NAME = "api_files"
+        private const val RECORD_SUFFIX = ".json"
+        private const val ID_PREFIX = "file-"
+
+        const val PURPOSE_BATCH = "batch"
+        const val PURPOSE_BATCH_OUTPUT = "batch_output"
+    }
+
+    /**
+     * Store the contents of [input] as a new file.
+     * @return The stored file record
+     */
+    fun create(input: InputStream, filename: String, purpose: String): ApiFile {
+        ensureDir()
+        val id = newId()
+        val tmp = File(dir, "$id.tmp")
+        input.use { source -> tmp.outputStream().use { source.copyTo(it) } }
+        return commit(id, tmp, filename, purpose)
+    }
+
+    /**
+     * Move [source] into the store as a new file (used for batch results, which are
+     * written incrementally elsewhere).
+     * @return The stored file record
+     */
+    fun createFrom(source: File, filename: String, purpose: String): ApiFile {
+        ensureDir()
+        val id = newId()
+        val tmp = File(dir, "$id.tmp")
+        if (!source.renameTo(tmp)) {
+            source.copyTo(tmp, overwrite = true)
+            source.delete()
+        }
+        return commit(id, tmp, filename, purpose)
+    }
+
+    fun get(id: String): ApiFile? {
+        if (!isValidId(id)) return null
+        val record = File(dir, id + RECORD_SUFFIX)
+        if (!record.exists()) return null
+        return try {
+            gson.fromJson(record.readText(), ApiFile::class.java)
+        } catch (e: Exception) {
+            LogManager.w(TAG, "Unreadable file record $id: ${e.message}")
+            null
+        }
+    }
+
+    /**
+     * The contents of file [id], or null if it does not exist.
+     */
+    fun contentFile(id: String): File? {
+        if (get(id) == null) return null
+        val file = File(dir, id)
+        return if (file.exists()) file else null
+    }
+
+    /**
+     * All stored files, newest first, optionally restricted to one [purpose].
+     */
+    fun list(purpose: String? = null): List<ApiFile> {
+        val records = dir.listFiles { file -> file.name.endsWith(RECORD_SUFFIX) } ?: return emptyList()
+        return records
+            .mapNotNull { get(it.name.removeSuffix(RECORD_SUFFIX)) }
+            .filter { purpose == null || it.purpose == purpose }
+            .sortedByDescending { it.createdAt }
+    }
+
+    /**
+     * Delete file [id].
+     * @return True if the file existed
+     */
+    fun delete(id: String): Boolean {
+        if (!isValidId(id)) return false
+        synchronized(lock) {
+            val record = File(dir, id + RECORD_SUFFIX)
+            if (!record.exists()) return false
+            record.delete()
+            File(dir, id).delete()
+        }
+        LogManager.i(TAG, "Deleted file $id")
+        return true
+    }
+
+    private fun commit(id: String, tmp: File, filename: String, purpose: String): ApiFile {
+        val file = ApiFile(
+            id = id,
+            bytes = tmp.length(),
+            createdAt = System.currentTimeMillis() / 1000,
+            filename = filename,
+            purpose = purpose
+        )
+        synchronized(lock) {
+            if (!tmp.renameTo(File(dir, id))) {
+                tmp.delete()
+                throw IOException("Failed to store file $filename")
+            }
+            // The record is written last: a file without a record is never listed
+            val recordTmp = File(dir, "$id$RECORD_SUFFIX.tmp")
+            recordTmp.writeText(gson.toJson(file))
+            recordTmp.renameTo(File(dir, id + RECORD_SUFFIX))
+        }
+        LogManager.i(TAG, "Stored file $id ($filename, ${file.bytes} bytes, purpose=$purpose)")
+        return file
+    }
+
+    private fun ensureDir() {
+        if (!dir.exists() && !dir.mkdirs()) {
+            throw IOException("Cannot create ${dir.absolutePath}")
+        }
+    }
+
+    private fun newId(): String = ID_PREFIX + UUID.randomUUID().toString().replace("-", "").take(24)
+
+    // IDs are used as file names; reject anything that could escape the directory
+    private fun isValidId(id: String): Boolean {
+        return id.startsWith(ID_PREFIX) && id.length <= 64 &&
+            id.all { it.isLetterOrDigit() || it == '-' }
+    }
+}
@@ -0,0 +1,141 @@
+package com.wannaphong.hostai
+
+/**
+ * Running decode throughput figures for the loaded model.
+ *
+ * LiteRT streams output in chunks of roughly one token, so streamed generations
+ * are measured per chunk: time to first token covers prefill, and the chunks after
+ * it over the remaining time give the decode rate.  Blocking generations only have
+ * an end-to-end time and a word-based token estimate (the same estimate used for
+ * `usage`), so they contribute to the overall rate only.
+ *
+ * Thread-safe: all updates are synchronised.
+ */
+class GenerationStats {
+    private val lock = Any()
+    private var generations = 0L
+    private var streamedGenerations = 0L
+    private var outputTokens = 0L
+    private var totalMs = 0L
+    private var timeToFirstTokenMs = 0L
+    private var decodeTokens = 0L
+    private var decodeMs = 0L
+    private var lastDecodeTokensPerSecond = 0.0
+    private var lookupRequests = 0L
+    private var lookupOutputTokens = 0L
+    private var lookupDrafted = 0L
+    private var lookupAccepted = 0L
+
+    companion object {
+        private const val TAG = "GenerationStats"
+    }
+
+    /** Point-in-time copy of the counters, with derived rates. */
+    data class Snapshot(
+        val generations: Long,
+        val outputTokens: Long,
+        val tokensPerSecond: Double,
+        val decodeTokensPerSecond: Double,
+        val lastDecodeTokensPerSecond: Double,
+        val averageTimeToFirstTokenMs: Double,
+        val promptLookup: PromptLookupSnapshot
+    )
+
+    /**
+     * Totals of [PromptLookup.simulate] over requests that asked for prompt-lookup
+     * measurement.  [acceptanceRate] is the share of drafted tokens that matched.
+     */
+    data class PromptLookupSnapshot(
+        val requests: Long,
+        val outputTokens: Long,
+        val draftedTokens: Long,
+        val acceptedTokens: Long,
+        val acceptanceRate: Double
+    )
+
+    /**
+     * Record a blocking generation of [text] that took [elapsedMs].
+     */
+    fun recordBlocking(text: String, elapsedMs: Long) {
+        val tokens = text.split(" ").size.toLong()
+        synchronized(lock) {
+            generations++
+            outputTokens += tokens
+            totalMs += elapsedMs
+        }
+    }
+
+    /**
+     * Record a streamed generation of [chunks] chunks whose first chunk arrived
+     * [firstTokenMs] after the request and whose last arrived at [elapsedMs].
+     */
+    fun recordStream(chunks: Int, firstTokenMs: Long, elapsedMs: Long) {
+        if (chunks == 0) return
+        val decodeTime = elapsedMs - firstTokenMs
+        synchronized(lock) {
+            generations++
+            streamedGenerations++
+            outputTokens += chunks
+            totalMs += elapsedMs
+            timeToFirstTokenMs += firstTokenMs
+            if (chunks > 1 && decodeTime > 0) {
+                decodeTokens += chunks - 1
+                decodeMs += decodeTime
+                lastDecodeTokensPerSecond = (chunks - 1) * 1000.0 / decodeTime
+            }
+        }
+        LogManager.d(TAG) { "Streamed $chunks chunks: first after ${firstTokenMs}ms, total ${elapsedMs}ms" }
+    }
+
+    fun recordPromptLookup(result: PromptLookup.Result) {
+        synchronized(lock) {
+            lookupRequests++
+            lookupOutputTokens += result.outputTokens
+            lookupDrafted += result.drafted
+            lookupAccepted += result.accepted
+        }
+    }
+
+    fun snapshot(): Snapshot {
+        synchronized(lock) {
+            return Snapshot(
+                generations = generations,
+                outputTokens = outputTokens,
+                tokensPerSecond = rate(outputTokens, totalMs),
+                decodeTokensPerSecond = rate(decodeTokens, decodeMs),
+                lastDecodeTokensPerSecond = lastDecodeTokensPerSecond,
+                averageTimeToFirstTokenMs = if (streamedGenerations > 0) {
+                    timeToFirstTokenMs.toDouble() / streamedGenerations
+                } else {
+                    0.0
+                },
+                promptLookup = PromptLookupSnapshot(
+                    requests = lookupRequests,
+                    outputTokens = lookupOutputTokens,
+                    draftedTokens = lookupDrafted,
+                    acceptedTokens = lookupAccepted,
+                    acceptanceRate = if (lookupDrafted > 0) lookupAccepted.toDouble() / lookupDrafted else 0.0
+                )
+            )
+        }
+    }
+
+    fun reset() {
+        synchronized(lock) {
+            generations = 0
+            streamedGenerations = 0
+            outputTokens = 0
+            totalMs = 0
+            timeToFirstTokenMs = 0
+            decodeTokens = 0
+            decodeMs = 0
+            lastDecodeTokensPerSecond = 0.0
+            lookupRequests = 0
+            lookupOutputTokens = 0
+            lookupDrafted = 0
+            lookupAccepted = 0
+        }
+    }
+
+    private fun rate(tokens: Long, ms: Long): Double = if (ms > 0) tokens * 1000.0 / ms else 0.0
+}
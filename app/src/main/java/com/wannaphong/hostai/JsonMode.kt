@@ -0,0 +1,183 @@
+package com.wannaphong.hostai
+
+import com.google.ai.edge.litertlm.Content
+import com.google.gson.JsonElement
+import com.google.gson.JsonParser
+
+/**
+ * A `response_format` of type `json_object` or `json_schema`.
+ * @property schema The JSON Schema as a JSON string (json_schema only)
+ */
+data class ResponseFormat(
+    val type: String,
+    val schemaName: String? = null,
+    val schema: String? = null
+) {
+    /** Whether the top-level value may be an array (only when the schema says so). */
+    val allowsArray: Boolean = schema != null && try {
+        JsonParser.parseString(schema).asJsonObject.get("type")?.asString == "array"
+    } catch (e: Exception) {
+        false
+    }
+}
+
+/**
+ * JSON output mode for chat completions (`response_format`).
+ *
+ * LiteRT-LM does not expose logits, so output cannot be constrained token by token.
+ * Instead the model is instructed to answer with JSON (and the schema, if given),
+ * generation is stopped as soon as the top-level value is complete, and any text
+ * around the value (prose, code fences) is removed from non-streaming responses.
+ * Stopping at the closing brace saves the tokens a model would otherwise spend
+ * after the JSON, and clients no longer have to strip it.
+ */
+object JsonMode {
+    private const val TAG = "JsonMode"
+
+    const val TYPE_TEXT = "text"
+    const val TYPE_JSON_OBJECT = "json_object"
+    const val TYPE_JSON_SCHEMA = "json_schema"
+
+    /**
+     * Parse a `response_format` value.
+     * @return The format, or null for plain text (or when absent)
+     * @throws IllegalArgumentException if the value is malformed
+     */
+    fun parse(element: JsonElement?): ResponseFormat? {
+        if (element == null || element.isJsonNull) return null
+        require(element.isJsonObject) { "response_format must be an object" }
+        val obj = element.asJsonObject
+        return when (val type = obj.get("type")?.takeIf { it.isJsonPrimitive }?.asString) {
+            TYPE_TEXT -> null
+            TYPE_JSON_OBJECT -> ResponseFormat(TYPE_JSON_OBJECT)
+            TYPE_JSON_SCHEMA -> {
+                val jsonSchema = obj.get("json_schema")?.takeIf { it.isJsonObject }?.asJsonObject
+                    ?: throw IllegalArgumentException("response_format.json_schema is required")
+                val name = jsonSchema.get("name")?.takeIf { it.isJsonPrimitive }?.asString
+                    ?: throw IllegalArgumentException("response_format.json_schema.name is required")
+                val schema = jsonSchema.get("schema")?.takeIf { it.isJsonObject }?.toString()
+                ResponseFormat(TYPE_JSON_SCHEMA, name, schema)
+            }
+            else -> throw IllegalArgumentException("Unsupported response_format.type: $type")
+        }
+    }
+
+    /**
+     * Prepend the JSON instruction for [format] to [contents] (a prompt String or
+     * List<Content>, as built from the messages).
+     */
+    fun applyInstruction(contents: Any, format: ResponseFormat?): Any {
+        if (format == null) return contents
+        val instruction = buildString {
+            append("system: Respond only with a valid JSON ")
+            append(if (format.allowsArray) "value" else "object")
+            append(", with no other text before or after it.")
+            if (format.schema != null) {
+                append(" The JSON must conform to this JSON Schema: ")
+                append(format.schema)
+            }
+            append("\n")
+        }
+        return if (contents is String) {
+            instruction + contents
+        } else {
+            @Suppress("UNCHECKED_CAST")
+            listOf(Content.Text(instruction)) + (contents as List<Content>)
+        }
+    }
+
+    /**
+     * Wrap a token [sink] so that generation stops once the top-level JSON value is
+     * complete: the chunk containing its end is cut after the closing bracket and
+     * [StopGenerationException] ends the generation.
+     */
+    fun stopWhenComplete(format: ResponseFormat, sink: (String) -> Unit): (String) -> Unit {
+        val scanner = Scanner(format.allowsArray)
+        return { chunk ->
+            val end = scanner.accept(chunk)
+            if (end < 0) {
+                sink(chunk)
+            } else {
+                if (end > 0) sink(chunk.substring(0, end))
+                LogManager.d(TAG, "JSON value complete; stopping generation")
+                throw StopGenerationException()
+            }
+        }
+    }
+
+    /**
+     * The top-level JSON value in [text], without surrounding prose or code fences.
+     * Returns [text] unchanged if it contains no complete, parseable value.
+     */
+    fun extract(text: String, format: ResponseFormat): String {
+        val start = text.indexOfFirst { it == '{' || (format.allowsArray && it == '[') }
+        if (start < 0) {
+            LogManager.w(TAG, "Response contains no JSON value")
+            return text
+        }
+        val end = Scanner(format.allowsArray).accept(text.substring(start))
+        if (end < 0) {
+            LogManager.w(TAG, "Response JSON is incomplete")
+            return text
+        }
+        val value = text.substring(start, start + end)
+        return try {
+            JsonParser.parseString(value)
+            value
+        } catch (e: Exception) {
+            LogManager.w(TAG, "Response is not valid JSON: ${e.message}")
+            text
+        }
+    }
+
+    /**
+     * Incremental scanner that finds the end of the first top-level JSON object (or
+     * array, if [allowsArray]) in a stream of chunks.  Text before the value is skipped.
+     */
+    class Scanner(private val allowsArray: Boolean) {
+        private var started = false
+        private var depth = 0
+        private var inString = false
+        private var escaped = false
+        private var complete = false
+
+        /**
+         * Feed the next chunk.
+         * @return The index just past the end of the value within [chunk], or -1 if
+         *   the value is not complete yet
+         */
+        fun accept(chunk: String): Int {
+            if (complete) return 0
+            for (i in chunk.indices) {
+                val c = chunk[i]
+                if (!started) {
+                    if (c == '{' || (allowsArray && c == '[')) {
+                        started = true
+                        depth = 1
+                    }
+                    continue
+                }
+                if (inString) {
+                    when {
+                        escaped -> escaped = false
+                        c == '\\' -> escaped = true
+                        c == '"' -> inString = false
+                    }
+                    continue
+                }
+                when (c) {
+                    '"' -> inString = true
+                    '{', '[' -> depth++
+                    '}', ']' -> {
+                        depth--
+                        if (depth == 0) {
+                            complete = true
+                            return i + 1
+                        }
+                    }
+                }
+            }
+            return -1
+        }
+    }
+}
@@ -19,12 +19,16 @@ import kotlinx.coroutines.CoroutineScope
 import kotlinx.coroutines.Dispatchers
 import kotlinx.coroutines.Job
 import kotlinx.coroutines.cancel
+import kotlinx.coroutines.delay
 import kotlinx.coroutines.launch
 import kotlinx.coroutines.suspendCancellableCoroutine
 import java.io.File
 import java.util.concurrent.LinkedBlockingQueue
 import java.util.concurrent.TimeUnit
 import java.util.concurrent.atomic.AtomicBoolean
+import java.util.concurrent.atomic.AtomicLong
+import java.util.concurrent.locks.ReentrantLock
+import kotlin.concurrent.withLock
 import kotlin.coroutines.resume
 import kotlin.coroutines.resumeWithException
 
@@ -38,9 +42,74 @@ data class GenerationConfig(
     val topK: Int = 40,
     val topP: Double = 0.95,
     val seed: Int = -1,
+    val n: Int = 1,  // Number of choices to generate (handled by the server, one generation each)
+    val prediction: String? = null,  // Expected output (OpenAI predicted outputs); used for usage reporting only
+    val responseFormat: ResponseFormat? = null,  // JSON output mode (handled by the server, see JsonMode)
     val extraContext: Map<String, Any>? = null  // Extra context for prompt template (from extra_body)
 )
 
+/**
+ * Thrown from a streaming onToken callback to end the generation early without an
+ * error, e.g. once a complete JSON response has been produced.
+ */
+class StopGenerationException : RuntimeException("Generation stopped by caller")
+
+/**
+ * Thrown when a request with image or audio parts cannot get an engine with
+ * encoders.  Text-only engines are built without vision/audio backends, so such a
+ * request is never sent to them.
+ * @property retryable True when the encoders only do not fit right now (low memory);
+ *   false when the model cannot take image or audio input at all
+ */
+class MultimodalUnavailableException(message: String, val retryable: Boolean) : Exception(message)
+
+/**
+ * One named engine sub-pool from the Engine Pools setting, e.g. "short:2:gpu:1024".
+ * @property backend SettingsManager.BACKEND_* value, or null for the Backend setting
+ * @property contextLength Context length of the pool's engines, or null for the Max
+ *   Context Length setting
+ */
+data class EnginePoolSpec(
+    val name: String,
+    val engines: Int,
+    val backend: String? = null,
+    val contextLength: Int? = null
+) {
+    companion object {
+        const val MAX_ENGINES_PER_POOL = 8
+        private const val MIN_CONTEXT_LENGTH = 512
+        private val NAME = Regex("[A-Za-z0-9_-]+")
+        private val BACKENDS = setOf(SettingsManager.BACKEND_CPU, SettingsManager.BACKEND_GPU, SettingsManager.BACKEND_NPU)
+
+        /**
+         * Parse a comma-separated list of `name:engines[:backend[:context]]` entries.
+         * An empty [value] gives an empty list (a single pool from the other settings).
+         * @throws IllegalArgumentException if an entry is malformed
+         */
+        fun parseList(value: String): List<EnginePoolSpec> {
+            val specs = value.split(',').map { it.trim() }.filter { it.isNotEmpty() }.map { entry ->
+                val fields = entry.split(':').map { it.trim() }
+                require(fields.size in 2..4) { "Engine pool \"$entry\" must be name:engines[:backend[:context]]" }
+                val name = fields[0]
+                require(NAME.matches(name)) { "Invalid engine pool name \"$name\"" }
+                val engines = fields[1].toIntOrNull()
+                require(engines != null && engines in 1..MAX_ENGINES_PER_POOL) {
+                    "Engine pool $name must have 1 to $MAX_ENGINES_PER_POOL engines"
+                }
+                val backend = fields.getOrNull(2)?.lowercase()?.takeIf { it.isNotEmpty() }
+                require(backend == null || backend in BACKENDS) { "Unknown backend \"$backend\" in engine pool $name" }
+                val context = fields.getOrNull(3)?.takeIf { it.isNotEmpty() }?.let { it.toIntOrNull() ?: -1 }
+                require(context == null || context >= MIN_CONTEXT_LENGTH) {
+                    "Context length of engine pool $name must be at least $MIN_CONTEXT_LENGTH"
+                }
+                EnginePoolSpec(name, engines, backend, context)
+            }
+            require(specs.map { it.name }.toSet().size == specs.size) { "Engine pool names must be unique" }
+            return specs
+        }
+    }
+}
+
 /**
  * LLM model interface using LiteRT (LLM) library.
  * 
@@ -57,32 +126,178 @@ class LlamaModel(
     
     // LiteRT components
     //
-    // Pool of Engine instances – one per allowed concurrent session.
+    // Pools of Engine instances – one engine per allowed concurrent session.
     // LiteRT's native engine only supports one active conversation at a time,
     // so to support N truly parallel inference requests we maintain N separate
-    // Engine instances.  The pool is filled at loadModel() time based on the
-    // maxConcurrency setting.  Each generate*() call borrows one engine,
-    // creates a conversation on it, runs inference, then returns the engine
-    // to the pool in a finally block.
+    // Engine instances.  The pools are filled at loadModel() time from the
+    // Engine Pools setting (by default one pool of maxConcurrency engines).
+    // Each generate*() call borrows one engine from the cheapest pool that fits
+    // the request, creates a conversation on it, runs inference, then returns
+    // the engine to its pool in a finally block.
     //
     // close() cancels the coroutine scope (signalling in-flight streaming
-    // coroutines to stop) and then drains every engine from the pool,
+    // coroutines to stop) and then drains every engine from the pools,
     // waiting for in-use engines to be returned by their finally blocks
     // before closing the underlying native resources.
-    private val enginePool = LinkedBlockingQueue<Engine>()
-    @Volatile private var poolCapacity = 0
+    //
+    // Under memory pressure the pools can be shrunk with [shrinkPool]: idle engines
+    // are closed at once and busy ones when they are returned, until each pool's
+    // capacity is down to its target.  [restorePool] creates them again.
+    //
+    // The engines of these pools are text-only.  Vision/audio encoders live in a
+    // separate multimodal pool that [ensureMultimodalPool] creates on the first
+    // multimodal request and [unloadWhenIdle] closes again after
+    // MULTIMODAL_IDLE_MS without one, so text traffic does not pay for them.
+    @Volatile private var pools: List<EnginePool> = emptyList()
+    // Guards capacity/targetCapacity changes against engines being returned
+    private val poolLock = Any()
+    // How to create the multimodal pool, or null if multimodal mode is off or the
+    // model has no encoders
+    @Volatile private var multimodalPoolConfig: LazyPoolConfig? = null
+    // Serialises creation of the multimodal pool
+    private val multimodalLock = Any()
+    // Set by [shrinkPool] so that a multimodal request does not reload the encoders
+    // under memory pressure; cleared by [restorePool]
+    @Volatile private var lazyPoolsSuspended = false
     private val scope = CoroutineScope(Dispatchers.IO)
 
     // Cache SettingsManager to avoid repeated instantiation
     private val settingsManager by lazy { SettingsManager(context) }
+
+    /** Throughput of generations run on this model (the mock model is not measured). */
+    val stats = GenerationStats()
+
+    /** Lifecycle of the model, as reported by [getLoadStatus]. */
+    enum class LoadState {
+        /** Created, [loadModel] not called yet (the server starts before loading). */
+        NOT_LOADED,
+        LOADING,
+        LOADED,
+        /** Engines closed by [shrinkPool] under memory pressure until [restorePool]. */
+        SUSPENDED,
+        FAILED,
+        CLOSED
+    }
+
+    /**
+     * Load progress.
+     * @property progress Fraction of the load done, 0.0 to 1.0
+     * @property elapsedMs Time spent loading so far, or the duration of the finished load
+     * @property etaMs Estimated time until the model is ready, or null if unknown
+     * @property error Why the load failed ([LoadState.FAILED] only)
+     */
+    data class LoadStatus(
+        val state: LoadState,
+        val progress: Double,
+        val elapsedMs: Long,
+        val etaMs: Long?,
+        val error: String?
+    )
+
+    // Load lifecycle.  Changes are signalled on [loadStateChanged] for [awaitLoaded].
+    private val loadStateLock = ReentrantLock()
+    private val loadStateChanged = loadStateLock.newCondition()
+    @Volatile private var loadState = LoadState.NOT_LOADED
+    @Volatile private var loadProgress = 0.0
+    @Volatile private var loadStartedAt = 0L
+    @Volatile private var loadDurationMs = 0L
+    // Duration of the previous load of the same model, for the ETA (0 if unknown)
+    @Volatile private var expectedLoadMs = 0L
+    @Volatile private var loadError: String? = null
     
     companion object {
         private const val TAG = "LlamaModel"
         private const val DEFAULT_MAX_TOKENS = 2048
+        // Share of the load progress given to copying a model from a content URI
+        private const val COPY_PROGRESS_SHARE = 0.5
+        // How often a request waiting for an engine re-checks that the model is still loaded
+        private const val ENGINE_WAIT_POLL_MS = 1000L
+        // How often a request waiting for its cheapest pool checks the larger pools
+        private const val SPILL_CHECK_MS = 100L
+        private const val MULTIMODAL_POOL = "multimodal"
+        private const val ENCODERS_SUSPENDED_MESSAGE =
+            "Image and audio input is paused while the device is low on memory; try again shortly"
+        // How long the multimodal pool may sit unused before its encoders are unloaded
+        private const val MULTIMODAL_IDLE_MS = 5 * 60 * 1000L
+        private const val IDLE_CHECK_MS = 30_000L
     }
     
+    /**
+     * Load the model at [modelPath] (a file path, content:// URI, or "mock-model").
+     * Progress is reported by [getLoadStatus]; callers can wait with [awaitLoaded].
+     */
     fun loadModel(modelPath: String): Boolean {
+        val modelManager = ModelManager(context)
+        setLoadState(LoadState.LOADING)
+        loadStartedAt = System.currentTimeMillis()
+        loadProgress = 0.0
+        loadError = null
+        expectedLoadMs = modelManager.getLoadDurationMs(modelPath)
+
+        val loaded = loadModelFrom(modelPath)
+
+        loadDurationMs = System.currentTimeMillis() - loadStartedAt
+        if (loaded) {
+            modelManager.setLoadDurationMs(modelPath, loadDurationMs)
+            loadProgress = 1.0
+            setLoadState(LoadState.LOADED)
+        } else {
+            if (loadError == null) loadError = "Failed to load model $modelName"
+            setLoadState(LoadState.FAILED)
+        }
+        return loaded
+    }
+
+    /**
+     * Current load state and progress, with an ETA based on how long the previous
+     * load of this model took (or on progress so far, for a first load).
+     */
+    fun getLoadStatus(): LoadStatus {
+        val state = loadState
+        if (state != LoadState.LOADING) {
+            val progress = if (state == LoadState.LOADED) 1.0 else 0.0
+            return LoadStatus(state, progress, loadDurationMs, null, loadError.takeIf { state == LoadState.FAILED })
+        }
+        val elapsed = System.currentTimeMillis() - loadStartedAt
+        var progress = loadProgress
+        val etaMs = if (expectedLoadMs > 0) {
+            // Engine initialisation reports no progress of its own; interpolate by time
+            progress = maxOf(progress, minOf(0.99, elapsed.toDouble() / expectedLoadMs))
+            (expectedLoadMs - elapsed).coerceAtLeast(0L)
+        } else if (progress > 0.0) {
+            (elapsed * (1.0 - progress) / progress).toLong()
+        } else {
+            null
+        }
+        return LoadStatus(state, progress, elapsed, etaMs, null)
+    }
+
+    /**
+     * Block until the model has finished loading or [timeoutMs] has passed.
+     * Returns immediately if the model is loaded, has failed to load, or is closed.
+     * @return Whether the model is loaded
+     */
+    fun awaitLoaded(timeoutMs: Long): Boolean {
+        loadStateLock.withLock {
+            var remainingNanos = TimeUnit.MILLISECONDS.toNanos(timeoutMs)
+            while (loadState == LoadState.NOT_LOADED || loadState == LoadState.LOADING) {
+                if (remainingNanos <= 0L) break
+                remainingNanos = loadStateChanged.awaitNanos(remainingNanos)
+            }
+            return loadState == LoadState.LOADED
+        }
+    }
+
+    private fun setLoadState(state: LoadState) {
+        loadStateLock.withLock {
+            loadState = state
+            loadStateChanged.signalAll()
+        }
+    }
+
+    private fun loadModelFrom(modelPath: String): Boolean {
         this.modelPath = modelPath
+        stats.reset()
         
         LogManager.i(TAG, "Loading model from path: $modelPath")
         
@@ -121,7 +336,17 @@ class LlamaModel(
                 try {
                     contentResolver.openInputStream(uri)?.use { input ->
                         destFile.outputStream().use { output ->
-                            input.copyTo(output)
+                            val buffer = ByteArray(DEFAULT_BUFFER_SIZE * 64)
+                            var copied = 0L
+                            while (true) {
+                                val read = input.read(buffer)
+                                if (read < 0) break
+                                output.write(buffer, 0, read)
+                                copied += read
+                                if (fileSize > 0) {
+                                    loadProgress = COPY_PROGRESS_SHARE * copied / fileSize
+                                }
+                            }
                         }
                     } ?: run {
                         LogManager.e(TAG, "Failed to open input stream for URI: $modelPath")
@@ -202,32 +427,68 @@ class LlamaModel(
         return file
     }
 
+    /**
+     * Engine settings chosen for a model: the operator's settings, limited to what the
+     * model supports (see [chooseEngineSettings]).
+     */
+    private data class EngineSettings(
+        val backend: String,
+        val maxContextLength: Int,
+        val vision: Boolean,
+        val audio: Boolean
+    ) {
+        val multimodal: Boolean get() = vision || audio
+    }
+
+    /**
+     * Engines created from one [EnginePoolSpec].
+     * @property plannedCapacity Engines created by the load, restored by [restorePool]
+     */
+    private class EnginePool(
+        val name: String,
+        val settings: EngineSettings,
+        val engineConfig: EngineConfig,
+        val plannedCapacity: Int,
+        val lazy: Boolean = false
+    ) {
+        val engines = LinkedBlockingQueue<Engine>()
+        @Volatile var capacity = 0
+        @Volatile var targetCapacity = 0
+        @Volatile var lastUsedAt = System.currentTimeMillis()
+        val requests = AtomicLong(0)
+    }
+
+    /** Everything needed to create a pool on demand, decided at load time. */
+    private data class LazyPoolConfig(
+        val settings: EngineSettings,
+        val engineConfig: EngineConfig,
+        val estimate: MemoryPlanner.Estimate
+    )
+
+    /** State of one engine pool, for /metrics. */
+    data class EnginePoolStatus(
+        val name: String,
+        val backend: String,
+        val contextLength: Int,
+        val multimodal: Boolean,
+        val engines: Int,
+        val idleEngines: Int,
+        val requests: Long
+    )
+
     /**
      * Initialise the LiteRT engine from a real file-system path.
+     *
+     * The backend, context length and vision/audio encoders come from the settings,
+     * adjusted to the model's metadata so that a wrong setting does not make the load
+     * fail or waste memory.  If creating the engines still fails with an accelerator
+     * or encoders, the load is retried once on CPU, text only.
      */
     private fun loadFromPath(enginePath: String): Boolean {
         return try {
             LogManager.i(TAG, "Initializing LiteRT with model: $modelName")
 
-            // Get backend preference from settings
-            val backend = when (settingsManager.getBackend()) {
-                SettingsManager.BACKEND_NPU -> {
-                    LogManager.i(TAG, "Using NPU backend for inference")
-                    Backend.NPU(nativeLibraryDir = context.applicationInfo.nativeLibraryDir)
-                }
-                SettingsManager.BACKEND_GPU -> {
-                    LogManager.i(TAG, "Using GPU backend for inference")
-                    Backend.GPU()
-                }
-                else -> {
-                    LogManager.i(TAG, "Using CPU backend for inference")
-                    Backend.CPU()
-                }
-            }
-
-            // Get max context length from settings
-            val maxContextLength = settingsManager.getMaxContextLength()
-            LogManager.i(TAG, "Using max context length: $maxContextLength tokens")
+            val metadata = modelPath?.let { ModelManager(context).getMetadata(it) }
 
             // Compiled-kernel cache directory: speeds up subsequent model loads by reusing
             // pre-compiled GPU/NPU kernels instead of recompiling them on every launch.
@@ -237,81 +498,223 @@ class LlamaModel(
             }
             val cacheDir = cacheDirFile.absolutePath
 
-            // Create engine config with selected backend.
-            // Only add vision/audio backends for multimodal models (e.g. Gemma-3N).
-            // Text-only models fail with "Unsupported or unknown file format" when
-            // these backends are specified.
-            val useMultimodal = settingsManager.isMultimodalEnabled()
-            val engineConfig = if (useMultimodal) {
-                LogManager.i(TAG, "Multimodal mode enabled: adding vision (GPU) and audio (CPU) backends")
-                EngineConfig(
-                    modelPath = enginePath,
-                    backend = backend,
-                    maxNumTokens = maxContextLength,
-                    cacheDir = cacheDir,
-                    visionBackend = Backend.GPU(),
-                    audioBackend = Backend.CPU()
-                )
-            } else {
-                EngineConfig(
-                    modelPath = enginePath,
-                    backend = backend,
-                    maxNumTokens = maxContextLength,
-                    cacheDir = cacheDir
-                )
-            }
-
             // Drain any engines left from a previous load (defensive; normally the
-            // pool is empty here because close() or unload() was called first).
+            // pools are empty here because close() or unload() was called first).
             var drainedCount = 0
-            while (true) {
-                val old = enginePool.poll() ?: break
-                try { old.close() } catch (_: Exception) { }
-                drainedCount++
+            for (pool in pools) {
+                while (true) {
+                    val old = pool.engines.poll() ?: break
+                    try { old.close() } catch (_: Exception) { }
+                    drainedCount++
+                }
             }
             if (drainedCount > 0) {
                 LogManager.w(TAG, "Drained $drainedCount leftover engine(s) from a previous load; close() or unload() may have been skipped")
             }
-            poolCapacity = 0
+            pools = emptyList()
 
-            // Create one Engine instance per allowed concurrent session.
+            // Create one Engine instance per allowed concurrent session, pool by pool.
             // N engines → N truly parallel inference requests without
             // serialisation (each engine handles exactly one active conversation).
-            val concurrency = settingsManager.getMaxConcurrency().coerceAtLeast(1)
-            LogManager.i(TAG, "Creating $concurrency engine instance(s) for $concurrency concurrent session(s)")
-
-            val newEngines = mutableListOf<Engine>()
+            // Only as many as the memory planner expects to fit are created; further
+            // requests wait for a free engine instead of the app being killed.
+            val specs = settingsManager.getEnginePoolSpecs()
+            val totalRequested = specs.sumOf { it.engines }
+            val planner = MemoryPlanner(context)
+            val progressBase = loadProgress
+            var requestedSoFar = 0
+            val created = ArrayList<EnginePool>()
             try {
-                repeat(concurrency) { index ->
-                    LogManager.i(TAG, "Initializing engine instance ${index + 1}/$concurrency...")
-                    val eng = Engine(engineConfig)
-                    eng.initialize()
-                    newEngines.add(eng)
+                for (spec in specs) {
+                    requestedSoFar += spec.engines
+                    val progressEnd = progressBase + (1.0 - progressBase) * requestedSoFar / totalRequested
+                    created.add(createPool(spec, enginePath, metadata, cacheDir, planner, progressEnd))
                 }
             } catch (e: Exception) {
-                // If any instance fails, close all that were created and rethrow.
-                newEngines.forEach { try { it.close() } catch (_: Exception) { } }
+                created.forEach { pool -> pool.engines.forEach { try { it.close() } catch (_: Exception) { } } }
                 throw e
             }
 
-            newEngines.forEach { enginePool.offer(it) }
-            poolCapacity = concurrency
+            pools = cheapestFirst(created)
+            multimodalPoolConfig = if (settingsManager.isMultimodalEnabled()) {
+                multimodalPoolConfigFor(enginePath, metadata, cacheDir, planner)
+            } else {
+                null
+            }
+            lazyPoolsSuspended = false
             isLoaded = true
 
-            LogManager.i(TAG, "LiteRT engine(s) initialized successfully with ${settingsManager.getBackend().uppercase()} backend ($concurrency instance(s))")
+            LogManager.i(TAG, "LiteRT engine(s) initialized successfully: " + pools.joinToString { pool ->
+                "${pool.name} (${pool.capacity} x ${pool.settings.backend.uppercase()}, ${pool.settings.maxContextLength} tokens)"
+            } + if (multimodalPoolConfig != null) "; multimodal pool loads on the first image or audio request" else "")
             true
         } catch (e: Exception) {
             Log.e(TAG, "Failed to load model", e)
             LogManager.e(TAG, "Failed to load model: ${e.message}", e)
-            while (true) {
-                val old = enginePool.poll() ?: break
-                try { old.close() } catch (_: Exception) { }
-            }
-            poolCapacity = 0
+            loadError = e.message
+            pools = emptyList()
+            multimodalPoolConfig = null
             isLoaded = false
             false
         }
     }
+
+    /**
+     * Create the text-only engines of one pool: as many of [spec]'s engines as the
+     * memory planner expects to fit (at least one), on the spec's backend and context.
+     * If creation fails on an accelerator it is retried once on CPU.  Load progress
+     * advances to [progressEnd].
+     */
+    private fun createPool(
+        spec: EnginePoolSpec,
+        enginePath: String,
+        metadata: ModelMetadata?,
+        cacheDir: String,
+        planner: MemoryPlanner,
+        progressEnd: Double
+    ): EnginePool {
+        val chosen = chooseEngineSettings(metadata, spec, multimodal = false)
+        val estimate = planner.estimate(
+            modelPath ?: enginePath, metadata, File(enginePath).length(), chosen.maxContextLength, chosen.backend
+        )
+        val plan = planner.plan(estimate, spec.engines)
+        val count = plan.safeEngines
+        if (!plan.fitsAll) {
+            LogManager.w(TAG, "Pool ${spec.name}: ${spec.engines} engine(s) need about ${estimate.perEngineBytes * spec.engines / 1024 / 1024} MB " +
+                "but only ${plan.availableBytes / 1024 / 1024} MB is available; creating $count engine(s)")
+        }
+        LogManager.i(TAG, "Creating $count engine instance(s) for pool ${spec.name}")
+
+        var used = chosen
+        var usedConfig = engineConfigFor(enginePath, chosen, cacheDir)
+        val progressBase = loadProgress
+        val rssBefore = MemoryPlanner.residentBytes()
+        val newEngines = try {
+            createEngines(usedConfig, count, progressEnd)
+        } catch (e: Exception) {
+            val fallback = chosen.copy(backend = SettingsManager.BACKEND_CPU)
+            if (fallback == chosen) throw e
+            LogManager.w(TAG, "Engine creation failed (${e.message}); retrying on CPU")
+            used = fallback
+            usedConfig = engineConfigFor(enginePath, fallback, cacheDir)
+            loadProgress = progressBase
+            createEngines(usedConfig, count, progressEnd)
+        }
+
+        val rssAfter = MemoryPlanner.residentBytes()
+        if (used == chosen && rssBefore > 0 && rssAfter > rssBefore) {
+            planner.calibrate(modelPath ?: enginePath, used.backend, estimate, (rssAfter - rssBefore) / count)
+        }
+
+        val pool = EnginePool(spec.name, used, usedConfig, count)
+        newEngines.forEach { pool.engines.offer(it) }
+        pool.capacity = count
+        pool.targetCapacity = count
+        return pool
+    }
+
+    /**
+     * Settings for the multimodal pool (one engine with the model's encoders on the
+     * Backend and Max Context Length settings), or null if the model has none.
+     */
+    private fun multimodalPoolConfigFor(
+        enginePath: String,
+        metadata: ModelMetadata?,
+        cacheDir: String,
+        planner: MemoryPlanner
+    ): LazyPoolConfig? {
+        val settings = chooseEngineSettings(metadata, EnginePoolSpec(MULTIMODAL_POOL, 1), multimodal = true)
+        if (!settings.multimodal) {
+            LogManager.i(TAG, "Model has no vision or audio encoder; image and audio input is refused")
+            return null
+        }
+        val estimate = planner.estimate(
+            modelPath ?: enginePath, metadata, File(enginePath).length(), settings.maxContextLength, settings.backend
+        )
+        return LazyPoolConfig(settings, engineConfigFor(enginePath, settings, cacheDir), estimate)
+    }
+
+    /** [candidates] ordered cheapest first: text-only before multimodal, then smallest context. */
+    private fun cheapestFirst(candidates: List<EnginePool>): List<EnginePool> =
+        candidates.sortedWith(compareBy<EnginePool>({ it.settings.multimodal }, { it.settings.maxContextLength }))
+
+    /**
+     * Settings for this model: NPU only for models compiled for an NPU (GPU otherwise),
+     * no larger a context than the model was exported with, and, for a [multimodal]
+     * pool, the vision/audio encoders the model contains.  Without header metadata
+     * both encoders are assumed present.
+     */
+    private fun chooseEngineSettings(metadata: ModelMetadata?, spec: EnginePoolSpec, multimodal: Boolean): EngineSettings {
+        var backend = spec.backend ?: settingsManager.getBackend()
+        if (backend == SettingsManager.BACKEND_NPU && metadata != null && !metadata.npuCompiled) {
+            LogManager.w(TAG, "Model is not compiled for an NPU; using GPU backend instead")
+            backend = SettingsManager.BACKEND_GPU
+        }
+        if (settingsManager.isThermalThrottlingEnabled()) {
+            backend = ThermalController.getInstance(context).backendFor(backend)
+        }
+        LogManager.i(TAG, "Using ${backend.uppercase()} backend for pool ${spec.name}")
+
+        val configuredContext = spec.contextLength ?: settingsManager.getMaxContextLength()
+        val modelContext = metadata?.maxContextLength
+        val maxContextLength = if (modelContext != null && modelContext < configuredContext) {
+            LogManager.i(TAG, "Limiting context length to the model's $modelContext tokens (setting: $configuredContext)")
+            modelContext
+        } else {
+            configuredContext
+        }
+        LogManager.i(TAG, "Using max context length for pool ${spec.name}: $maxContextLength tokens")
+
+        // Only add vision/audio backends for models that include those encoders (e.g.
+        // Gemma-3N).  Text-only models fail with "Unsupported or unknown file format"
+        // when these backends are specified.
+        val headerMetadata = metadata?.takeIf { it.isFromHeader }
+        val vision = multimodal && (headerMetadata?.hasVision ?: true)
+        val audio = multimodal && (headerMetadata?.hasAudio ?: true)
+        if (multimodal) {
+            LogManager.i(TAG, "Multimodal pool: vision ${if (vision) "on (GPU)" else "off"}, audio ${if (audio) "on (CPU)" else "off"}")
+        }
+        return EngineSettings(backend, maxContextLength, vision, audio)
+    }
+
+    private fun engineConfigFor(enginePath: String, settings: EngineSettings, cacheDir: String): EngineConfig {
+        val backend = when (settings.backend) {
+            SettingsManager.BACKEND_NPU -> Backend.NPU(nativeLibraryDir = context.applicationInfo.nativeLibraryDir)
+            SettingsManager.BACKEND_GPU -> Backend.GPU()
+            else -> Backend.CPU()
+        }
+        return EngineConfig(
+            modelPath = enginePath,
+            backend = backend,
+            maxNumTokens = settings.maxContextLength,
+            cacheDir = cacheDir,
+            visionBackend = if (settings.vision) Backend.GPU() else null,
+            audioBackend = if (settings.audio) Backend.CPU() else null
+        )
+    }
+
+    /**
+     * Create and initialise [count] engines, advancing the load progress to
+     * [progressEnd].  If any fails, the ones already created are closed and the
+     * exception is rethrown.
+     */
+    private fun createEngines(engineConfig: EngineConfig, count: Int, progressEnd: Double): List<Engine> {
+        val newEngines = mutableListOf<Engine>()
+        val progressBase = loadProgress
+        try {
+            repeat(count) { index ->
+                LogManager.i(TAG, "Initializing engine instance ${index + 1}/$count...")
+                val eng = Engine(engineConfig)
+                eng.initialize()
+                newEngines.add(eng)
+                loadProgress = progressBase + (progressEnd - progressBase) * (index + 1) / count
+            }
+        } catch (e: Exception) {
+            newEngines.forEach { try { it.close() } catch (_: Exception) { } }
+            throw e
+        }
+        return newEngines
+    }
     
     fun isModelLoaded(): Boolean {
         return isLoaded
@@ -321,6 +724,279 @@ class LlamaModel(
     
     fun getModelPath(): String? = modelPath
 
+    /**
+     * Tokens (prompt and completion together) one conversation can hold: the largest
+     * context any engine pool was created with, or the setting before a load.
+     */
+    fun getMaxContextLength(): Int =
+        pools.filter { it.targetCapacity > 0 }.maxOfOrNull { it.settings.maxContextLength }
+            ?: settingsManager.getMaxContextLength()
+
+    /** Number of engines (parallel requests) in all pools. */
+    fun getEngineCount(): Int = pools.sumOf { it.capacity }
+
+    /** State of each engine pool, cheapest first. */
+    fun getEnginePoolStatus(): List<EnginePoolStatus> = pools.map { pool ->
+        EnginePoolStatus(
+            name = pool.name,
+            backend = pool.settings.backend,
+            contextLength = pool.settings.maxContextLength,
+            multimodal = pool.settings.multimodal,
+            engines = pool.capacity,
+            idleEngines = pool.engines.size,
+            requests = pool.requests.get()
+        )
+    }
+
+    /**
+     * Whether a pooled engine is free right now, i.e. a request could start without
+     * waiting.  Background work (batches) uses this to run only in spare capacity.
+     * The mock model has no engines and is always considered idle.
+     */
+    fun hasIdleEngine(): Boolean {
+        return isLoaded && (modelPath == "mock-model" || pools.any { it.engines.isNotEmpty() })
+    }
+
+    /**
+     * Shrink the engine pools to [target] engines in total to give memory back under
+     * pressure.  Engines are kept in text-only pools first, largest context first, so
+     * that the remaining engines can still serve any text request.  Idle engines are
+     * closed now, busy ones when their request finishes.  With a target of 0 the model
+     * is [LoadState.SUSPENDED] until [restorePool] (requests waiting for an engine fail).
+     * @return Number of engines closed now
+     */
+    fun shrinkPool(target: Int): Int {
+        val current = pools
+        if (modelPath == "mock-model" || current.isEmpty()) return 0
+        val closing = ArrayList<Engine>()
+        var pending = 0
+        synchronized(poolLock) {
+            var remaining = target.coerceAtLeast(0)
+            val keepOrder = current.sortedWith(
+                compareBy<EnginePool> { it.settings.multimodal }.thenByDescending { it.settings.maxContextLength }
+            )
+            // The multimodal pool goes first, and is not recreated until restorePool()
+            lazyPoolsSuspended = true
+            for (pool in keepOrder) {
+                pool.targetCapacity = if (pool.lazy) 0 else remaining.coerceAtMost(pool.capacity)
+                remaining -= pool.targetCapacity
+                while (pool.capacity > pool.targetCapacity) {
+                    val eng = pool.engines.poll() ?: break
+                    pool.capacity--
+                    closing.add(eng)
+                }
+                pending += pool.capacity - pool.targetCapacity
+            }
+            pools = pools.filterNot { it.lazy && it.capacity == 0 }
+            if (current.all { it.targetCapacity == 0 }) isLoaded = false
+        }
+        if (target <= 0) setLoadState(LoadState.SUSPENDED)
+        closing.forEach { eng ->
+            try { eng.close() } catch (e: Exception) {
+                LogManager.w(TAG, "Error closing engine instance: ${e.message}")
+            }
+        }
+        LogManager.i(TAG, "Engine pools shrunk to ${current.sumOf { it.targetCapacity }} (${closing.size} closed now, " +
+            "$pending when their request finishes)")
+        return closing.size
+    }
+
+    /**
+     * Recreate the engines removed by [shrinkPool], up to each pool's count of the
+     * last load, stopping a pool at the first engine that cannot be created.
+     * @return Number of engines created
+     */
+    fun restorePool(): Int {
+        if (modelPath == "mock-model" || loadState == LoadState.CLOSED) return 0
+        lazyPoolsSuspended = false
+        var added = 0
+        for (pool in pools) {
+            val missing = synchronized(poolLock) {
+                pool.targetCapacity = pool.plannedCapacity
+                pool.plannedCapacity - pool.capacity
+            }
+            for (i in 0 until missing) {
+                try {
+                    val eng = Engine(pool.engineConfig)
+                    eng.initialize()
+                    synchronized(poolLock) {
+                        pool.capacity++
+                        pool.engines.offer(eng)
+                    }
+                    added++
+                } catch (e: Exception) {
+                    LogManager.w(TAG, "Could not restore engine ${i + 1}/$missing of pool ${pool.name}: ${e.message}")
+                    synchronized(poolLock) { pool.targetCapacity = pool.capacity }
+                    break
+                }
+            }
+        }
+        if (!isLoaded && getEngineCount() > 0) {
+            isLoaded = true
+            setLoadState(LoadState.LOADED)
+        }
+        if (added > 0) LogManager.i(TAG, "Engine pools restored to ${getEngineCount()} engine(s)")
+        return added
+    }
+
+    /**
+     * Pools that can serve a request of [tokens] tokens (prompt and max_tokens), cheapest
+     * first.  Multimodal requests only use a pool with encoders, and text requests keep
+     * off it (unless it is all there is), so that it can be unloaded when idle.  Pools
+     * whose context is too small are skipped unless none is large enough, in which case
+     * the largest is used and the conversation is truncated as before.
+     */
+    private fun poolsFor(tokens: Int, multimodal: Boolean): List<EnginePool> {
+        val live = pools.filter { it.targetCapacity > 0 }
+        val byModality = if (multimodal) {
+            live.filter { it.settings.multimodal }
+        } else {
+            live.filter { !it.settings.multimodal }.ifEmpty { live }
+        }
+        return byModality.filter { it.settings.maxContextLength >= tokens }.ifEmpty {
+            listOfNotNull(byModality.maxByOrNull { it.settings.maxContextLength })
+        }
+    }
+
+    /**
+     * Take an engine from the cheapest pool that fits the request and has one free,
+     * waiting while all of them are busy.  While waiting the cheapest pool is preferred,
+     * but a larger one is taken as soon as one of its engines frees up.
+     * @return The pool and engine, or null if the model stops being loaded while waiting
+     * @throws MultimodalUnavailableException if a [multimodal] request has no pool with encoders
+     */
+    private fun borrowEngine(tokens: Int, multimodal: Boolean): Pair<EnginePool, Engine>? {
+        // Decided once per borrow: creating the pool plans memory and loads the encoders
+        if (multimodal) ensureMultimodalPool()
+        while (true) {
+            val candidates = poolsFor(tokens, multimodal)
+            if (multimodal && candidates.isEmpty() && isLoaded) {
+                // Shrunk for memory pressure while this request waited
+                throw MultimodalUnavailableException(ENCODERS_SUSPENDED_MESSAGE, retryable = true)
+            }
+            for (pool in candidates) {
+                pool.engines.poll()?.let { return lease(pool, it) }
+            }
+            val cheapest = candidates.firstOrNull()
+            if (cheapest == null) {
+                Thread.sleep(ENGINE_WAIT_POLL_MS)
+            } else {
+                val wait = if (candidates.size > 1) SPILL_CHECK_MS else ENGINE_WAIT_POLL_MS
+                cheapest.engines.poll(wait, TimeUnit.MILLISECONDS)?.let { return lease(cheapest, it) }
+            }
+            if (!isLoaded) return null
+        }
+    }
+
+    private fun lease(pool: EnginePool, engine: Engine): Pair<EnginePool, Engine> {
+        pool.requests.incrementAndGet()
+        pool.lastUsedAt = System.currentTimeMillis()
+        if (pools.size > 1) LogManager.d(TAG) { "Routing request to engine pool ${pool.name}" }
+        return pool to engine
+    }
+
+    /** Give [engine] back to [pool], or close it if the pool is being shrunk. */
+    private fun returnEngine(pool: EnginePool, engine: Engine) {
+        pool.lastUsedAt = System.currentTimeMillis()
+        val excess = synchronized(poolLock) {
+            if (pool.capacity > pool.targetCapacity) {
+                pool.capacity--
+                if (pool.lazy && pool.capacity == 0) pools = pools - pool
+                true
+            } else {
+                pool.engines.offer(engine)
+                false
+            }
+        }
+        if (excess) {
+            try { engine.close() } catch (e: Exception) {
+                LogManager.w(TAG, "Error closing engine instance: ${e.message}")
+            }
+        }
+    }
+
+    /**
+     * The multimodal pool, created with one engine if there is none: the first
+     * multimodal request pays for loading the encoders.
+     * @throws MultimodalUnavailableException if the model has no encoders (or
+     *   multimodal mode is off), they failed to load before, the pools are shrunk for
+     *   memory pressure, or the engine does not fit in memory
+     */
+    private fun ensureMultimodalPool(): EnginePool {
+        val lazyConfig = multimodalPoolConfig
+            ?: throw MultimodalUnavailableException("This model does not accept image or audio input", retryable = false)
+        pools.firstOrNull { it.lazy && it.targetCapacity > 0 }?.let { return it }
+        if (lazyPoolsSuspended) throw MultimodalUnavailableException(ENCODERS_SUSPENDED_MESSAGE, retryable = true)
+        synchronized(multimodalLock) {
+            pools.firstOrNull { it.lazy && it.targetCapacity > 0 }?.let { return it }
+            val plan = MemoryPlanner(context).plan(lazyConfig.estimate, 1)
+            if (plan.availableBytes < lazyConfig.estimate.perEngineBytes) {
+                val message = "The vision/audio encoders need about ${lazyConfig.estimate.perEngineBytes / 1024 / 1024} MB " +
+                    "but only ${plan.availableBytes / 1024 / 1024} MB is available"
+                LogManager.w(TAG, message)
+                throw MultimodalUnavailableException("$message; try again shortly", retryable = true)
+            }
+            LogManager.i(TAG, "Loading vision/audio encoders for the first multimodal request")
+            val eng = try {
+                Engine(lazyConfig.engineConfig).also { it.initialize() }
+            } catch (e: Exception) {
+                LogManager.e(TAG, "Could not create the multimodal engine: ${e.message}; image and audio input is disabled", e)
+                multimodalPoolConfig = null
+                throw MultimodalUnavailableException("The vision/audio encoders failed to load: ${e.message}", retryable = false)
+            }
+            val pool = EnginePool(MULTIMODAL_POOL, lazyConfig.settings, lazyConfig.engineConfig, 1, lazy = true)
+            val added = synchronized(poolLock) {
+                if (!isLoaded || lazyPoolsSuspended) {
+                    false
+                } else {
+                    pool.engines.offer(eng)
+                    pool.capacity = 1
+                    pool.targetCapacity = 1
+                    pools = cheapestFirst(pools + pool)
+                    true
+                }
+            }
+            if (!added) {
+                try { eng.close() } catch (_: Exception) { }
+                throw MultimodalUnavailableException(ENCODERS_SUSPENDED_MESSAGE, retryable = true)
+            }
+            scope.launch { unloadWhenIdle(pool) }
+            return pool
+        }
+    }
+
+    /**
+     * Close the multimodal [pool] once it has gone [MULTIMODAL_IDLE_MS] without a
+     * request, giving the encoders' memory back.  The next multimodal request
+     * creates it again.
+     */
+    private suspend fun unloadWhenIdle(pool: EnginePool) {
+        while (pool.capacity > 0) {
+            delay(IDLE_CHECK_MS)
+            val idleMs = System.currentTimeMillis() - pool.lastUsedAt
+            if (idleMs < MULTIMODAL_IDLE_MS || pool.engines.size < pool.capacity) continue
+            val closing = ArrayList<Engine>()
+            synchronized(poolLock) {
+                pool.targetCapacity = 0
+                while (pool.capacity > 0) {
+                    val eng = pool.engines.poll() ?: break
+                    pool.capacity--
+                    closing.add(eng)
+                }
+                // Engines borrowed meanwhile are closed by returnEngine(), which also
+                // removes the pool once it is empty
+                if (pool.capacity == 0) pools = pools - pool
+            }
+            closing.forEach { eng ->
+                try { eng.close() } catch (e: Exception) {
+                    LogManager.w(TAG, "Error closing engine instance: ${e.message}")
+                }
+            }
+            LogManager.i(TAG, "Unloaded the multimodal pool after ${idleMs / 1000} s without a multimodal request")
+            return
+        }
+    }
+
     /**
      * Create a new conversation for a single request.
      * A fresh conversation is created for every request and closed after use,
@@ -338,15 +1014,25 @@ class LlamaModel(
     private fun createConversation(engine: Engine, config: GenerationConfig): Conversation? {
         // Log extra context if provided (for debugging/future support)
         if (config.extraContext?.isNotEmpty() == true) {
-            LogManager.d(TAG, "Extra context provided: ${config.extraContext}")
+            LogManager.d(TAG) { "Extra context provided: ${config.extraContext}" }
         }
 
         return try {
-            val samplerConfig = SamplerConfig(
-                topK = config.topK,
-                topP = config.topP,
-                temperature = config.temperature
-            )
+            // A non-negative seed makes sampling reproducible; -1 keeps the engine default
+            val samplerConfig = if (config.seed >= 0) {
+                SamplerConfig(
+                    topK = config.topK,
+                    topP = config.topP,
+                    temperature = config.temperature,
+                    seed = config.seed
+                )
+            } else {
+                SamplerConfig(
+                    topK = config.topK,
+                    topP = config.topP,
+                    temperature = config.temperature
+                )
+            }
 
             val conversationConfig = ConversationConfig(
                 systemInstruction = null,
@@ -376,7 +1062,7 @@ class LlamaModel(
         }
 
         LogManager.i(TAG, "Generating response with prompt (length: ${prompt.length})")
-        LogManager.d(TAG, "Config: maxTokens=${config.maxTokens}, temp=${config.temperature}, topK=${config.topK}, topP=${config.topP}")
+        LogManager.d(TAG) { "Config: maxTokens=${config.maxTokens}, temp=${config.temperature}, topK=${config.topK}, topP=${config.topP}, seed=${config.seed}" }
         
         // For mock model, return a simple response
         if (modelPath == "mock-model") {
@@ -384,10 +1070,11 @@ class LlamaModel(
             return "This is a mock response from the model. In production, this would be the actual LLM output for prompt: \"$promptPreview\""
         }
 
-        // Borrow one engine from the pool (blocks only if all N engines are in use,
+        // Borrow one engine from the pools (blocks only if all N engines are in use,
         // which cannot happen once the requestSemaphore in OpenAIApiServer limits
-        // concurrent calls to N – the same value as the pool size).
-        val eng = enginePool.take()
+        // concurrent calls to N – the same value as the total pool size).
+        val (pool, eng) = borrowEngine(ContextManager.estimateTokens(prompt) + config.maxTokens, multimodal = false)
+            ?: return "Error: Model not loaded. Please load a model first."
         var conversation: Conversation? = null
         return try {
             // Re-check after acquiring the engine: if close()/unload() raced ahead
@@ -405,9 +1092,11 @@ class LlamaModel(
             }
 
             // Send message and get response synchronously
+            val startTime = System.currentTimeMillis()
             val userMessage = Message.user(prompt)
             val response = conversation.sendMessage(userMessage)
             val result = response.toString()
+            stats.recordBlocking(result, System.currentTimeMillis() - startTime)
             LogManager.i(TAG, "Generation completed successfully (length: ${result.length})")
             result
         } catch (e: Exception) {
@@ -418,7 +1107,7 @@ class LlamaModel(
             try { conversation?.close() } catch (e: Exception) {
                 LogManager.w(TAG, "Error closing conversation: ${e.message}")
             }
-            enginePool.offer(eng)  // always return engine to pool
+            returnEngine(pool, eng)  // always return engine to pool
         }
     }
 
@@ -428,6 +1117,8 @@ class LlamaModel(
      * @param config Generation configuration with all parameters (optional)
      * @param sessionId Unused – kept for API compatibility
      * @return Generated text
+     * @throws MultimodalUnavailableException if [contents] has image or audio parts and
+     *   no engine with encoders is available
      */
     fun generateWithContents(contents: List<Content>, config: GenerationConfig = GenerationConfig(), sessionId: String = ""): String {
         if (!isModelLoaded()) {
@@ -437,14 +1128,15 @@ class LlamaModel(
         }
 
         LogManager.i(TAG, "Generating multimodal response with ${contents.size} content parts")
-        LogManager.d(TAG, "Config: maxTokens=${config.maxTokens}, temp=${config.temperature}, topK=${config.topK}, topP=${config.topP}")
+        LogManager.d(TAG) { "Config: maxTokens=${config.maxTokens}, temp=${config.temperature}, topK=${config.topK}, topP=${config.topP}, seed=${config.seed}" }
 
         // For mock model, return a simple response
         if (modelPath == "mock-model") {
             return "This is a mock multimodal response from the model with ${contents.size} content parts."
         }
 
-        val eng = enginePool.take()
+        val (pool, eng) = borrowEngine(ContextManager.estimateContentTokens(contents) + config.maxTokens, ContextManager.isMultimodal(contents))
+            ?: return "Error: Model not loaded. Please load a model first."
         var conversation: Conversation? = null
         return try {
             if (!isLoaded) {
@@ -460,9 +1152,11 @@ class LlamaModel(
             }
 
             // Send message with multimodal contents and get response synchronously
+            val startTime = System.currentTimeMillis()
             val userMessage = Message.user(Contents.of(contents))
             val response = conversation.sendMessage(userMessage)
             val result = response.toString()
+            stats.recordBlocking(result, System.currentTimeMillis() - startTime)
             LogManager.i(TAG, "Multimodal generation completed successfully (length: ${result.length})")
             result
         } catch (e: Exception) {
@@ -473,7 +1167,7 @@ class LlamaModel(
             try { conversation?.close() } catch (e: Exception) {
                 LogManager.w(TAG, "Error closing conversation: ${e.message}")
             }
-            enginePool.offer(eng)  // always return engine to pool
+            returnEngine(pool, eng)  // always return engine to pool
         }
     }
 
@@ -505,7 +1199,7 @@ class LlamaModel(
             return null
         }
 
-        LogManager.d(TAG, "Streaming - config: maxTokens=${config.maxTokens}, temp=${config.temperature}, topK=${config.topK}, topP=${config.topP}")
+        LogManager.d(TAG) { "Streaming - config: maxTokens=${config.maxTokens}, temp=${config.temperature}, topK=${config.topK}, topP=${config.topP}" }
 
         // For mock model, simulate streaming
         if (modelPath == "mock-model") {
@@ -516,12 +1210,15 @@ class LlamaModel(
         }
 
         return scope.launch {
-            // Borrow one engine from the pool.  The pool has exactly as many
-            // engines as the maxConcurrency setting, so this call blocks only
-            // when all engines are already in use.  In-flight conversations
-            // each hold a single engine slot and release it in the finally
-            // block below, guaranteeing forward progress.
-            val eng = enginePool.take()
+            // Borrow one engine from the pools.  The pools have exactly as many
+            // engines as the server admits requests, so this call blocks only
+            // when all engines that fit are already in use.  In-flight
+            // conversations each hold a single engine slot and release it in the
+            // finally block below, guaranteeing forward progress.
+            val (pool, eng) = borrowEngine(ContextManager.estimateTokens(prompt) + config.maxTokens, multimodal = false) ?: run {
+                onToken("Error: Model not loaded. Please load a model first.")
+                return@launch
+            }
             var conversation: Conversation? = null
             try {
                 // Re-check after acquiring the engine: close()/unload() may have
@@ -543,6 +1240,9 @@ class LlamaModel(
                 // Use suspendCancellableCoroutine to bridge the async callback with coroutines.
                 suspendCancellableCoroutine<Unit> { continuation ->
                     val resumed = AtomicBoolean(false)
+                    val startTime = System.currentTimeMillis()
+                    var firstTokenMs = 0L
+                    var chunks = 0
 
                     val callback = object : MessageCallback {
                         override fun onMessage(message: Message) {
@@ -551,6 +1251,7 @@ class LlamaModel(
                             // This avoids redundant IOException throws and keeps the
                             // native callback thread free.
                             if (resumed.get()) return
+                            if (chunks++ == 0) firstTokenMs = System.currentTimeMillis() - startTime
 
                             // Emit each token chunk directly as it arrives from the engine.
                             // No buffering or artificial delays — let the native engine pace output.
@@ -558,6 +1259,14 @@ class LlamaModel(
                             // they will crash the native engine / the Android process.
                             try {
                                 onToken(message.toString())
+                            } catch (e: StopGenerationException) {
+                                // The caller has all the output it needs; stop the engine
+                                // and finish normally.
+                                if (resumed.compareAndSet(false, true)) {
+                                    try { conversation?.close() } catch (ignored: Exception) { }
+                                    stats.recordStream(chunks, firstTokenMs, System.currentTimeMillis() - startTime)
+                                    continuation.resume(Unit)
+                                }
                             } catch (e: Exception) {
                                 LogManager.w(TAG, "Token callback error (client may have disconnected): ${e.message}")
                                 if (resumed.compareAndSet(false, true)) {
@@ -574,7 +1283,10 @@ class LlamaModel(
 
                         override fun onDone() {
                             LogManager.i(TAG, "Streaming completed")
+                            // Only if the generation has not already ended (stopped early,
+                            // failed, or client disconnected), so that it is recorded once
                             if (resumed.compareAndSet(false, true)) {
+                                stats.recordStream(chunks, firstTokenMs, System.currentTimeMillis() - startTime)
                                 continuation.resume(Unit)
                             }
                         }
@@ -601,7 +1313,7 @@ class LlamaModel(
                 try { conversation?.close() } catch (e: Exception) {
                     LogManager.w(TAG, "Error closing conversation: ${e.message}")
                 }
-                enginePool.offer(eng)  // always return engine to pool
+                returnEngine(pool, eng)  // always return engine to pool
             }
         }
     }
@@ -625,7 +1337,7 @@ class LlamaModel(
             return null
         }
 
-        LogManager.d(TAG, "Streaming multimodal with ${contents.size} content parts - config: maxTokens=${config.maxTokens}, temp=${config.temperature}, topK=${config.topK}, topP=${config.topP}")
+        LogManager.d(TAG) { "Streaming multimodal with ${contents.size} content parts - config: maxTokens=${config.maxTokens}, temp=${config.temperature}, topK=${config.topK}, topP=${config.topP}" }
 
         // For mock model, simulate streaming
         if (modelPath == "mock-model") {
@@ -637,7 +1349,16 @@ class LlamaModel(
 
         return scope.launch {
             // Same pool-borrow pattern as generateStream().
-            val eng = enginePool.take()
+            val borrowed = try {
+                borrowEngine(ContextManager.estimateContentTokens(contents) + config.maxTokens, ContextManager.isMultimodal(contents))
+            } catch (e: MultimodalUnavailableException) {
+                onToken("Error: ${e.message}")
+                return@launch
+            }
+            val (pool, eng) = borrowed ?: run {
+                onToken("Error: Model not loaded. Please load a model first.")
+                return@launch
+            }
             var conversation: Conversation? = null
             try {
                 if (!isLoaded) {
@@ -655,6 +1376,9 @@ class LlamaModel(
 
                 suspendCancellableCoroutine<Unit> { continuation ->
                     val resumed = AtomicBoolean(false)
+                    val startTime = System.currentTimeMillis()
+                    var firstTokenMs = 0L
+                    var chunks = 0
 
                     val callback = object : MessageCallback {
                         override fun onMessage(message: Message) {
@@ -663,12 +1387,21 @@ class LlamaModel(
                             // This avoids redundant IOException throws and keeps the
                             // native callback thread free.
                             if (resumed.get()) return
+                            if (chunks++ == 0) firstTokenMs = System.currentTimeMillis() - startTime
 
                             // Emit each token chunk directly as it arrives from the engine.
                             // Wrap in try-catch: exceptions must never escape a JNI callback or
                             // they will crash the native engine / the Android process.
                             try {
                                 onToken(message.toString())
+                            } catch (e: StopGenerationException) {
+                                // The caller has all the output it needs; stop the engine
+                                // and finish normally.
+                                if (resumed.compareAndSet(false, true)) {
+                                    try { conversation?.close() } catch (ignored: Exception) { }
+                                    stats.recordStream(chunks, firstTokenMs, System.currentTimeMillis() - startTime)
+                                    continuation.resume(Unit)
+                                }
                             } catch (e: Exception) {
                                 LogManager.w(TAG, "Multimodal token callback error (client may have disconnected): ${e.message}")
                                 if (resumed.compareAndSet(false, true)) {
@@ -686,6 +1419,7 @@ class LlamaModel(
                         override fun onDone() {
                             LogManager.i(TAG, "Multimodal streaming completed")
                             if (resumed.compareAndSet(false, true)) {
+                                stats.recordStream(chunks, firstTokenMs, System.currentTimeMillis() - startTime)
                                 continuation.resume(Unit)
                             }
                         }
@@ -712,7 +1446,7 @@ class LlamaModel(
                 try { conversation?.close() } catch (e: Exception) {
                     LogManager.w(TAG, "Error closing conversation: ${e.message}")
                 }
-                enginePool.offer(eng)  // always return engine to pool
+                returnEngine(pool, eng)  // always return engine to pool
             }
         }
     }
@@ -741,24 +1475,31 @@ class LlamaModel(
                 // will close the active conversation and offer the engine back to the
                 // pool, allowing the drain loop below to collect it.
                 scope.cancel()
-                val count = poolCapacity
-                poolCapacity = 0
-                repeat(count) {
-                    try {
-                        // Wait up to 60 s for each engine to be returned by its finally block.
-                        // In normal operation this is immediate; a timeout indicates that a
-                        // finally block failed to call enginePool.offer() – log a warning so
-                        // the issue can be diagnosed without deadlocking close().
-                        val eng = enginePool.poll(60L, TimeUnit.SECONDS)
-                        if (eng == null) {
-                            LogManager.w(TAG, "Timed out waiting for an engine to be returned to the pool; skipping close() for this slot")
-                        } else {
-                            eng.close()
+                val draining = pools
+                for (pool in draining) {
+                    val count = synchronized(poolLock) {
+                        pool.targetCapacity = 0
+                        pool.capacity.also { pool.capacity = 0 }
+                    }
+                    repeat(count) {
+                        try {
+                            // Wait up to 60 s for each engine to be returned by its finally block.
+                            // In normal operation this is immediate; a timeout indicates that a
+                            // finally block failed to call returnEngine() – log a warning so
+                            // the issue can be diagnosed without deadlocking close().
+                            val eng = pool.engines.poll(60L, TimeUnit.SECONDS)
+                            if (eng == null) {
+                                LogManager.w(TAG, "Timed out waiting for an engine to be returned to pool ${pool.name}; skipping close() for this slot")
+                            } else {
+                                eng.close()
+                            }
+                        } catch (e: Exception) {
+                            LogManager.w(TAG, "Error closing engine instance: ${e.message}")
                         }
-                    } catch (e: Exception) {
-                        LogManager.w(TAG, "Error closing engine instance: ${e.message}")
                     }
                 }
+                pools = emptyList()
+                multimodalPoolConfig = null
                 LogManager.i(TAG, "All engine instances closed")
             }
 
@@ -773,6 +1514,7 @@ class LlamaModel(
         LogManager.i(TAG, "Unloading model")
         cleanup(closeEngine = false)
         modelPath = null
+        setLoadState(LoadState.NOT_LOADED)
     }
     
     /**
@@ -792,6 +1534,7 @@ class LlamaModel(
         // going away.  They re-check isLoaded after borrowing an engine and will
         // return the engine and emit an error instead of starting a new conversation.
         isLoaded = false
+        setLoadState(LoadState.CLOSED)
         cleanup(closeEngine = true)
     }
 }
@@ -4,20 +4,61 @@ import android.util.Log
 import java.text.SimpleDateFormat
 import java.util.Date
 import java.util.Locale
+import java.util.concurrent.ConcurrentLinkedQueue
+import java.util.concurrent.atomic.AtomicInteger
+import java.util.concurrent.atomic.AtomicLong
+import java.util.concurrent.atomic.AtomicReferenceArray
+import java.util.concurrent.locks.LockSupport
 
 /**
  * Centralized logging manager that collects logs in memory for display in the app.
- * Thread-safe implementation using ArrayDeque with synchronized access.
- * Automatically maintains a maximum of MAX_LOGS entries by removing oldest logs.
+ *
+ * Designed to be cheap on the inference hot path (streaming handlers log once per
+ * token):
+ * - A runtime minimum level gates every call; messages below it are dropped before
+ *   any String is built when the lazy `d(tag) { "..." }` overloads are used.
+ * - The in-app log is a lock-free ring buffer of MAX_LOGS slots.  Writers claim a
+ *   sequence number with a single atomic increment and overwrite the oldest slot.
+ * - Forwarding to logcat happens asynchronously on a daemon thread, so callers never
+ *   block on android.util.Log I/O.
  */
 object LogManager {
     private const val MAX_LOGS = 1000
-    private val logs = ArrayDeque<LogEntry>(MAX_LOGS)
-    private val dateFormat = SimpleDateFormat("HH:mm:ss.SSS", Locale.getDefault())
-    
-    // Synchronize access to logs for thread safety
-    private val lock = Any()
-    
+    // Upper bound on records waiting for the logcat drain thread; beyond this new
+    // records are only kept in the ring buffer.
+    private const val MAX_PENDING_LOGCAT = 4096
+
+    private val ring = AtomicReferenceArray<Slot?>(MAX_LOGS)
+    private val nextSeq = AtomicLong(0)
+    // Entries with a sequence number below this are hidden (see clearLogs()).
+    @Volatile private var clearedBeforeSeq = 0L
+
+    private val dateFormat = object : ThreadLocal<SimpleDateFormat>() {
+        override fun initialValue() = SimpleDateFormat("HH:mm:ss.SSS", Locale.getDefault())
+    }
+
+    @Volatile private var minLevel = LogLevel.INFO
+
+    private val logcatQueue = ConcurrentLinkedQueue<LogcatRecord>()
+    // Records claimed by writers and not yet taken by the drain thread (some may
+    // still be on their way into logcatQueue)
+    private val pendingLogcat = AtomicInteger(0)
+    private val droppedLogcat = AtomicLong(0)
+    private val drainThread = Thread({ drainLogcat() }, "hostai-logcat").apply {
+        isDaemon = true
+        priority = Thread.MIN_PRIORITY
+        start()
+    }
+
+    private class Slot(val seq: Long, val entry: LogEntry)
+
+    private class LogcatRecord(
+        val level: LogLevel,
+        val tag: String,
+        val message: String,
+        val throwable: Throwable?
+    )
+
     data class LogEntry(
         val timestamp: Long,
         val level: LogLevel,
@@ -25,92 +66,166 @@ object LogManager {
         val message: String
     ) {
         fun format(): String {
-            val time = dateFormat.format(Date(timestamp))
+            val time = dateFormat.get()!!.format(Date(timestamp))
             return "[$time] [${level.name}] [$tag] $message"
         }
     }
-    
+
     enum class LogLevel {
         DEBUG, INFO, WARN, ERROR
     }
-    
+
+    /**
+     * Set the minimum level that is recorded; lower-level calls become no-ops.
+     */
+    fun setMinLevel(level: LogLevel) {
+        minLevel = level
+    }
+
+    fun getMinLevel(): LogLevel = minLevel
+
+    /**
+     * Whether a message at [level] would be recorded.  Used by the lazy overloads.
+     */
+    fun isLoggable(level: LogLevel): Boolean = level.ordinal >= minLevel.ordinal
+
+    /**
+     * Number of records that were kept in memory but not forwarded to logcat because
+     * the drain thread fell behind.
+     */
+    fun getDroppedLogcatCount(): Long = droppedLogcat.get()
+
     /**
      * Log a debug message
      */
     fun d(tag: String, message: String) {
-        addLog(LogLevel.DEBUG, tag, message)
-        Log.d(tag, message)
+        log(LogLevel.DEBUG, tag, message, null)
+    }
+
+    /**
+     * Log a debug message built lazily; [message] is not evaluated when DEBUG is disabled.
+     */
+    inline fun d(tag: String, message: () -> String) {
+        if (isLoggable(LogLevel.DEBUG)) d(tag, message())
     }
-    
+
     /**
      * Log an info message
      */
     fun i(tag: String, message: String) {
-        addLog(LogLevel.INFO, tag, message)
-        Log.i(tag, message)
+        log(LogLevel.INFO, tag, message, null)
     }
-    
+
+    /**
+     * Log an info message built lazily; [message] is not evaluated when INFO is disabled.
+     */
+    inline fun i(tag: String, message: () -> String) {
+        if (isLoggable(LogLevel.INFO)) i(tag, message())
+    }
+
     /**
      * Log a warning message
      */
     fun w(tag: String, message: String) {
-        addLog(LogLevel.WARN, tag, message)
-        Log.w(tag, message)
+        log(LogLevel.WARN, tag, message, null)
     }
-    
+
     /**
      * Log an error message
      */
     fun e(tag: String, message: String, throwable: Throwable? = null) {
+        log(LogLevel.ERROR, tag, message, throwable)
+    }
+
+    private fun log(level: LogLevel, tag: String, message: String, throwable: Throwable?) {
+        if (!isLoggable(level)) return
+
         val fullMessage = if (throwable != null) {
             "$message\n${throwable.stackTraceToString()}"
         } else {
             message
         }
-        addLog(LogLevel.ERROR, tag, fullMessage)
-        if (throwable != null) {
-            Log.e(tag, message, throwable)
-        } else {
-            Log.e(tag, message)
+        addLog(level, tag, fullMessage)
+
+        val pending = pendingLogcat.incrementAndGet()
+        if (pending > MAX_PENDING_LOGCAT) {
+            pendingLogcat.decrementAndGet()
+            droppedLogcat.incrementAndGet()
+            return
         }
+        logcatQueue.offer(LogcatRecord(level, tag, message, throwable))
+        // Only the first record after the queue ran empty needs to wake the drain thread
+        if (pending == 1) LockSupport.unpark(drainThread)
     }
-    
+
     private fun addLog(level: LogLevel, tag: String, message: String) {
-        synchronized(lock) {
-            val entry = LogEntry(System.currentTimeMillis(), level, tag, message)
-            logs.add(entry)
-            
-            // Keep only the last MAX_LOGS entries
-            if (logs.size > MAX_LOGS) {
-                logs.removeFirst()
+        val entry = LogEntry(System.currentTimeMillis(), level, tag, message)
+        val seq = nextSeq.getAndIncrement()
+        // The slot at seq % MAX_LOGS held entry seq - MAX_LOGS, which is exactly the one
+        // that falls out of the window, so overwriting it keeps the last MAX_LOGS entries.
+        ring.set((seq % MAX_LOGS).toInt(), Slot(seq, entry))
+    }
+
+    /**
+     * Forward queued records to logcat.  Runs forever on [drainThread], parked while
+     * there is nothing to forward; a writer that finds nothing pending unparks it.
+     */
+    private fun drainLogcat() {
+        while (true) {
+            val record = logcatQueue.poll()
+            if (record == null) {
+                // A claimed record not yet offered arrives without another unpark
+                if (pendingLogcat.get() > 0) Thread.yield() else LockSupport.park(this)
+                continue
+            }
+            pendingLogcat.decrementAndGet()
+            try {
+                when (record.level) {
+                    LogLevel.DEBUG -> Log.d(record.tag, record.message)
+                    LogLevel.INFO -> Log.i(record.tag, record.message)
+                    LogLevel.WARN -> Log.w(record.tag, record.message)
+                    LogLevel.ERROR -> if (record.throwable != null) {
+                        Log.e(record.tag, record.message, record.throwable)
+                    } else {
+                        Log.e(record.tag, record.message)
+                    }
+                }
+            } catch (_: Exception) {
+                // Never let a logcat failure kill the drain thread.
             }
         }
     }
-    
+
     /**
      * Get all logs as a formatted string
      */
     fun getAllLogs(): String {
-        synchronized(lock) {
-            return logs.joinToString("\n") { it.format() }
-        }
+        return getLogEntries().joinToString("\n") { it.format() }
     }
-    
+
     /**
-     * Get all log entries
+     * Get all log entries, oldest first.
+     * Slots that are mid-write or were overwritten during the snapshot are skipped.
      */
     fun getLogEntries(): List<LogEntry> {
-        synchronized(lock) {
-            return logs.toList()
+        val end = nextSeq.get()
+        val start = maxOf(end - MAX_LOGS, clearedBeforeSeq, 0L)
+        val result = ArrayList<LogEntry>((end - start).toInt().coerceAtLeast(0))
+        var seq = start
+        while (seq < end) {
+            val slot = ring.get((seq % MAX_LOGS).toInt())
+            if (slot != null && slot.seq == seq) {
+                result.add(slot.entry)
+            }
+            seq++
         }
+        return result
     }
-    
+
     /**
      * Clear all logs
      */
     fun clearLogs() {
-        synchronized(lock) {
-            logs.clear()
-        }
+        clearedBeforeSeq = nextSeq.get()
     }
 }
@@ -14,12 +14,15 @@ import com.wannaphong.hostai.databinding.ActivityLogViewerBinding
 class LogViewerActivity : AppCompatActivity() {
     
     private lateinit var binding: ActivityLogViewerBinding
+    private lateinit var settingsManager: SettingsManager
     
     override fun onCreate(savedInstanceState: Bundle?) {
         super.onCreate(savedInstanceState)
         binding = ActivityLogViewerBinding.inflate(layoutInflater)
         setContentView(binding.root)
         
+        settingsManager = SettingsManager(this)
+        
         setupUI()
         updateLogs()
     }
@@ -45,6 +48,14 @@ class LogViewerActivity : AppCompatActivity() {
         binding.clearLogsButton.setOnClickListener {
             clearLogs()
         }
+        
+        // Debug level takes effect immediately and is remembered across restarts
+        binding.debugLogsSwitch.isChecked = LogManager.getMinLevel() == LogManager.LogLevel.DEBUG
+        binding.debugLogsSwitch.setOnCheckedChangeListener { _, isChecked ->
+            val level = if (isChecked) LogManager.LogLevel.DEBUG else SettingsManager.DEFAULT_LOG_LEVEL
+            LogManager.setMinLevel(level)
+            settingsManager.setLogLevel(level)
+        }
     }
     
     private fun updateLogs() {
@@ -38,7 +38,7 @@ class MainActivity : AppCompatActivity() {
     private var isBound = false
     private var selectedModelPath: String? = null
     private var selectedModelName: String? = null
-    private var wasServerRunningBeforeModelChange = false
+    private var swapAfterModelChange = false
     private lateinit var modelManager: ModelManager
     
     private val serviceConnection = object : ServiceConnection {
@@ -69,6 +69,13 @@ class MainActivity : AppCompatActivity() {
             // Model selection changed, reload from manager
             loadSelectedModelFromManager()
             updateUI()
+            
+            // Switch the running server over to the newly selected model
+            val loadedPath = apiServerService?.getLoadedModel()?.getModelPath()
+            val path = selectedModelPath
+            if (isServerRunning() && path != null && path != loadedPath) {
+                hotSwapModel(path, selectedModelName ?: path)
+            }
         }
     }
     
@@ -93,6 +100,8 @@ class MainActivity : AppCompatActivity() {
         binding = ActivityMainBinding.inflate(layoutInflater)
         setContentView(binding.root)
         
+        LogManager.setMinLevel(SettingsManager(this).getLogLevel())
+        
         modelManager = ModelManager(this)
         loadSelectedModelFromManager()
         
@@ -387,16 +396,25 @@ class MainActivity : AppCompatActivity() {
     private fun changeModel() {
         LogManager.i("MainActivity", "User requested to change model while server is running")
         
-        // Stop the server first
-        wasServerRunningBeforeModelChange = true
-        stopServer()
-        
-        Toast.makeText(this, R.string.server_stopped_to_change_model, Toast.LENGTH_SHORT).show()
-        
-        // Wait for server to stop, then open file picker
-        binding.root.postDelayed({
-            selectModelFile()
-        }, 500)
+        // The server keeps running; the new model is swapped in once selected
+        swapAfterModelChange = true
+        selectModelFile()
+    }
+    
+    /**
+     * Switch the running server to the model at [path] without stopping it.  The
+     * current model keeps serving until the new one is ready.
+     */
+    private fun hotSwapModel(path: String, name: String) {
+        LogManager.i("MainActivity", "Hot swapping to model: $name")
+        Toast.makeText(this, getString(R.string.model_swap_started, name), Toast.LENGTH_LONG).show()
+        apiServerService?.swapModel(path) { success ->
+            runOnUiThread {
+                val message = if (success) R.string.model_swap_done else R.string.model_swap_failed
+                Toast.makeText(this, getString(message, name), Toast.LENGTH_LONG).show()
+                updateUI()
+            }
+        }
     }
     
     private fun selectModelFile() {
@@ -471,13 +489,12 @@ class MainActivity : AppCompatActivity() {
                 Toast.makeText(this, "Model selected: $validFileName", Toast.LENGTH_SHORT).show()
                 updateUI()
                 
-                // If server was running before model change, restart it with the new model
-                if (wasServerRunningBeforeModelChange) {
-                    wasServerRunningBeforeModelChange = false
-                    LogManager.i("MainActivity", "Restarting server with new model")
-                    binding.root.postDelayed({
-                        startServer()
-                    }, 500)
+                // If the server is running, switch it to the new model
+                if (swapAfterModelChange) {
+                    swapAfterModelChange = false
+                    if (isServerRunning()) {
+                        hotSwapModel(model.path, model.name)
+                    }
                 }
             } else {
                 LogManager.e("MainActivity", "Failed to add model")
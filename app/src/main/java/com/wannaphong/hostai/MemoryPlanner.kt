@@ -0,0 +1,154 @@
+package com.wannaphong.hostai
+
+import android.app.ActivityManager
+import android.content.Context
+import java.io.File
+
+/**
+ * Estimates how much memory a model needs per engine and how many engines (parallel
+ * requests) fit in the memory the device has available, so that Max Concurrency
+ * does not have to be found by crashing.
+ *
+ * One engine costs its weights, its KV cache and its working (activation) buffers:
+ * - Weights: the model file size.  Every engine holds its own copy (GPU buffers, or
+ *   repacked CPU weights).
+ * - KV cache: context length x bytes per token.  Bytes per token scale with the
+ *   parameter count (about 32 KB per billion parameters at 16-bit), which is read
+ *   from the model metadata or derived from file size and quantization.
+ * - Activations: a fixed allowance for prefill and sampler buffers.
+ *
+ * After a load, [calibrate] compares the estimate with the resident memory the
+ * engines actually added and stores the ratio per model and backend, which later
+ * estimates for that model are multiplied by.
+ */
+class MemoryPlanner(private val context: Context) {
+
+    /**
+     * Estimated memory for one engine.
+     * @property calibration Measured/estimated ratio applied, 1.0 if never measured
+     */
+    data class Estimate(
+        val weightsBytes: Long,
+        val kvCacheBytes: Long,
+        val activationBytes: Long,
+        val calibration: Double
+    ) {
+        val perEngineBytes: Long
+            get() = ((weightsBytes + kvCacheBytes + activationBytes) * calibration).toLong()
+    }
+
+    /**
+     * Result of [plan].
+     * @property safeEngines Engines that fit in [availableBytes] (at least 1, at most
+     *   [requestedEngines])
+     */
+    data class Plan(
+        val estimate: Estimate,
+        val requestedEngines: Int,
+        val safeEngines: Int,
+        val availableBytes: Long
+    ) {
+        val fitsAll: Boolean get() = safeEngines >= requestedEngines
+    }
+
+    private val modelManager = ModelManager(context)
+
+    companion object {
+        private const val TAG = "MemoryPlanner"
+
+        private const val KV_BYTES_PER_TOKEN_PER_BILLION_PARAMS = 32 * 1024L
+        private const val ACTIVATION_BYTES = 96L * 1024 * 1024
+        // Bytes per parameter when the quantization is unknown (mixed int4/int8 exports)
+        private const val DEFAULT_BYTES_PER_PARAM = 0.75
+        // Keep this much of total RAM free on top of the low-memory threshold
+        private const val HEADROOM_FRACTION = 0.10
+        // Calibration ratios outside this range are treated as measurement errors
+        private const val MIN_CALIBRATION = 0.5
+        private const val MAX_CALIBRATION = 4.0
+
+        /**
+         * Resident memory of this process in bytes, from /proc/self/statm, or -1 if it
+         * cannot be read.  GPU memory is usually not included.
+         */
+        fun residentBytes(): Long {
+            return try {
+                val fields = File("/proc/self/statm").readText().trim().split(Regex("\\s+"))
+                fields[1].toLong() * 4096L
+            } catch (e: Exception) {
+                -1L
+            }
+        }
+    }
+
+    /**
+     * Estimate one engine of the model at [modelPath] with a [contextLength]-token
+     * context on [backend] (a SettingsManager.BACKEND_* value).
+     */
+    fun estimate(
+        modelPath: String,
+        metadata: ModelMetadata?,
+        fileSizeBytes: Long,
+        contextLength: Int,
+        backend: String
+    ): Estimate {
+        val parameters = metadata?.parameterCount
+            ?: (fileSizeBytes / bytesPerParam(metadata?.quantization)).toLong()
+        val kvBytesPerToken = parameters / 1_000_000_000.0 * KV_BYTES_PER_TOKEN_PER_BILLION_PARAMS
+        return Estimate(
+            weightsBytes = fileSizeBytes,
+            kvCacheBytes = (kvBytesPerToken * contextLength).toLong(),
+            activationBytes = ACTIVATION_BYTES,
+            calibration = modelManager.getMemoryCalibration(modelPath, backend)
+        )
+    }
+
+    /**
+     * How many of [requestedEngines] engines with [estimate] fit in the memory
+     * available now (minus the low-memory threshold and some headroom).  When a model
+     * is being replaced, pass the bytes it will free as [reclaimableBytes].
+     */
+    fun plan(estimate: Estimate, requestedEngines: Int, reclaimableBytes: Long = 0L): Plan {
+        val activityManager = context.getSystemService(Context.ACTIVITY_SERVICE) as ActivityManager
+        val memoryInfo = ActivityManager.MemoryInfo()
+        activityManager.getMemoryInfo(memoryInfo)
+        val available = memoryInfo.availMem + reclaimableBytes - memoryInfo.threshold -
+            (memoryInfo.totalMem * HEADROOM_FRACTION).toLong()
+        val perEngine = estimate.perEngineBytes.coerceAtLeast(1L)
+        val fitting = (available.coerceAtLeast(0L) / perEngine).toInt()
+        val safe = fitting.coerceIn(1, requestedEngines.coerceAtLeast(1))
+        LogManager.d(TAG) {
+            "Plan: ${perEngine / 1024 / 1024} MB per engine, ${available.coerceAtLeast(0L) / 1024 / 1024} MB available, " +
+                "$safe of $requestedEngines engine(s) fit"
+        }
+        return Plan(estimate, requestedEngines, safe, available.coerceAtLeast(0L))
+    }
+
+    /**
+     * Record how much resident memory each engine actually added ([measuredPerEngineBytes])
+     * against [estimate].  Resident memory usually excludes GPU memory, so for GPU and
+     * NPU a measurement can only raise the estimate.
+     */
+    fun calibrate(modelPath: String, backend: String, estimate: Estimate, measuredPerEngineBytes: Long) {
+        val uncalibrated = estimate.weightsBytes + estimate.kvCacheBytes + estimate.activationBytes
+        if (measuredPerEngineBytes <= 0L || uncalibrated <= 0L) return
+        var ratio = measuredPerEngineBytes.toDouble() / uncalibrated
+        if (ratio < MIN_CALIBRATION || ratio > MAX_CALIBRATION) {
+            LogManager.w(TAG, "Ignoring implausible memory measurement (ratio $ratio)")
+            return
+        }
+        if (backend != SettingsManager.BACKEND_CPU) {
+            ratio = maxOf(ratio, 1.0)
+        }
+        LogManager.i(TAG, "Measured ${measuredPerEngineBytes / 1024 / 1024} MB per engine " +
+            "(estimated ${uncalibrated / 1024 / 1024} MB); calibration $ratio")
+        modelManager.setMemoryCalibration(modelPath, backend, ratio)
+    }
+
+    private fun bytesPerParam(quantization: String?): Double = when (quantization) {
+        "int4", "q4" -> 0.5
+        "int8", "q8" -> 1.0
+        "fp16", "f16", "bf16" -> 2.0
+        "fp32", "f32" -> 4.0
+        else -> DEFAULT_BYTES_PER_PARAM
+    }
+}
@@ -0,0 +1,140 @@
+package com.wannaphong.hostai
+
+import android.content.ComponentCallbacks2
+import java.util.concurrent.atomic.AtomicLong
+
+/**
+ * Memory pressure reported by Android (onTrimMemory / onLowMemory) and what the
+ * server has given up in response, for /metrics.
+ *
+ * Pressure is graded so that the server sheds memory step by step instead of being
+ * killed with every request in flight:
+ * - [Level.MODERATE]: drop caches (response cache, stored completion cache) and
+ *   unload secondary models that are idle.
+ * - [Level.LOW]: also shrink the primary model's engine pool to one engine.
+ * - [Level.CRITICAL]: also stop admitting new inference requests (503 with
+ *   Retry-After); requests in flight finish.
+ * - [Level.COMPLETE]: also unload the primary model's engines.
+ *
+ * The level only rises until the server recovers (see OpenAIApiServer), which
+ * resets it to [Level.NORMAL].  Thread-safe.
+ */
+class MemoryPressure {
+
+    enum class Level {
+        NORMAL,
+        MODERATE,
+        LOW,
+        CRITICAL,
+        COMPLETE
+    }
+
+    /**
+     * Counters since the server started.
+     * @property lastEventAt Time of the last pressure callback (epoch ms), or 0 if none
+     * @property lastAction What was done for the last callback that raised the level
+     */
+    data class Snapshot(
+        val level: Level,
+        val admitting: Boolean,
+        val events: Long,
+        val cacheDrops: Long,
+        val modelsEvicted: Long,
+        val enginesShed: Long,
+        val modelUnloads: Long,
+        val rejectedRequests: Long,
+        val recoveries: Long,
+        val lastEventAt: Long,
+        val lastAction: String?
+    )
+
+    @Volatile var level = Level.NORMAL
+        private set
+    @Volatile private var lastEventAt = 0L
+    @Volatile private var lastAction: String? = null
+    private val events = AtomicLong(0)
+    private val cacheDrops = AtomicLong(0)
+    private val modelsEvicted = AtomicLong(0)
+    private val enginesShed = AtomicLong(0)
+    private val modelUnloads = AtomicLong(0)
+    private val rejectedRequests = AtomicLong(0)
+    private val recoveries = AtomicLong(0)
+
+    companion object {
+        /**
+         * The level for an onTrimMemory [trimLevel].  TRIM_MEMORY_UI_HIDDEN only means
+         * the app's activity was left, which is not pressure for a server.
+         */
+        @Suppress("DEPRECATION")
+        fun levelFor(trimLevel: Int): Level = when {
+            trimLevel >= ComponentCallbacks2.TRIM_MEMORY_COMPLETE -> Level.COMPLETE
+            trimLevel >= ComponentCallbacks2.TRIM_MEMORY_MODERATE -> Level.LOW
+            trimLevel >= ComponentCallbacks2.TRIM_MEMORY_BACKGROUND -> Level.MODERATE
+            trimLevel >= ComponentCallbacks2.TRIM_MEMORY_UI_HIDDEN -> Level.NORMAL
+            trimLevel >= ComponentCallbacks2.TRIM_MEMORY_RUNNING_CRITICAL -> Level.CRITICAL
+            trimLevel >= ComponentCallbacks2.TRIM_MEMORY_RUNNING_LOW -> Level.LOW
+            trimLevel >= ComponentCallbacks2.TRIM_MEMORY_RUNNING_MODERATE -> Level.MODERATE
+            else -> Level.NORMAL
+        }
+    }
+
+    /** Whether new inference requests are accepted. */
+    val isAdmitting: Boolean get() = level < Level.CRITICAL
+
+    /**
+     * Record a pressure callback at [next].
+     * @return Whether it raised the level (and the server should shed more)
+     */
+    @Synchronized
+    fun raise(next: Level): Boolean {
+        events.incrementAndGet()
+        lastEventAt = System.currentTimeMillis()
+        if (next <= level) return false
+        level = next
+        return true
+    }
+
+    /** Record what was shed for the last raise. */
+    fun recordShed(cachesDropped: Boolean, models: Int, engines: Int, unloaded: Boolean) {
+        if (cachesDropped) cacheDrops.incrementAndGet()
+        modelsEvicted.addAndGet(models.toLong())
+        enginesShed.addAndGet(engines.toLong())
+        if (unloaded) modelUnloads.incrementAndGet()
+        lastAction = buildList {
+            if (cachesDropped) add("dropped caches")
+            if (models > 0) add("unloaded $models idle model(s)")
+            if (engines > 0) add("closed $engines engine(s)")
+            if (level >= Level.CRITICAL) add("stopped admitting requests")
+            if (unloaded) add("unloaded the model")
+        }.joinToString(", ").ifEmpty { "nothing to shed" }
+    }
+
+    fun recordRejected() {
+        rejectedRequests.incrementAndGet()
+    }
+
+    /** Milliseconds since the last pressure callback. */
+    fun quietMs(): Long = System.currentTimeMillis() - lastEventAt
+
+    /** Back to [Level.NORMAL] after the pressure has passed. */
+    @Synchronized
+    fun recover() {
+        if (level == Level.NORMAL) return
+        level = Level.NORMAL
+        recoveries.incrementAndGet()
+    }
+
+    fun snapshot(): Snapshot = Snapshot(
+        level = level,
+        admitting = isAdmitting,
+        events = events.get(),
+        cacheDrops = cacheDrops.get(),
+        modelsEvicted = modelsEvicted.get(),
+        enginesShed = enginesShed.get(),
+        modelUnloads = modelUnloads.get(),
+        rejectedRequests = rejectedRequests.get(),
+        recoveries = recoveries.get(),
+        lastEventAt = lastEventAt,
+        lastAction = lastAction
+    )
+}
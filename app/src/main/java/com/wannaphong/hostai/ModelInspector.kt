@@ -0,0 +1,176 @@
+package com.wannaphong.hostai
+
+import android.content.Context
+import android.net.Uri
+import java.io.File
+import java.io.InputStream
+import java.nio.ByteBuffer
+import java.nio.ByteOrder
+
+/**
+ * What is known about a model file, read on import by [ModelInspector].
+ * Fields are null when the file does not say.
+ * @property formatVersion `.litertlm` container version, or null if the header was not recognised
+ * @property parameterCount Approximate parameter count (effective parameters for Gemma 3n "E" models)
+ * @property quantization Weight quantization, e.g. "int4"
+ * @property maxContextLength Largest context (KV cache) the model was exported with
+ * @property modalities Input modalities: always "text", plus "vision" and/or "audio"
+ * @property tokenizer "sentencepiece" or "huggingface"
+ * @property npuCompiled Whether the model is compiled ahead of time for an NPU
+ */
+data class ModelMetadata(
+    val formatVersion: String?,
+    val parameterCount: Long?,
+    val quantization: String?,
+    val maxContextLength: Int?,
+    val modalities: List<String>,
+    val tokenizer: String?,
+    val npuCompiled: Boolean
+) {
+    /** Whether [modalities] comes from the container header rather than defaults. */
+    val isFromHeader: Boolean get() = formatVersion != null
+
+    val hasVision: Boolean get() = MODALITY_VISION in modalities
+
+    val hasAudio: Boolean get() = MODALITY_AUDIO in modalities
+
+    companion object {
+        const val MODALITY_TEXT = "text"
+        const val MODALITY_VISION = "vision"
+        const val MODALITY_AUDIO = "audio"
+    }
+}
+
+/**
+ * Reads [ModelMetadata] from a `.litertlm` file without loading it.
+ *
+ * The container starts with the magic "LITERTLM", the format version (three
+ * little-endian uint32s) and a FlatBuffers header that lists the sections (prefill /
+ * decode model, vision and audio encoders, tokenizer) with string key-value
+ * metadata.  Rather than depend on the FlatBuffers schema, the header is scanned
+ * for the section and tokenizer names it contains.  Parameter count, quantization
+ * and maximum context are not stored in the header; they come from the naming
+ * convention of published LiteRT-LM models (e.g. "gemma3-1b-it-int4",
+ * "Gemma3-1B-IT_multi-prefill-seq_q8_ekv4096", "gemma-3n-E2B-it-int4").
+ */
+object ModelInspector {
+    private const val TAG = "ModelInspector"
+
+    private const val MAGIC = "LITERTLM"
+    // Offset of the header end offset (uint64) after magic, version and padding
+    private const val HEADER_END_OFFSET_POSITION = 24
+    private const val HEADER_START = 32
+    // Never scan more than this, whatever the header claims
+    private const val MAX_HEADER_BYTES = 1024 * 1024
+    private const val MIN_STRING_LENGTH = 3
+
+    private val PARAMETERS = Regex("(?:^|[-_.])e?(\\d+(?:\\.\\d+)?)([bm])(?=[-_.]|$)", RegexOption.IGNORE_CASE)
+    private val QUANTIZATION = Regex("(?:^|[-_.])(int4|int8|q4|q8|fp16|f16|bf16|fp32|f32)(?=[-_.]|$)", RegexOption.IGNORE_CASE)
+    private val CONTEXT = Regex("ekv(\\d+)", RegexOption.IGNORE_CASE)
+    private val NPU_MARKERS = listOf("npu", "qualcomm", "mediatek", "google_tensor", "_sm8", "_mt6")
+
+    /**
+     * Inspect the model at [path] (a file path or content:// URI) named [fileName].
+     * Never throws: unreadable files get metadata from the file name only.
+     */
+    fun inspect(context: Context, path: String, fileName: String): ModelMetadata {
+        val header = try {
+            open(context, path)?.use { readHeader(it) }
+        } catch (e: Exception) {
+            LogManager.w(TAG, "Could not read header of $fileName: ${e.message}")
+            null
+        }
+        val metadata = fromHeaderAndName(header, fileName)
+        LogManager.i(TAG, "Inspected $fileName: $metadata")
+        return metadata
+    }
+
+    private class Header(val version: String, val strings: List<String>)
+
+    private fun open(context: Context, path: String): InputStream? {
+        return if (path.startsWith("content://")) {
+            context.contentResolver.openInputStream(Uri.parse(path))
+        } else {
+            File(path).takeIf { it.exists() }?.inputStream()
+        }
+    }
+
+    private fun readHeader(input: InputStream): Header? {
+        val prefix = readFully(input, HEADER_START)
+        if (prefix.size < HEADER_START || String(prefix, 0, MAGIC.length, Charsets.US_ASCII) != MAGIC) {
+            return null
+        }
+        val buffer = ByteBuffer.wrap(prefix).order(ByteOrder.LITTLE_ENDIAN)
+        val version = "${buffer.getInt(8)}.${buffer.getInt(12)}.${buffer.getInt(16)}"
+        val headerEnd = buffer.getLong(HEADER_END_OFFSET_POSITION)
+        val length = if (headerEnd > HEADER_START && headerEnd - HEADER_START <= MAX_HEADER_BYTES) {
+            (headerEnd - HEADER_START).toInt()
+        } else {
+            MAX_HEADER_BYTES
+        }
+        return Header(version, extractStrings(readFully(input, length)))
+    }
+
+    private fun readFully(input: InputStream, length: Int): ByteArray {
+        val bytes = ByteArray(length)
+        var offset = 0
+        while (offset < length) {
+            val read = input.read(bytes, offset, length - offset)
+            if (read < 0) break
+            offset += read
+        }
+        return if (offset == length) bytes else bytes.copyOf(offset)
+    }
+
+    // Printable ASCII runs, lowercased: FlatBuffers stores strings inline
+    private fun extractStrings(bytes: ByteArray): List<String> {
+        val strings = ArrayList<String>()
+        val current = StringBuilder()
+        for (b in bytes) {
+            val c = b.toInt() and 0xff
+            if (c in 0x20..0x7e) {
+                current.append(c.toChar())
+            } else {
+                if (current.length >= MIN_STRING_LENGTH) strings.add(current.toString().lowercase())
+                current.setLength(0)
+            }
+        }
+        if (current.length >= MIN_STRING_LENGTH) strings.add(current.toString().lowercase())
+        return strings
+    }
+
+    private fun fromHeaderAndName(header: Header?, fileName: String): ModelMetadata {
+        val name = fileName.substringBeforeLast('.')
+        val strings = header?.strings ?: emptyList()
+
+        val modalities = mutableListOf(ModelMetadata.MODALITY_TEXT)
+        if (strings.any { "vision" in it }) modalities.add(ModelMetadata.MODALITY_VISION)
+        if (strings.any { "audio" in it }) modalities.add(ModelMetadata.MODALITY_AUDIO)
+
+        val tokenizer = when {
+            strings.any { "hf_tokenizer" in it || "tokenizer.json" in it } -> "huggingface"
+            strings.any { "sentencepiece" in it || "sp_tokenizer" in it } -> "sentencepiece"
+            else -> null
+        }
+
+        val lowerName = name.lowercase()
+        val npuCompiled = NPU_MARKERS.any { marker -> marker in lowerName || strings.any { marker in it } }
+
+        return ModelMetadata(
+            formatVersion = header?.version,
+            parameterCount = parseParameterCount(name),
+            quantization = QUANTIZATION.find(name)?.groupValues?.get(1)?.lowercase(),
+            maxContextLength = CONTEXT.find(name)?.groupValues?.get(1)?.toIntOrNull(),
+            modalities = modalities,
+            tokenizer = tokenizer,
+            npuCompiled = npuCompiled
+        )
+    }
+
+    private fun parseParameterCount(name: String): Long? {
+        val match = PARAMETERS.find(name) ?: return null
+        val value = match.groupValues[1].toDoubleOrNull() ?: return null
+        val unit = if (match.groupValues[2].equals("b", ignoreCase = true)) 1e9 else 1e6
+        return (value * unit).toLong()
+    }
+}
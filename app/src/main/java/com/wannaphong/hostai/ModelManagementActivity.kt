@@ -179,6 +179,16 @@ class ModelManagementActivity : AppCompatActivity() {
         val dateFormat = SimpleDateFormat("yyyy-MM-dd HH:mm:ss", Locale.US)
         val date = dateFormat.format(Date(model.addedTimestamp))
         
+        val metadata = model.metadata
+        val details = if (metadata == null) "" else buildString {
+            metadata.parameterCount?.let { append("\n\nParameters: ${formatParameterCount(it)}") }
+            metadata.quantization?.let { append("\n\nQuantization: $it") }
+            metadata.maxContextLength?.let { append("\n\nMax context: $it tokens") }
+            append("\n\nInputs: ${metadata.modalities.joinToString(", ")}")
+            metadata.tokenizer?.let { append("\n\nTokenizer: $it") }
+            if (metadata.npuCompiled) append("\n\nCompiled for NPU")
+        }
+        
         val message = """
             Name: ${model.name}
             
@@ -187,7 +197,7 @@ class ModelManagementActivity : AppCompatActivity() {
             Added: $date
             
             Path: ${model.path}
-        """.trimIndent()
+        """.trimIndent() + details
         
         AlertDialog.Builder(this)
             .setTitle(getString(R.string.model_info))
@@ -196,6 +206,14 @@ class ModelManagementActivity : AppCompatActivity() {
             .show()
     }
     
+    private fun formatParameterCount(count: Long): String {
+        return if (count >= 1_000_000_000L) {
+            String.format(Locale.US, "%.1fB", count / 1e9)
+        } else {
+            String.format(Locale.US, "%dM", count / 1_000_000L)
+        }
+    }
+    
     private fun confirmDeleteModel(model: StoredModel) {
         AlertDialog.Builder(this)
             .setTitle(getString(R.string.confirm_delete_model))
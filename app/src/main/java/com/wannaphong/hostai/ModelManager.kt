@@ -11,6 +11,7 @@ import java.io.File
 /**
  * Data class representing a stored model.
  * [path] may be either an absolute file-system path or a content:// URI string.
+ * [metadata] is read from the file on import (null for models added before that).
  */
 data class StoredModel(
     val id: String,
@@ -18,7 +19,8 @@ data class StoredModel(
     val path: String,
     val sizeBytes: Long,
     val addedTimestamp: Long,
-    val isSelected: Boolean = false
+    val isSelected: Boolean = false,
+    val metadata: ModelMetadata? = null
 )
 
 /**
@@ -37,6 +39,8 @@ class ModelManager(private val context: Context) {
         private const val PREFS_NAME = "model_prefs"
         private const val KEY_MODELS = "models"
         private const val KEY_SELECTED_MODEL_ID = "selected_model_id"
+        private const val KEY_LOAD_DURATION_PREFIX = "load_duration_ms_"
+        private const val KEY_MEMORY_CALIBRATION_PREFIX = "memory_calibration_"
         private const val MODELS_DIR = "models"
     }
     
@@ -129,7 +133,8 @@ class ModelManager(private val context: Context) {
                     path = destFile.absolutePath,
                     sizeBytes = destFile.length(),
                     addedTimestamp = System.currentTimeMillis(),
-                    isSelected = false
+                    isSelected = false,
+                    metadata = ModelInspector.inspect(context, destFile.absolutePath, destFile.name)
                 )
                 
                 // Add to list
@@ -174,7 +179,8 @@ class ModelManager(private val context: Context) {
                     path = uriString,
                     sizeBytes = fileSize,
                     addedTimestamp = System.currentTimeMillis(),
-                    isSelected = false
+                    isSelected = false,
+                    metadata = ModelInspector.inspect(context, uriString, fileName)
                 )
                 val models = getModels().toMutableList()
                 models.add(model)
@@ -323,6 +329,54 @@ class ModelManager(private val context: Context) {
         return getModels().find { it.id == modelId }
     }
     
+    /**
+     * Get the metadata of the model at [path], reading it from the file if the model
+     * was stored before metadata existed (the result is then saved) or is not stored.
+     */
+    fun getMetadata(path: String): ModelMetadata {
+        getModels().find { it.path == path }?.metadata?.let { return it }
+        val fileName = getModels().find { it.path == path }?.name
+            ?: path.substringAfterLast('/').substringAfterLast(':')
+        val metadata = ModelInspector.inspect(context, path, fileName)
+        synchronized(lock) {
+            val models = getModels()
+            if (models.any { it.path == path }) {
+                saveModels(models.map { if (it.path == path) it.copy(metadata = metadata) else it })
+            }
+        }
+        return metadata
+    }
+    
+    /**
+     * Get how long the last successful load of the model at [path] took (0 if never loaded).
+     * Used to estimate when a loading model will be ready.
+     */
+    fun getLoadDurationMs(path: String): Long {
+        return prefs.getLong(KEY_LOAD_DURATION_PREFIX + path.hashCode(), 0L)
+    }
+    
+    /**
+     * Record how long loading the model at [path] took
+     */
+    fun setLoadDurationMs(path: String, durationMs: Long) {
+        prefs.edit().putLong(KEY_LOAD_DURATION_PREFIX + path.hashCode(), durationMs).apply()
+    }
+    
+    /**
+     * Get the measured/estimated memory ratio for the model at [path] on [backend]
+     * (1.0 if never measured).  See [MemoryPlanner].
+     */
+    fun getMemoryCalibration(path: String, backend: String): Double {
+        return prefs.getFloat(KEY_MEMORY_CALIBRATION_PREFIX + backend + "_" + path.hashCode(), 1.0f).toDouble()
+    }
+    
+    /**
+     * Record the measured/estimated memory ratio for the model at [path] on [backend]
+     */
+    fun setMemoryCalibration(path: String, backend: String, ratio: Double) {
+        prefs.edit().putFloat(KEY_MEMORY_CALIBRATION_PREFIX + backend + "_" + path.hashCode(), ratio.toFloat()).apply()
+    }
+    
     /**
      * Generate a unique model ID
      */
@@ -0,0 +1,486 @@
+package com.wannaphong.hostai
+
+import android.app.ActivityManager
+import android.content.Context
+import java.io.File
+import java.util.concurrent.TimeUnit
+import java.util.concurrent.locks.ReentrantLock
+import kotlin.concurrent.withLock
+
+/**
+ * Thrown when the model a request asks for cannot be made available (load failure,
+ * not enough memory budget even after evicting idle models, or still loading).
+ * @property retryAfterSeconds When the client should retry, if the model is expected
+ *   to become available
+ */
+class ModelUnavailableException(
+    message: String,
+    val retryAfterSeconds: Int? = null
+) : Exception(message)
+
+/**
+ * The models the server can answer with, and the routing of requests to them.
+ *
+ * The primary model is the one the service loaded at startup; it is always resident.
+ * A request whose `model` field names another model from [ModelManager] (by name,
+ * name without extension, or ID) is served by that model, which is loaded on first
+ * use.  Unknown or empty model names go to the primary model, so OpenAI clients that
+ * send placeholder names such as "gpt-3.5-turbo" keep working.
+ *
+ * Resident models share a memory budget (Settings, or half of the device RAM by
+ * default), with each model's cost estimated from its weights file.  Loading a model
+ * that does not fit evicts the least recently used secondary models that have no
+ * request in progress; if that is not enough the request fails with
+ * [ModelUnavailableException].
+ *
+ * The primary model can be replaced while serving with [swapPrimary]: the new model
+ * is loaded next to the old one, routing switches to it atomically, and the old
+ * model is closed once the requests still using it have finished.  When both do not
+ * fit in the budget the old model is drained and closed first, and requests for the
+ * primary model wait until the new one is ready.
+ *
+ * Requests for the primary model while it is still loading (the server starts before
+ * the model is loaded) wait for the load to finish, up to [LOAD_WAIT_TIMEOUT_MS].
+ *
+ * Thread-safe.  Callers [acquire] a [Lease] and must release it when the request ends.
+ */
+class ModelRegistry(
+    private val context: Context,
+    initialPrimary: LlamaModel
+) {
+    /** How [swapPrimary] makes room for the new model. */
+    enum class SwapMode {
+        /** Load alongside the old model if the budget allows, otherwise drain first. */
+        AUTO,
+        /** Load alongside the old model; fail if the budget does not allow it. */
+        PARALLEL,
+        /** Finish in-flight requests and close the old model before loading the new one. */
+        DRAIN
+    }
+
+    /** A model in use by one request; prevents it from being evicted. */
+    class Lease internal constructor(val model: LlamaModel, private val onRelease: (() -> Unit)?) {
+        private var released = false
+
+        fun release() {
+            if (released) return
+            released = true
+            onRelease?.invoke()
+        }
+    }
+
+    private class Entry(
+        val storedModel: StoredModel?,
+        val model: LlamaModel,
+        val costBytes: Long
+    ) {
+        var activeRequests = 0
+        var lastUsed = System.currentTimeMillis()
+    }
+
+    private val modelManager = ModelManager(context)
+    private val settingsManager = SettingsManager(context)
+    private val lock = ReentrantLock()
+    // Signalled when a lease is released or a swap finishes
+    private val changed = lock.newCondition()
+    // The primary model; replaced only by [swapPrimary]
+    @Volatile private var primary = Entry(null, initialPrimary, 0L)
+    // True while a drain-first swap has no primary model to route to
+    private var swapping = false
+    // Secondary resident models by stored model ID
+    private val resident = HashMap<String, Entry>()
+    // Bytes claimed by loads in progress and by replaced models still draining
+    private var reservedBytes = 0L
+    // One lock per model ID so concurrent requests for a cold model share one load
+    private val loadLocks = HashMap<String, Any>()
+    // One swap at a time
+    private val swapLock = Any()
+
+    companion object {
+        private const val TAG = "ModelRegistry"
+        // How long a swap waits for in-flight requests before closing the old model anyway
+        private const val DRAIN_TIMEOUT_MS = 5 * 60 * 1000L
+        // How long a request waits for a drain-first swap to finish
+        private const val SWAP_WAIT_TIMEOUT_MS = 2 * 60 * 1000L
+        // How long a request waits for the primary model to finish loading
+        private const val LOAD_WAIT_TIMEOUT_MS = 60 * 1000L
+        // Retry-After when the remaining load time is unknown
+        private const val DEFAULT_RETRY_AFTER_SECONDS = 5
+        // Retry-After while the primary model's engines are unloaded for memory pressure
+        private const val SUSPENDED_RETRY_AFTER_SECONDS = 30
+    }
+
+    /**
+     * Resolve [requestedModel] (a request's `model` field) to a loaded model,
+     * loading it if needed.
+     * @throws ModelUnavailableException if the model cannot be loaded
+     */
+    fun acquire(requestedModel: String?): Lease {
+        val stored = findStoredModel(requestedModel)
+        if (stored == null || isPrimary(stored)) {
+            return leasePrimary()
+        }
+
+        lock.withLock {
+            resident[stored.id]?.let { return leaseFor(it) }
+        }
+
+        val loadLock = lock.withLock { loadLocks.getOrPut(stored.id) { Any() } }
+        synchronized(loadLock) {
+            lock.withLock {
+                resident[stored.id]?.let { return leaseFor(it) }
+            }
+            val entry = load(stored)
+            lock.withLock {
+                resident[stored.id] = entry
+                return leaseFor(entry)
+            }
+        }
+    }
+
+    /** The model that requests without a known model name are routed to. */
+    fun primaryModel(): LlamaModel = primary.model
+
+    /**
+     * The model [requestedModel] resolves to if it is resident, without loading it.
+     * @return The model, or null if it names a stored model that is not loaded
+     */
+    fun residentModel(requestedModel: String?): LlamaModel? {
+        val stored = findStoredModel(requestedModel)
+        if (stored == null || isPrimary(stored)) return primary.model
+        return lock.withLock { resident[stored.id]?.model }
+    }
+
+    /**
+     * Replace the primary model with the model at [modelPath] (a stored model path or
+     * content URI) without stopping the server.  Blocks until the old model is closed.
+     * @return The new primary model
+     * @throws ModelUnavailableException if the new model cannot be loaded; the old
+     *   model keeps serving (or is reloaded, after a drain-first swap)
+     */
+    fun swapPrimary(modelPath: String, mode: SwapMode = SwapMode.AUTO): LlamaModel {
+        synchronized(swapLock) {
+            val old = primary
+            if (old.model.getModelPath() == modelPath && old.model.isModelLoaded()) {
+                LogManager.i(TAG, "Model $modelPath is already the primary model")
+                return old.model
+            }
+
+            // A model already resident as a secondary is promoted without loading
+            val promoted = lock.withLock {
+                resident.entries.firstOrNull { it.value.storedModel?.path == modelPath }
+                    ?.also { resident.remove(it.key) }
+                    ?.value
+            }
+            if (promoted != null) {
+                LogManager.i(TAG, "Promoting resident model ${promoted.model.getModelName()} to primary")
+                switchPrimary(old, Entry(null, promoted.model, promoted.costBytes))
+                return promoted.model
+            }
+
+            val stored = modelManager.getModels().firstOrNull { it.path == modelPath }
+            val name = stored?.name ?: modelPath.substringAfterLast('/')
+            val cost = stored?.let { estimateCost(it) } ?: fileCost(modelPath)
+            val drainFirst = when (mode) {
+                SwapMode.DRAIN -> true
+                SwapMode.PARALLEL -> false
+                SwapMode.AUTO -> !tryReserve(name, cost)
+            }
+            if (drainFirst) {
+                return swapDrainFirst(old, modelPath, name, cost)
+            }
+            if (mode == SwapMode.PARALLEL) {
+                reserve(name, cost)
+            }
+
+            // Load alongside the old model, which keeps serving meanwhile
+            LogManager.i(TAG, "Hot swap: loading $name alongside ${old.model.getModelName()}")
+            val model = try {
+                loadModel(modelPath, name)
+            } finally {
+                lock.withLock { reservedBytes -= cost }
+            }
+            switchPrimary(old, Entry(null, model, cost))
+            return model
+        }
+    }
+
+    /**
+     * Names of every model a request can select: the primary model first, then all
+     * stored models, with whether each is currently loaded.
+     */
+    fun listModels(): List<Pair<String, Boolean>> {
+        val loadedIds = lock.withLock { resident.keys.toSet() }
+        val current = primary.model
+        val primaryName = current.getModelName()
+        val others = modelManager.getModels()
+            .filter { !isPrimary(it) && it.name != primaryName }
+            .map { it.name to (it.id in loadedIds) }
+        return listOf(primaryName to current.isModelLoaded()) + others
+    }
+
+    /** Currently loaded secondary models. */
+    fun residentModels(): List<LlamaModel> = lock.withLock { resident.values.map { it.model } }
+
+    /**
+     * Unload the secondary models that have no request in progress, to free memory
+     * under pressure.  They are loaded again on their next request.
+     * @return Number of models unloaded
+     */
+    fun evictIdle(): Int {
+        val evicted = lock.withLock {
+            val idle = resident.entries.filter { it.value.activeRequests == 0 }
+            idle.forEach { resident.remove(it.key) }
+            idle.map { it.value }
+        }
+        for (entry in evicted) {
+            LogManager.i(TAG, "Evicting idle model ${entry.model.getModelName()} to free memory")
+            entry.model.close()
+        }
+        return evicted.size
+    }
+
+    /**
+     * Unload every secondary model (the primary model is owned by the service).
+     */
+    fun close() {
+        val entries = lock.withLock {
+            resident.values.toList().also { resident.clear() }
+        }
+        entries.forEach { it.model.close() }
+    }
+
+    private fun leasePrimary(): Lease {
+        val lease = lock.withLock {
+            var remainingNanos = TimeUnit.MILLISECONDS.toNanos(SWAP_WAIT_TIMEOUT_MS)
+            while (swapping) {
+                if (remainingNanos <= 0L) {
+                    throw ModelUnavailableException(
+                        "Model is being replaced; try again shortly",
+                        DEFAULT_RETRY_AFTER_SECONDS
+                    )
+                }
+                remainingNanos = changed.awaitNanos(remainingNanos)
+            }
+            leaseFor(primary)
+        }
+        if (lease.model.isModelLoaded() || lease.model.awaitLoaded(LOAD_WAIT_TIMEOUT_MS)) {
+            return lease
+        }
+        lease.release()
+        val status = lease.model.getLoadStatus()
+        throw when (status.state) {
+            LlamaModel.LoadState.NOT_LOADED, LlamaModel.LoadState.LOADING -> ModelUnavailableException(
+                "Model is still loading; try again shortly",
+                retryAfterSeconds(status)
+            )
+            // No load is running; the engines come back once memory pressure is over
+            LlamaModel.LoadState.SUSPENDED -> ModelUnavailableException(
+                "Model is unloaded while the device is low on memory; try again shortly",
+                SUSPENDED_RETRY_AFTER_SECONDS
+            )
+            else -> ModelUnavailableException(status.error ?: "Model is not loaded")
+        }
+    }
+
+    private fun leaseFor(entry: Entry): Lease {
+        // Called with [lock] held
+        entry.activeRequests++
+        entry.lastUsed = System.currentTimeMillis()
+        return Lease(entry.model) {
+            lock.withLock {
+                entry.activeRequests--
+                entry.lastUsed = System.currentTimeMillis()
+                changed.signalAll()
+            }
+        }
+    }
+
+    /**
+     * Route new requests to [next], then close [old] once its requests have finished.
+     * The old model's memory stays reserved until it is closed.
+     */
+    private fun switchPrimary(old: Entry, next: Entry) {
+        val oldCost = primaryCost()
+        lock.withLock {
+            primary = next
+            reservedBytes += oldCost
+        }
+        LogManager.i(TAG, "Routing switched to ${next.model.getModelName()}; draining ${old.model.getModelName()}")
+        try {
+            drain(old)
+            old.model.close()
+        } finally {
+            lock.withLock { reservedBytes -= oldCost }
+        }
+        LogManager.i(TAG, "Closed ${old.model.getModelName()}")
+    }
+
+    /**
+     * Hold new primary requests, close [old] once idle, then load the new model.  If
+     * that fails the old model is loaded again so the server is not left without one.
+     */
+    private fun swapDrainFirst(old: Entry, modelPath: String, name: String, cost: Long): LlamaModel {
+        LogManager.i(TAG, "Hot swap: draining ${old.model.getModelName()} before loading $name")
+        lock.withLock { swapping = true }
+        try {
+            drain(old)
+            old.model.close()
+            val next = try {
+                reserve(name, cost)
+                try {
+                    Entry(null, loadModel(modelPath, name), cost)
+                } finally {
+                    lock.withLock { reservedBytes -= cost }
+                }
+            } catch (e: ModelUnavailableException) {
+                val oldPath = old.model.getModelPath()
+                LogManager.w(TAG, "Swap to $name failed; reloading previous model $oldPath")
+                val restored = LlamaModel(context.contentResolver, context)
+                if (oldPath != null) {
+                    restored.loadModel(oldPath)
+                }
+                lock.withLock { primary = Entry(null, restored, old.costBytes) }
+                throw e
+            }
+            lock.withLock { primary = next }
+            LogManager.i(TAG, "Routing switched to $name")
+            return next.model
+        } finally {
+            lock.withLock {
+                swapping = false
+                changed.signalAll()
+            }
+        }
+    }
+
+    private fun retryAfterSeconds(status: LlamaModel.LoadStatus): Int {
+        val etaMs = status.etaMs ?: return DEFAULT_RETRY_AFTER_SECONDS
+        return ((etaMs + 999) / 1000).toInt().coerceAtLeast(1)
+    }
+
+    /** Wait until no request holds a lease on [entry], up to [DRAIN_TIMEOUT_MS]. */
+    private fun drain(entry: Entry) {
+        lock.withLock {
+            var remainingNanos = TimeUnit.MILLISECONDS.toNanos(DRAIN_TIMEOUT_MS)
+            while (entry.activeRequests > 0) {
+                if (remainingNanos <= 0L) {
+                    LogManager.w(TAG, "${entry.activeRequests} request(s) still running on ${entry.model.getModelName()} after drain timeout; closing anyway")
+                    return
+                }
+                remainingNanos = changed.awaitNanos(remainingNanos)
+            }
+        }
+    }
+
+    private fun load(stored: StoredModel): Entry {
+        val cost = estimateCost(stored)
+        reserve(stored.name, cost)
+        try {
+            LogManager.i(TAG, "Loading ${stored.name} on demand (${cost / 1024 / 1024} MB)")
+            return Entry(stored, loadModel(stored.path, stored.name), cost)
+        } finally {
+            lock.withLock { reservedBytes -= cost }
+        }
+    }
+
+    private fun loadModel(path: String, name: String): LlamaModel {
+        val model = LlamaModel(context.contentResolver, context)
+        if (!model.loadModel(path)) {
+            model.close()
+            throw ModelUnavailableException("Failed to load model $name")
+        }
+        return model
+    }
+
+    /** [reserve], returning false instead of throwing when [cost] does not fit. */
+    private fun tryReserve(name: String, cost: Long): Boolean {
+        return try {
+            reserve(name, cost)
+            true
+        } catch (e: ModelUnavailableException) {
+            false
+        }
+    }
+
+    /**
+     * Make room for [cost] bytes within the budget, evicting idle secondary models
+     * least recently used first, and reserve it for the load in progress.
+     */
+    private fun reserve(name: String, cost: Long) {
+        val budget = memoryBudgetBytes()
+        val evicted = ArrayList<Entry>()
+        lock.withLock {
+            // During a drain-first swap the old primary model is already closed
+            val primaryBytes = if (swapping) 0L else primaryCost()
+            var used = primaryBytes + reservedBytes + resident.values.sumOf { it.costBytes }
+            if (used + cost > budget) {
+                val candidates = resident.entries
+                    .filter { it.value.activeRequests == 0 }
+                    .sortedBy { it.value.lastUsed }
+                for ((id, entry) in candidates) {
+                    if (used + cost <= budget) break
+                    resident.remove(id)
+                    used -= entry.costBytes
+                    evicted.add(entry)
+                }
+            }
+            if (used + cost > budget) {
+                // Put back what was taken out; nothing is closed
+                evicted.forEach { entry -> entry.storedModel?.let { resident[it.id] = entry } }
+                throw ModelUnavailableException(
+                    "Not enough memory to load $name " +
+                        "(needs ${cost / 1024 / 1024} MB, ${(budget - used).coerceAtLeast(0) / 1024 / 1024} MB free in budget)"
+                )
+            }
+            reservedBytes += cost
+        }
+        for (entry in evicted) {
+            LogManager.i(TAG, "Evicting ${entry.model.getModelName()} to load $name")
+            entry.model.close()
+        }
+    }
+
+    /**
+     * The stored model named [name] (by name, name without extension, or ID), if any.
+     */
+    fun findStoredModelByName(name: String): StoredModel? {
+        val trimmed = name.trim()
+        return modelManager.getModels().firstOrNull {
+            it.name == trimmed || it.id == trimmed || it.name.substringBeforeLast('.') == trimmed
+        }
+    }
+
+    private fun findStoredModel(requestedModel: String?): StoredModel? {
+        val name = requestedModel?.trim()
+        if (name.isNullOrEmpty() || name == primary.model.getModelName()) return null
+        return findStoredModelByName(name)
+    }
+
+    private fun isPrimary(stored: StoredModel): Boolean = stored.path == primary.model.getModelPath()
+
+    private fun estimateCost(stored: StoredModel): Long {
+        if (stored.sizeBytes > 0) return stored.sizeBytes
+        return fileCost(stored.path)
+    }
+
+    private fun fileCost(path: String): Long {
+        val file = File(path)
+        return if (file.exists()) file.length() else 0L
+    }
+
+    private fun primaryCost(): Long {
+        val path = primary.model.getModelPath() ?: return 0L
+        val stored = modelManager.getModels().firstOrNull { it.path == path }
+        return stored?.let { estimateCost(it) } ?: fileCost(path)
+    }
+
+    private fun memoryBudgetBytes(): Long {
+        val configuredMb = settingsManager.getModelMemoryBudgetMb()
+        if (configuredMb > 0) return configuredMb * 1024L * 1024L
+        val activityManager = context.getSystemService(Context.ACTIVITY_SERVICE) as ActivityManager
+        val memoryInfo = ActivityManager.MemoryInfo()
+        activityManager.getMemoryInfo(memoryInfo)
+        return memoryInfo.totalMem / 2
+    }
+}
@@ -1,20 +1,37 @@
 package com.wannaphong.hostai
 
+import android.app.ActivityManager
 import android.content.Context
 import android.util.Base64
 import com.google.ai.edge.litertlm.Content
 import com.google.gson.Gson
 import com.google.gson.GsonBuilder
+import com.google.gson.JsonElement
 import com.google.gson.JsonObject
+import com.google.gson.JsonPrimitive
 import com.google.gson.reflect.TypeToken
 import io.javalin.Javalin
+import io.javalin.compression.CompressionStrategy
+import io.javalin.compression.Gzip
 import io.javalin.http.Context as JavalinContext
+import io.javalin.websocket.WsConnectContext
+import io.javalin.websocket.WsContext
+import io.javalin.websocket.WsMessageContext
 import kotlinx.coroutines.*
+import org.eclipse.jetty.http2.server.HTTP2CServerConnectionFactory
+import org.eclipse.jetty.server.HttpConfiguration
+import org.eclipse.jetty.server.HttpConnectionFactory
 import org.eclipse.jetty.server.Server
+import org.eclipse.jetty.server.ServerConnector
 import org.eclipse.jetty.util.thread.QueuedThreadPool
 import java.io.IOException
+import java.time.Duration
+import java.util.Collections
 import java.util.concurrent.ConcurrentHashMap
 import java.util.concurrent.Semaphore
+import java.util.concurrent.TimeUnit
+import java.util.concurrent.atomic.AtomicBoolean
+import java.util.concurrent.atomic.AtomicInteger
 
 /**
  * Data class to store chat completion information.
@@ -37,11 +54,15 @@ data class StoredCompletion(
  * - POST /v1/chat/completions - Chat completions (OpenAI format)
  * - POST /v1/completions - Text completions (OpenAI format)
  * - GET /v1/models - List available models
+ * - /v1/files, /v1/batches - Batch API (background bulk chat completions)
+ * - GET /metrics - Generation throughput and cache statistics
+ * - POST /admin/model - Replace the loaded model without downtime
+ * - WS /v1/ws - Multiplexed streaming of chat and text completions over one WebSocket
  * - GET /chat - Chat UI interface
  */
 class OpenAIApiServer(
     private val port: Int,
-    private val model: LlamaModel,
+    model: LlamaModel,
     private val context: Context
 ) {
     
@@ -54,8 +75,9 @@ class OpenAIApiServer(
     
     private var app: Javalin? = null
     
-    // Storage for chat completions with store=true
-    private val storedCompletions = ConcurrentHashMap<String, StoredCompletion>()
+    // Persistent storage for chat completions with store=true
+    private val completionStoreDelegate = lazy { StoredCompletionStore(context) }
+    private val completionStore by completionStoreDelegate
     
     // Settings manager for feature toggles
     private val settingsManager = SettingsManager(context)
@@ -63,15 +85,76 @@ class OpenAIApiServer(
     // Semaphore to limit concurrent model-inference requests.
     // Initialised in start() from the configured max-concurrency value.
     // fair=true ensures requests are queued in FIFO order (OpenAI-like behaviour).
-    private var requestSemaphore = Semaphore(SettingsManager.DEFAULT_MAX_CONCURRENCY, true)
+    private var requestSemaphore = RequestSemaphore(SettingsManager.DEFAULT_MAX_CONCURRENCY)
+    private var maxConcurrency = SettingsManager.DEFAULT_MAX_CONCURRENCY
+    
+    // Throttles concurrency and max_tokens while the device is hot.  Concurrency is
+    // limited by reducing the permits of requestSemaphore (only the thermal job changes this).
+    private val thermalController = ThermalController.getInstance(context)
+    @Volatile private var thermalWithheldPermits = 0
     
     // Request logger (singleton)
     private val requestLogger by lazy { RequestLogger.getInstance(context) }
     
+    // Exact-match cache for deterministic requests (temperature 0 or fixed seed)
+    private val responseCache = ResponseCache()
+    
+    // Identical deterministic requests running at the same time share one generation
+    private val singleFlight = SingleFlight()
+    
+    // Shortens chat histories that do not fit in the model's context
+    private val contextManager = ContextManager()
+    
+    // Routes requests to the model named in their `model` field, loading stored models on demand.
+    // Holds the primary model, which /admin/model can replace while serving.
+    private val modelRegistry = ModelRegistry(context, model)
+    
+    // Content-addressed store for media inside stored completions (singleton)
+    private val blobStore by lazy { BlobStore.getInstance(context) }
+    
+    // Uploaded files (/v1/files) and the background batch worker (/v1/batches).
+    // Batches only take a permit from requestSemaphore when no interactive request is waiting.
+    private val fileStore by lazy { FileStore(context) }
+    
+    // Active WebSocket streams: connection (session) ID -> stream ID -> cancellation flag
+    private val webSocketStreams = ConcurrentHashMap<String, ConcurrentHashMap<String, AtomicBoolean>>()
+    // Streams across all connections; each one occupies an IO thread while it waits or runs
+    private val activeWebSocketStreams = AtomicInteger(0)
+    
+    // What has been shed under memory pressure (onTrimMemory from ApiServerService).
+    // Shedding and recovery run one at a time under pressureLock.
+    private val memoryPressure = MemoryPressure()
+    private val pressureLock = Any()
+    @Volatile private var pressureRecoveryJob: Job? = null
+    
+    // Chat UI page and /assets, held in memory with ETags and gzip copies
+    private val assetCache by lazy { StaticAssetCache(context) }
+    private val batchManager by lazy {
+        BatchManager(context, fileStore, ::isIdleForBatch, { requestSemaphore }, ::executeBatchRequest)
+    }
+    
+    /**
+     * Fair request semaphore whose permits can be withheld without acquiring them,
+     * so that a lower limit takes effect as running requests finish.
+     */
+    private class RequestSemaphore(permits: Int) : Semaphore(permits, true) {
+        fun withhold(permits: Int) = reducePermits(permits)
+    }
+    
     companion object {
         private const val TAG = "OpenAIApiServer"
         // Maximum request body size (10 MB) to prevent memory exhaustion attacks
         private const val MAX_REQUEST_BODY_SIZE = 10 * 1024 * 1024
+        
+        // Stored completions list endpoint paging (OpenAI defaults)
+        private const val DEFAULT_LIST_LIMIT = 20
+        private const val MAX_LIST_LIMIT = 100
+        // Number of stored completions shown in the app
+        private const val UI_STORED_COMPLETIONS_LIMIT = 1000
+        // Maximum number of choices (n) per request
+        private const val MAX_CHOICES = 8
+        // Maximum size of a file uploaded to /v1/files
+        private const val MAX_UPLOAD_FILE_SIZE = 100L * 1024 * 1024
 
         // Jetty thread-pool tuning: keep a small number of threads warm so that
         // the very first request (and requests after a quiet period) do not incur
@@ -79,15 +162,45 @@ class OpenAIApiServer(
         private const val JETTY_MIN_THREADS = 4
         private const val JETTY_MAX_THREADS = 20
         private const val JETTY_IDLE_TIMEOUT_MS = 60_000
+
+        // Responses smaller than about one packet are sent uncompressed
+        private const val COMPRESSION_MIN_SIZE = 1500
+        // Moderate gzip level: most of the size reduction at a fraction of the CPU cost
+        private const val GZIP_LEVEL = 5
+        // Browser cache lifetime for /assets (revalidated with the ETag afterwards)
+        private const val ASSET_MAX_AGE_SECONDS = 3600
+        // Idle WebSocket connections are closed after this long without any frame
+        private const val WS_IDLE_TIMEOUT_MS = 10L * 60L * 1000L
+        // Maximum concurrent streams per WebSocket connection
+        private const val WS_MAX_STREAMS_PER_CONNECTION = 32
+        // Maximum concurrent streams across all connections, below the 64 threads of
+        // Dispatchers.IO so waiting streams cannot starve HTTP streaming and disk work
+        private const val WS_MAX_STREAMS = 48
+        // How often a stream waiting for a permit checks whether it was cancelled
+        private const val WS_PERMIT_POLL_MS = 250L
+        // Memory pressure is considered over after this long without a new callback
+        // (and while the system does not report low memory)
+        private const val PRESSURE_RECOVERY_MS = 60_000L
+        // Retry-After for requests refused under critical memory pressure
+        private const val PRESSURE_RETRY_AFTER_SECONDS = 30
+        // Room kept for the JSON mode instruction, on top of its schema
+        private const val JSON_INSTRUCTION_TOKENS = 32
     }
     
     fun start() {
         try {
-            // Initialise the semaphore with the current max-concurrency setting.
-            val maxConcurrency = settingsManager.getMaxConcurrency()
+            // Initialise the semaphore with the total engine count of all engine pools
+            // (the max-concurrency setting unless Engine Pools is configured).
+            maxConcurrency = settingsManager.getEnginePoolSpecs().sumOf { it.engines }
                 .coerceAtLeast(1)
-            requestSemaphore = Semaphore(maxConcurrency, true)
+            requestSemaphore = RequestSemaphore(maxConcurrency)
             LogManager.i(TAG, "Max concurrency set to $maxConcurrency")
+            if (settingsManager.isThermalThrottlingEnabled()) {
+                startThermalMonitor()
+            }
+
+            // Load the web assets into memory before the first request
+            assetCache.get("index.html")
 
             // Pre-warm a small pool of Jetty worker threads so that the first
             // request (and requests after idle periods) do not pay the cost of
@@ -102,10 +215,23 @@ class OpenAIApiServer(
                 config.http.maxRequestSize = MAX_REQUEST_BODY_SIZE.toLong()
                 config.showJavalinBanner = false
                 config.http.asyncTimeout = 300000L // 5 minutes for streaming
-                config.jetty.server { Server(threadPool) }
+                config.jetty.server { createJettyServer(threadPool) }
+                // Gzip non-streaming responses (JSON, HTML, assets).  SSE streams write to the
+                // servlet output stream directly and are never buffered for compression.
+                config.compression.custom(
+                    CompressionStrategy(null, Gzip(GZIP_LEVEL)).apply {
+                        minSizeForCompression = COMPRESSION_MIN_SIZE
+                    }
+                )
             }.apply {
                 // Health check
                 get("/health") { ctx -> handleHealth(ctx) }
+                get("/health/live") { ctx -> handleLiveness(ctx) }
+                get("/health/ready") { ctx -> handleReadiness(ctx) }
+                get("/metrics") { ctx -> handleMetrics(ctx) }
+                
+                // Admin endpoints
+                post("/admin/model") { ctx -> handleSwapModel(ctx) }
                 
                 // Model endpoints
                 get("/v1/models") { ctx -> handleModels(ctx) }
@@ -115,15 +241,36 @@ class OpenAIApiServer(
                 post("/v1/completions") { ctx -> handleCompletions(ctx) }
                 
                 // Stored chat completions endpoints
+                get("/v1/chat/completions") { ctx -> handleListStoredCompletions(ctx) }
                 get("/v1/chat/completions/{completion_id}") { ctx -> handleGetStoredCompletion(ctx) }
                 get("/v1/chat/completions/{completion_id}/messages") { ctx -> handleGetStoredCompletionMessages(ctx) }
                 post("/v1/chat/completions/{completion_id}") { ctx -> handleUpdateStoredCompletion(ctx) }
+                delete("/v1/chat/completions/{completion_id}") { ctx -> handleDeleteStoredCompletion(ctx) }
+                
+                // Files and batch endpoints
+                post("/v1/files") { ctx -> handleUploadFile(ctx) }
+                get("/v1/files") { ctx -> handleListFiles(ctx) }
+                get("/v1/files/{file_id}") { ctx -> handleGetFile(ctx) }
+                get("/v1/files/{file_id}/content") { ctx -> handleGetFileContent(ctx) }
+                delete("/v1/files/{file_id}") { ctx -> handleDeleteFile(ctx) }
+                post("/v1/batches") { ctx -> handleCreateBatch(ctx) }
+                get("/v1/batches") { ctx -> handleListBatches(ctx) }
+                get("/v1/batches/{batch_id}") { ctx -> handleGetBatch(ctx) }
+                post("/v1/batches/{batch_id}/cancel") { ctx -> handleCancelBatch(ctx) }
                 
                 // UI endpoints
                 get("/") { ctx -> handleRoot(ctx) }
                 get("/chat") { ctx -> handleChatUI(ctx) }
                 get("/assets/{fileName}") { ctx -> handleAssets(ctx) }
                 
+                // WebSocket streaming endpoint
+                ws("/v1/ws") { ws ->
+                    ws.onConnect { ctx -> handleWebSocketConnect(ctx) }
+                    ws.onMessage { ctx -> handleWebSocketMessage(ctx) }
+                    ws.onClose { ctx -> handleWebSocketClose(ctx.sessionId) }
+                    ws.onError { ctx -> handleWebSocketClose(ctx.sessionId) }
+                }
+                
                 // Exception handler
                 exception(Exception::class.java) { e, ctx ->
                     LogManager.e(TAG, "Error handling request", e)
@@ -132,19 +279,54 @@ class OpenAIApiServer(
                     )
                     ctx.status(500).contentType("application/json").result(gson.toJson(errorResponse))
                 }
-            }.start(port)
+            }.start()
             
             LogManager.i(TAG, "Javalin server started on port $port")
+            
+            // Resume any unfinished batches in the background
+            batchManager.start()
+            
+            // Remove media blobs that are no longer referenced by logs or stored
+            // completions.  Off the startup path; nothing depends on it finishing.
+            serverScope.launch {
+                try {
+                    blobStore.sweep(pinned = completionStore.referencedBlobHashes())
+                } catch (e: Exception) {
+                    LogManager.w(TAG, "Blob sweep failed: ${e.message}")
+                }
+            }
         } catch (e: Exception) {
             LogManager.e(TAG, "Failed to start Javalin server", e)
             throw e
         }
     }
     
+    /**
+     * Jetty server with a single connector on [port] that speaks HTTP/1.1 and
+     * cleartext HTTP/2 (h2c, via upgrade or prior knowledge), so clients that
+     * multiplex can share one connection for many concurrent requests.
+     */
+    private fun createJettyServer(threadPool: QueuedThreadPool): Server {
+        val server = Server(threadPool)
+        val httpConfig = HttpConfiguration().apply {
+            sendServerVersion = false
+        }
+        val connector = ServerConnector(
+            server,
+            HttpConnectionFactory(httpConfig),
+            HTTP2CServerConnectionFactory(httpConfig)
+        )
+        connector.port = port
+        server.addConnector(connector)
+        return server
+    }
+    
     fun stop() {
         try {
             app?.stop()
+            batchManager.stop()
             serverScope.cancel() // Cancel all streaming coroutines
+            modelRegistry.close()
             LogManager.i(TAG, "Javalin server stopped")
         } catch (e: Exception) {
             LogManager.e(TAG, "Error stopping server", e)
@@ -182,65 +364,486 @@ class OpenAIApiServer(
     }
     
     /**
-     * Get all stored completions
+     * Run [block] against the completion store on a background thread and pass its
+     * result to [onDone] on that thread (null if [block] failed or the server stopped).
+     * For the activities, which must not query SQLite on the main thread.
+     */
+    private fun <T> onCompletionStoreAsync(block: () -> T, onDone: (T?) -> Unit) {
+        if (!serverScope.isActive) {
+            onDone(null)
+            return
+        }
+        serverScope.launch {
+            val result = try {
+                block()
+            } catch (e: Exception) {
+                LogManager.e(TAG, "Stored completion operation failed", e)
+                null
+            }
+            onDone(result)
+        }
+    }
+    
+    /**
+     * Load the most recent stored completions (newest first) and the total number
+     * stored, off the caller's thread
+     */
+    fun loadStoredCompletions(onDone: (Pair<List<StoredCompletion>, Int>?) -> Unit) {
+        onCompletionStoreAsync({
+            completionStore.list(limit = UI_STORED_COMPLETIONS_LIMIT, ascending = false).data to completionStore.count()
+        }, onDone)
+    }
+    
+    /**
+     * Count stored completions, off the caller's thread
      */
-    fun getStoredCompletions(): List<StoredCompletion> {
-        return storedCompletions.values.toList().sortedByDescending { it.created }
+    fun countStoredCompletions(onDone: (Int?) -> Unit) {
+        onCompletionStoreAsync({ completionStore.count() }, onDone)
     }
     
     /**
      * Get a specific stored completion by ID
      */
     fun getStoredCompletionById(id: String): StoredCompletion? {
-        return storedCompletions[id]
+        return completionStore.get(id)
     }
     
     /**
-     * Clear all stored completions
+     * Clear all stored completions, off the caller's thread
      */
-    fun clearAllStoredCompletions(): Int {
-        val count = storedCompletions.size
-        storedCompletions.clear()
-        LogManager.i(TAG, "Cleared $count stored completions")
-        return count
+    fun clearAllStoredCompletions(onDone: (Int?) -> Unit) {
+        onCompletionStoreAsync({
+            val count = completionStore.clear()
+            LogManager.i(TAG, "Cleared $count stored completions")
+            count
+        }, onDone)
     }
     
     /**
      * Delete a specific stored completion
      */
     fun deleteStoredCompletion(id: String): Boolean {
-        val removed = storedCompletions.remove(id)
-        if (removed != null) {
+        val removed = completionStore.delete(id)
+        if (removed) {
             LogManager.i(TAG, "Deleted stored completion: $id")
-            return true
         }
-        return false
+        return removed
+    }
+    
+    /**
+     * Delete a specific stored completion, off the caller's thread
+     */
+    fun deleteStoredCompletion(id: String, onDone: (Boolean) -> Unit) {
+        onCompletionStoreAsync({ deleteStoredCompletion(id) }) { removed -> onDone(removed == true) }
+    }
+    
+    /**
+     * Persist a chat completion created with store=true.
+     * Media parts are kept as blob references and rehydrated on retrieval.
+     */
+    private fun storeCompletion(
+        id: String,
+        created: Long,
+        messages: com.google.gson.JsonArray,
+        responseContent: String,
+        metadata: Map<String, Any>?,
+        modelName: String
+    ) {
+        try {
+            val messagesList = blobStore.offloadMessages(messages).map { element ->
+                val msgObj = element.asJsonObject
+                val role = msgObj.get("role")?.asString ?: ""
+                val contentElement = msgObj.get("content")
+                
+                // Preserve the original content structure (string or array for multimodal)
+                val content: Any = when {
+                    contentElement == null -> ""
+                    contentElement.isJsonPrimitive && contentElement.asJsonPrimitive.isString -> {
+                        contentElement.asString
+                    }
+                    contentElement.isJsonArray -> {
+                        // Store multimodal content as a list of maps using TypeToken for type safety
+                        val mapType = object : TypeToken<Map<String, Any>>() {}.type
+                        contentElement.asJsonArray.map { part ->
+                            gson.fromJson<Map<String, Any>>(part, mapType)
+                        }
+                    }
+                    else -> contentElement.toString()
+                }
+                
+                mapOf(
+                    "role" to role,
+                    "content" to content
+                )
+            }
+            
+            completionStore.put(
+                StoredCompletion(
+                    id = id,
+                    obj = "chat.completion",
+                    created = created,
+                    model = modelName,
+                    messages = messagesList,
+                    responseContent = responseContent,
+                    metadata = metadata
+                )
+            )
+            LogManager.i(TAG, "Stored completion with ID: $id")
+        } catch (e: Exception) {
+            // Storage is best-effort; the client still receives its completion
+            LogManager.e(TAG, "Failed to store completion $id", e)
+        }
+    }
+    
+    /**
+     * Build the chat.completion object returned for a stored completion
+     */
+    private fun storedCompletionResponse(storedCompletion: StoredCompletion): Map<String, Any> {
+        val response = mutableMapOf<String, Any>(
+            "id" to storedCompletion.id,
+            "object" to storedCompletion.obj,
+            "created" to storedCompletion.created,
+            "model" to storedCompletion.model,
+            "choices" to listOf(
+                mapOf(
+                    "index" to 0,
+                    "message" to mapOf(
+                        "role" to "assistant",
+                        "content" to storedCompletion.responseContent
+                    ),
+                    "finish_reason" to "stop"
+                )
+            )
+        )
+        storedCompletion.metadata?.let { response["metadata"] = it }
+        return response
     }
     
+    /**
+     * Server and model status.  Always 200 while the server is up; "status" is "ok"
+     * once the model is ready, "loading" while it loads (with progress and ETA),
+     * "unloaded" while its engines are closed for memory pressure, and "error" if it
+     * failed to load.
+     */
     private fun handleHealth(ctx: JavalinContext) {
         LogManager.d(TAG, "Handling /health")
         
+        val model = modelRegistry.primaryModel()
+        val load = model.getLoadStatus()
+        val status = when (load.state) {
+            LlamaModel.LoadState.LOADED -> "ok"
+            LlamaModel.LoadState.NOT_LOADED, LlamaModel.LoadState.LOADING -> "loading"
+            LlamaModel.LoadState.SUSPENDED -> "unloaded"
+            LlamaModel.LoadState.FAILED, LlamaModel.LoadState.CLOSED -> "error"
+        }
         val health = mapOf(
-            "status" to "ok",
-            "model_loaded" to model.isModelLoaded()
+            "status" to status,
+            "model_loaded" to model.isModelLoaded(),
+            "model" to model.getModelName(),
+            "load" to loadStatusMap(load)
         )
         
         ctx.contentType("application/json").result(gson.toJson(health))
     }
     
+    /** Liveness: the server process is up and handling requests. */
+    private fun handleLiveness(ctx: JavalinContext) {
+        ctx.contentType("application/json").result(gson.toJson(mapOf("status" to "alive")))
+    }
+    
+    /**
+     * Readiness: 200 when inference requests can be served right away, otherwise 503
+     * (with Retry-After while the model is loading or memory pressure is critical).
+     */
+    private fun handleReadiness(ctx: JavalinContext) {
+        val model = modelRegistry.primaryModel()
+        if (!memoryPressure.isAdmitting) {
+            ctx.header("Retry-After", PRESSURE_RETRY_AFTER_SECONDS.toString())
+            val body = mapOf("status" to "not_ready", "memory_pressure" to memoryPressure.level.name.lowercase())
+            ctx.status(503).contentType("application/json").result(gson.toJson(body))
+            return
+        }
+        if (model.isModelLoaded()) {
+            ctx.contentType("application/json").result(gson.toJson(mapOf("status" to "ready")))
+            return
+        }
+        val load = model.getLoadStatus()
+        if (load.state == LlamaModel.LoadState.NOT_LOADED || load.state == LlamaModel.LoadState.LOADING) {
+            val etaSeconds = load.etaMs?.let { ((it + 999) / 1000).coerceAtLeast(1) } ?: 5
+            ctx.header("Retry-After", etaSeconds.toString())
+        } else if (load.state == LlamaModel.LoadState.SUSPENDED) {
+            ctx.header("Retry-After", PRESSURE_RETRY_AFTER_SECONDS.toString())
+        }
+        val body = mapOf(
+            "status" to "not_ready",
+            "load" to loadStatusMap(load)
+        )
+        ctx.status(503).contentType("application/json").result(gson.toJson(body))
+    }
+    
+    private fun loadStatusMap(load: LlamaModel.LoadStatus): Map<String, Any?> {
+        return mapOf(
+            "state" to load.state.name.lowercase(),
+            "progress" to Math.round(load.progress * 1000) / 1000.0,
+            "elapsed_ms" to load.elapsedMs,
+            "eta_ms" to load.etaMs,
+            "error" to load.error
+        )
+    }
+    
+    private fun handleMetrics(ctx: JavalinContext) {
+        LogManager.d(TAG, "Handling /metrics")
+        
+        val model = modelRegistry.primaryModel()
+        val stats = model.stats.snapshot()
+        val metrics = mapOf(
+            "model" to model.getModelName(),
+            "generation" to mapOf(
+                "generations" to stats.generations,
+                "output_tokens" to stats.outputTokens,
+                "tokens_per_second" to stats.tokensPerSecond,
+                "decode_tokens_per_second" to stats.decodeTokensPerSecond,
+                "last_decode_tokens_per_second" to stats.lastDecodeTokensPerSecond,
+                "avg_time_to_first_token_ms" to stats.averageTimeToFirstTokenMs
+            ),
+            "prompt_lookup" to mapOf(
+                "requests" to stats.promptLookup.requests,
+                "output_tokens" to stats.promptLookup.outputTokens,
+                "drafted_tokens" to stats.promptLookup.draftedTokens,
+                "accepted_tokens" to stats.promptLookup.acceptedTokens,
+                "acceptance_rate" to stats.promptLookup.acceptanceRate
+            ),
+            "response_cache" to mapOf(
+                "enabled" to settingsManager.isResponseCacheEnabled(),
+                "hits" to responseCache.getHitCount(),
+                "misses" to responseCache.getMissCount()
+            ),
+            "concurrency" to mapOf(
+                "engines" to model.getEngineCount(),
+                "available_permits" to requestSemaphore.availablePermits(),
+                "queued_requests" to requestSemaphore.queueLength,
+                "engine_pools" to model.getEnginePoolStatus().map { pool ->
+                    mapOf(
+                        "name" to pool.name,
+                        "backend" to pool.backend,
+                        "context_length" to pool.contextLength,
+                        "multimodal" to pool.multimodal,
+                        "engines" to pool.engines,
+                        "idle_engines" to pool.idleEngines,
+                        "requests" to pool.requests
+                    )
+                }
+            ),
+            "resident_models" to modelRegistry.residentModels().map { it.getModelName() },
+            "context" to contextManager.snapshot().let { context ->
+                mapOf(
+                    "policy" to settingsManager.getContextPolicy().value,
+                    "max_context_length" to model.getMaxContextLength(),
+                    "requests" to context.requests,
+                    "truncated_requests" to context.truncatedRequests,
+                    "dropped_messages" to context.droppedMessages,
+                    "summaries" to context.summaries,
+                    "summary_cache_hits" to context.summaryCacheHits,
+                    "rejected_requests" to context.rejectedRequests
+                )
+            },
+            "thermal" to thermalController.snapshot().let { thermal ->
+                mapOf(
+                    "enabled" to settingsManager.isThermalThrottlingEnabled(),
+                    "status" to thermal.status,
+                    "headroom" to thermal.headroom,
+                    "throttle" to thermal.decision.throttle.name.lowercase(),
+                    "concurrency_limit" to thermal.decision.concurrencyLimit,
+                    "withheld_permits" to thermalWithheldPermits,
+                    "max_tokens_cap" to thermal.decision.maxTokensCap,
+                    "avoid_gpu" to thermal.decision.avoidGpu,
+                    "since" to thermal.since / 1000,
+                    "throttle_changes" to thermal.changes,
+                    "capped_requests" to thermal.cappedRequests
+                )
+            },
+            "memory_pressure" to memoryPressure.snapshot().let { pressure ->
+                mapOf(
+                    "level" to pressure.level.name.lowercase(),
+                    "admitting" to pressure.admitting,
+                    "events" to pressure.events,
+                    "cache_drops" to pressure.cacheDrops,
+                    "models_evicted" to pressure.modelsEvicted,
+                    "engines_shed" to pressure.enginesShed,
+                    "model_unloads" to pressure.modelUnloads,
+                    "rejected_requests" to pressure.rejectedRequests,
+                    "recoveries" to pressure.recoveries,
+                    "last_event_at" to pressure.lastEventAt.takeIf { it > 0 }?.let { it / 1000 },
+                    "last_action" to pressure.lastAction
+                )
+            }
+        )
+        
+        ctx.contentType("application/json").result(gson.toJson(metrics))
+    }
+    
+    /**
+     * Replace the primary model while serving.  Body: {"model": name or ID of a stored
+     * model, "mode": "auto" | "parallel" | "drain"}.  Responds once the old model is closed.
+     */
+    private fun handleSwapModel(ctx: JavalinContext) {
+        LogManager.d(TAG, "Handling /admin/model")
+        
+        val request = try {
+            gson.fromJson(ctx.body(), JsonObject::class.java)
+        } catch (e: Exception) {
+            null
+        }
+        val name = request?.get("model")?.takeIf { it.isJsonPrimitive }?.asString
+        if (name.isNullOrBlank()) {
+            sendError(ctx, 400, "model is required")
+            return
+        }
+        val modeName = request.get("mode")?.takeIf { it.isJsonPrimitive }?.asString ?: "auto"
+        val mode = ModelRegistry.SwapMode.values().firstOrNull { it.name.equals(modeName, ignoreCase = true) }
+        if (mode == null) {
+            sendError(ctx, 400, "mode must be one of auto, parallel, drain")
+            return
+        }
+        val stored = modelRegistry.findStoredModelByName(name)
+        if (stored == null) {
+            sendError(ctx, 404, "Model '$name' not found", "not_found_error")
+            return
+        }
+        
+        val previous = modelRegistry.primaryModel().getModelName()
+        try {
+            val swapped = swapModel(stored.path, mode)
+            ctx.contentType("application/json").result(gson.toJson(mapOf(
+                "model" to swapped.getModelName(),
+                "previous_model" to previous,
+                "mode" to mode.name.lowercase()
+            )))
+        } catch (e: ModelUnavailableException) {
+            LogManager.w(TAG, "Model swap failed: ${e.message}")
+            sendError(ctx, 503, e.message ?: "Model unavailable", "server_error")
+        }
+    }
+    
+    /**
+     * Replace the primary model with the one at [modelPath] without stopping the
+     * server (see [ModelRegistry.swapPrimary]).  Blocks until the old model is closed.
+     * Cached responses from the old model are kept; their keys include the model path.
+     */
+    fun swapModel(modelPath: String, mode: ModelRegistry.SwapMode = ModelRegistry.SwapMode.AUTO): LlamaModel {
+        return modelRegistry.swapPrimary(modelPath, mode)
+    }
+    
+    /** The model currently serving requests that do not name another model. */
+    fun getPrimaryModel(): LlamaModel = modelRegistry.primaryModel()
+    
+    /**
+     * Shed memory for a pressure callback at [level] (see [MemoryPressure] for what
+     * each level gives up).  Returns at once; the work runs in the background.  Once
+     * no callback has arrived for [PRESSURE_RECOVERY_MS] and the system is no longer
+     * low on memory, requests are admitted again and the engine pool is restored.
+     */
+    fun onMemoryPressure(level: MemoryPressure.Level) {
+        if (level == MemoryPressure.Level.NORMAL) return
+        serverScope.launch {
+            synchronized(pressureLock) {
+                if (memoryPressure.raise(level)) {
+                    shedMemory(level)
+                }
+            }
+            scheduleMemoryRecovery()
+        }
+    }
+    
+    private fun shedMemory(level: MemoryPressure.Level) {
+        LogManager.w(TAG, "Memory pressure $level; shedding")
+        responseCache.clear()
+        if (completionStoreDelegate.isInitialized()) {
+            completionStore.trimMemory()
+        }
+        val models = modelRegistry.evictIdle()
+        val primary = modelRegistry.primaryModel()
+        val unloaded = level >= MemoryPressure.Level.COMPLETE && primary.isModelLoaded()
+        val engines = when {
+            level >= MemoryPressure.Level.COMPLETE -> primary.shrinkPool(0)
+            level >= MemoryPressure.Level.LOW -> primary.shrinkPool(1)
+            else -> 0
+        }
+        memoryPressure.recordShed(cachesDropped = true, models = models, engines = engines, unloaded = unloaded)
+        LogManager.w(TAG, "Memory pressure $level: ${memoryPressure.snapshot().lastAction}")
+    }
+    
+    private fun scheduleMemoryRecovery() {
+        pressureRecoveryJob?.cancel()
+        pressureRecoveryJob = serverScope.launch {
+            do {
+                delay(PRESSURE_RECOVERY_MS)
+            } while (isSystemLowOnMemory() || memoryPressure.quietMs() < PRESSURE_RECOVERY_MS)
+            synchronized(pressureLock) {
+                if (memoryPressure.level == MemoryPressure.Level.NORMAL) return@launch
+                LogManager.i(TAG, "Memory pressure over; admitting requests and restoring engines")
+                memoryPressure.recover()
+                modelRegistry.primaryModel().restorePool()
+            }
+        }
+    }
+    
+    /**
+     * Poll the thermal state and apply the controller's concurrency limit by reducing
+     * the permits of requestSemaphore.  Reducing does not wait for free permits or
+     * jump the FIFO queue: permits released by running requests are absorbed until
+     * the limit holds, so running requests are never interrupted and queued ones are
+     * admitted in order once the limit allows.
+     */
+    private fun startThermalMonitor() {
+        serverScope.launch {
+            while (isActive) {
+                val limit = thermalController.update(maxConcurrency).concurrencyLimit
+                val target = if (limit == null) 0 else (maxConcurrency - limit).coerceIn(0, maxConcurrency - 1)
+                val semaphore = requestSemaphore
+                if (target > thermalWithheldPermits) {
+                    semaphore.withhold(target - thermalWithheldPermits)
+                } else if (target < thermalWithheldPermits) {
+                    semaphore.release(thermalWithheldPermits - target)
+                }
+                thermalWithheldPermits = target
+                delay(ThermalController.POLL_INTERVAL_MS)
+            }
+        }
+    }
+    
+    private fun isSystemLowOnMemory(): Boolean {
+        val activityManager = context.getSystemService(Context.ACTIVITY_SERVICE) as ActivityManager
+        val memoryInfo = ActivityManager.MemoryInfo()
+        activityManager.getMemoryInfo(memoryInfo)
+        return memoryInfo.lowMemory
+    }
+    
+    /**
+     * Whether a new inference request may start; false (and counted) while memory
+     * pressure is critical.
+     */
+    private fun admitUnderMemoryPressure(): Boolean {
+        if (memoryPressure.isAdmitting) return true
+        memoryPressure.recordRejected()
+        return false
+    }
+    
     private fun handleModels(ctx: JavalinContext) {
         LogManager.d(TAG, "Handling /v1/models")
         
+        val created = System.currentTimeMillis() / 1000
         val models = mapOf(
             "object" to "list",
-            "data" to listOf(
+            "data" to modelRegistry.listModels().map { (name, loaded) ->
                 mapOf(
-                    "id" to model.getModelName(),
+                    "id" to name,
                     "object" to "model",
-                    "created" to System.currentTimeMillis() / 1000,
-                    "owned_by" to "hostai"
+                    "created" to created,
+                    "owned_by" to "hostai",
+                    "loaded" to loaded
                 )
-            )
+            }
         )
         
         ctx.contentType("application/json").result(gson.toJson(models))
@@ -276,6 +879,10 @@ class OpenAIApiServer(
                     Chat completion endpoint (OpenAI compatible)<br>
                     <em>Set store=true to persist completion for later retrieval</em>
                 </div>
+                <div class="endpoint">
+                    <strong>GET /v1/chat/completions</strong><br>
+                    List stored chat completions (after, limit, order, model, metadata[key] filters)
+                </div>
                 <div class="endpoint">
                     <strong>GET /v1/chat/completions/{completion_id}</strong><br>
                     Get a stored chat completion (only for completions with store=true)
@@ -288,13 +895,33 @@ class OpenAIApiServer(
                     <strong>POST /v1/chat/completions/{completion_id}</strong><br>
                     Update metadata for a stored chat completion
                 </div>
+                <div class="endpoint">
+                    <strong>DELETE /v1/chat/completions/{completion_id}</strong><br>
+                    Delete a stored chat completion
+                </div>
+                <div class="endpoint">
+                    <strong>POST /v1/files</strong>, <strong>GET /v1/files</strong>, <strong>GET /v1/files/{file_id}/content</strong><br>
+                    Upload, list and download files (batch input and output)
+                </div>
+                <div class="endpoint">
+                    <strong>POST /v1/batches</strong>, <strong>GET /v1/batches/{batch_id}</strong><br>
+                    Run a JSONL file of chat completion requests in the background
+                </div>
                 <div class="endpoint">
                     <strong>POST /v1/completions</strong><br>
                     Text completion endpoint (OpenAI compatible)
                 </div>
+                <div class="endpoint">
+                    <strong>WS /v1/ws</strong><br>
+                    Stream several chat or text completions over one WebSocket connection
+                </div>
                 <div class="endpoint">
                     <strong>GET /health</strong><br>
-                    Health check endpoint
+                    Server status and model load progress (readiness: /health/ready, liveness: /health/live)
+                </div>
+                <div class="endpoint">
+                    <strong>GET /metrics</strong><br>
+                    Generation throughput (tokens/sec, time to first token) and cache statistics
                 </div>
                 <div class="endpoint">
                     <strong>GET /chat</strong><br>
@@ -315,48 +942,80 @@ class OpenAIApiServer(
             return
         }
         
-        try {
-            val inputStream = context.assets.open("index.html")
-            val html = inputStream.bufferedReader().use { it.readText() }
-            ctx.html(html)
-        } catch (e: Exception) {
-            LogManager.e(TAG, "Error loading chat UI", e)
+        val page = assetCache.get("index.html")
+        if (page == null) {
+            LogManager.e(TAG, "Chat UI page is missing from assets")
             ctx.status(500).html(
-                "<html><body><h1>Error loading chat UI</h1><p>${e.message}</p></body></html>"
+                "<html><body><h1>Error loading chat UI</h1><p>index.html not found</p></body></html>"
             )
+            return
         }
+        // Revalidated on every load so a new app version's page is picked up at once
+        sendAsset(ctx, page, "no-cache")
     }
     
     private fun handleAssets(ctx: JavalinContext) {
         val fileName = ctx.pathParam("fileName")
-        LogManager.d(TAG, "Handling /assets/$fileName")
+        LogManager.d(TAG) { "Handling /assets/$fileName" }
         
-        try {
-            // Security: Prevent path traversal attacks
-            if (fileName.contains("..") || fileName.startsWith("/") || fileName.contains("\\")) {
-                LogManager.w(TAG, "Rejected potential path traversal attempt: $fileName")
-                ctx.status(403).result("Invalid asset path")
-                return
-            }
-            
-            // Determine MIME type based on file extension
-            val mimeType = when {
-                fileName.endsWith(".ico") -> "image/x-icon"
-                fileName.endsWith(".json") -> "application/json"
-                fileName.endsWith(".html") -> "text/html"
-                fileName.endsWith(".css") -> "text/css"
-                fileName.endsWith(".js") -> "application/javascript"
-                else -> "application/octet-stream"
-            }
-            
-            val inputStream = context.assets.open(fileName)
-            val bytes = inputStream.readBytes()
-            inputStream.close()
-            
-            ctx.contentType(mimeType).result(bytes)
-        } catch (e: Exception) {
-            LogManager.e(TAG, "Error loading asset: $fileName", e)
+        // Security: Prevent path traversal attacks
+        if (fileName.contains("..") || fileName.startsWith("/") || fileName.contains("\\")) {
+            LogManager.w(TAG, "Rejected potential path traversal attempt: $fileName")
+            ctx.status(403).result("Invalid asset path")
+            return
+        }
+        
+        val asset = assetCache.get(fileName)
+        if (asset == null) {
+            LogManager.w(TAG, "Asset not found: $fileName")
             ctx.status(404).result("Asset not found")
+            return
+        }
+        sendAsset(ctx, asset, "public, max-age=$ASSET_MAX_AGE_SECONDS")
+    }
+    
+    /**
+     * Send a cached [asset] with its ETag, answering 304 when the client's copy is
+     * current and sending the precompressed copy to clients that accept gzip.
+     */
+    private fun sendAsset(ctx: JavalinContext, asset: StaticAssetCache.Asset, cacheControl: String) {
+        // The gzip and identity bodies are different representations, so each has its own tag
+        val gzipped = asset.gzipped?.takeIf { acceptsGzip(ctx.header("Accept-Encoding")) }
+        val etag = if (gzipped != null) asset.gzipEtag else asset.etag
+        ctx.header("ETag", etag)
+        ctx.header("Cache-Control", cacheControl)
+        ctx.header("Vary", "Accept-Encoding")
+        
+        if (etagMatches(ctx.header("If-None-Match"), etag)) {
+            ctx.status(304)
+            return
+        }
+        
+        if (gzipped != null) {
+            // Written to the servlet stream directly so it is not compressed a second time
+            ctx.contentType(asset.mimeType)
+            ctx.header("Content-Encoding", "gzip")
+            ctx.res().setContentLength(gzipped.size)
+            ctx.res().outputStream.write(gzipped)
+        } else {
+            ctx.contentType(asset.mimeType).result(asset.bytes)
+        }
+    }
+    
+    private fun etagMatches(ifNoneMatch: String?, etag: String): Boolean {
+        if (ifNoneMatch == null) return false
+        return ifNoneMatch.split(",").any { candidate ->
+            val tag = candidate.trim().removePrefix("W/")
+            tag == "*" || tag == etag
+        }
+    }
+    
+    private fun acceptsGzip(acceptEncoding: String?): Boolean {
+        if (acceptEncoding == null) return false
+        return acceptEncoding.split(",").any { entry ->
+            val parts = entry.split(";").map { it.trim() }
+            val disabled = parts.drop(1).any { it.replace(" ", "").let { q -> q == "q=0" || q == "q=0.0" } }
+            (parts[0].equals("gzip", ignoreCase = true) || parts[0] == "*") && !disabled
         }
     }
     
@@ -394,36 +1053,84 @@ class OpenAIApiServer(
             // Extract session ID using helper method
             val sessionId = extractSessionId(ctx, request)
             
-            LogManager.d(TAG, "Using session ID: $sessionId, store: $store")
+            LogManager.d(TAG) { "Using session ID: $sessionId, store: $store" }
+            
+            // Predicted output (OpenAI `prediction` parameter) and JSON mode (`response_format`)
+            val prediction: String?
+            val responseFormat: ResponseFormat?
+            try {
+                prediction = PredictedOutput.parse(request.get("prediction"))
+                responseFormat = JsonMode.parse(request.get("response_format"))
+            } catch (e: IllegalArgumentException) {
+                sendError(ctx, 400, e.message ?: "Invalid request")
+                return
+            }
             
             // Build generation config from request parameters
-            val config = extractGenerationConfig(request)
+            val config = extractGenerationConfig(request).copy(prediction = prediction, responseFormat = responseFormat)
             
-            // Build content from messages (either String prompt or List<Content> for multimodal)
-            val contents = buildContentsFromMessages(messages)
+            LogManager.d(TAG) { "Chat completion - stream: $stream, maxTokens: ${config.maxTokens}, temp: ${config.temperature}, n: ${config.n}" }
             
-            // Log preview
-            if (contents is String) {
-                val promptPreview = if (contents.length > 100) contents.take(100) + "..." else contents
-                LogManager.d(TAG, "Prompt preview: $promptPreview")
-            } else {
-                LogManager.d(TAG, "Multimodal content with ${(contents as List<*>).size} parts")
+            if (!checkChoiceCount(ctx, config)) {
+                return
+            }
+            if (prediction != null && config.n > 1) {
+                sendError(ctx, 400, "prediction is not supported with n greater than 1")
+                return
             }
-            LogManager.d(TAG, "Chat completion - stream: $stream, maxTokens: ${config.maxTokens}, temp: ${config.temperature}")
+            
+            val lease = acquireModel(ctx, request) ?: return
+            val plan = planGeneration("chat", messages, config, lease.model)
             
             // Acquire a permit before running inference. If max concurrency is reached the
             // calling thread blocks here until a permit becomes available (FIFO queue).
-            LogManager.d(TAG, "Acquiring concurrency permit (available: ${requestSemaphore.availablePermits()}, queue depth: ${requestSemaphore.queueLength})")
-            requestSemaphore.acquire()
-            LogManager.d(TAG, "Concurrency permit acquired for chat completion")
+            // Cache hits and requests sharing another request's generation skip the queue.
             try {
-                if (stream) {
-                    handleChatStreamingResponse(ctx, contents, config, sessionId, messages, store, metadata, bodyText)
-                } else {
-                    handleChatNonStreamingResponse(ctx, contents, config, sessionId, messages, store, metadata, bodyText)
+                if (plan.needsPermit) {
+                    LogManager.d(TAG) { "Acquiring concurrency permit (available: ${requestSemaphore.availablePermits()}, queue depth: ${requestSemaphore.queueLength})" }
+                    requestSemaphore.acquire()
+                    LogManager.d(TAG, "Concurrency permit acquired for chat completion")
                 }
-            } finally {
-                requestSemaphore.release()
+                try {
+                    // Build content from the messages that fit in the model's context
+                    // (either String prompt or List<Content> for multimodal).  Done with
+                    // the permit held, because the summarize policy runs the model.
+                    val contents = try {
+                        JsonMode.applyInstruction(buildContentsFromMessages(fitContext(messages, config, plan)), responseFormat)
+                    } catch (e: ContextLengthExceededException) {
+                        sendError(ctx, 400, e.message ?: "Context length exceeded", code = "context_length_exceeded")
+                        return
+                    }
+                    
+                    // Log preview
+                    if (contents is String) {
+                        val promptPreview = if (contents.length > 100) contents.take(100) + "..." else contents
+                        LogManager.d(TAG) { "Prompt preview: $promptPreview" }
+                    } else {
+                        LogManager.d(TAG) { "Multimodal content with ${(contents as List<*>).size} parts" }
+                    }
+                    
+                    if (stream) {
+                        handleChatStreamingResponse(ctx, contents, config, sessionId, messages, store, metadata, bodyText, plan)
+                    } else {
+                        handleChatNonStreamingResponse(ctx, contents, config, sessionId, messages, store, metadata, bodyText, plan)
+                    }
+                } finally {
+                    if (plan.needsPermit) {
+                        requestSemaphore.release()
+                    }
+                }
+            } finally {
+                plan.abandon()
+                lease.release()
+            }
+        } catch (e: MultimodalUnavailableException) {
+            LogManager.w(TAG, "Image/audio request refused: ${e.message}")
+            if (e.retryable) {
+                ctx.header("Retry-After", PRESSURE_RETRY_AFTER_SECONDS.toString())
+                sendError(ctx, 503, e.message ?: "Image and audio input is unavailable", "server_error")
+            } else {
+                sendError(ctx, 400, e.message ?: "This model does not accept image or audio input")
             }
         } catch (e: Exception) {
             LogManager.e(TAG, "Error handling chat completions", e)
@@ -442,14 +1149,39 @@ class OpenAIApiServer(
         messages: com.google.gson.JsonArray,
         store: Boolean,
         metadata: Map<String, Any>?,
-        bodyText: String
+        bodyText: String,
+        plan: GenerationPlan
     ) {
+        val response = createChatCompletion(contents, config, sessionId, messages, store, metadata, plan)
+        
+        LogManager.i(TAG, "Chat completion completed successfully for session: $sessionId")
+        
+        val responseJson = gson.toJson(response)
+        
+        // Log request if logging is enabled
+        logRequestIfEnabled(ctx, "/v1/chat/completions", bodyText, responseJson)
+        
+        ctx.contentType("application/json").result(responseJson)
+    }
+    
+    /**
+     * Run a non-streaming chat completion and build the chat.completion response.
+     * Shared by POST /v1/chat/completions and the batch worker; the caller must hold
+     * a permit from requestSemaphore when [GenerationPlan.needsPermit] is true.
+     */
+    private fun createChatCompletion(
+        contents: Any,  // Either String or List<Content>
+        config: GenerationConfig,
+        sessionId: String,
+        messages: com.google.gson.JsonArray,
+        store: Boolean,
+        metadata: Map<String, Any>?,
+        plan: GenerationPlan
+    ): Map<String, Any> {
         // Generate response with session ID - handle both String and multimodal content
-        val completion = if (contents is String) {
-            model.generate(contents, config, sessionId)
-        } else {
-            @Suppress("UNCHECKED_CAST")
-            model.generateWithContents(contents as List<Content>, config, sessionId)
+        val completions = Array(config.n) { "" }
+        runChoices(config.n) { index ->
+            completions[index] = generateText(contents, choiceConfig(config, index), sessionId, plan)
         }
         
         val promptTokens = when (contents) {
@@ -469,84 +1201,47 @@ class OpenAIApiServer(
                 }
             }
         }
-        val completionTokens = completion.split(" ").size
+        val completionTokens = completions.sumOf { it.split(" ").size }
+        recordPromptLookup(contents, completions.asList(), config, plan.model)
+        val usage = mutableMapOf<String, Any>(
+            "prompt_tokens" to promptTokens,
+            "completion_tokens" to completionTokens,
+            "total_tokens" to (promptTokens + completionTokens)
+        )
+        if (config.prediction != null) {
+            val result = PredictedOutput.compare(config.prediction, completions[0])
+            LogManager.i(TAG, "Predicted output: ${result.acceptedTokens} tokens accepted, ${result.rejectedTokens} rejected")
+            usage["completion_tokens_details"] = mapOf(
+                "accepted_prediction_tokens" to result.acceptedTokens,
+                "rejected_prediction_tokens" to result.rejectedTokens
+            )
+        }
         
         val id = "chatcmpl-${System.currentTimeMillis()}"
         val created = System.currentTimeMillis() / 1000
         
-        // Store completion if store parameter is true
+        // Store completion if store parameter is true (the first choice, like OpenAI's UI)
         if (store) {
-            val messagesList = messages.map { element ->
-                val msgObj = element.asJsonObject
-                val role = msgObj.get("role")?.asString ?: ""
-                val contentElement = msgObj.get("content")
-                
-                // Preserve the original content structure (string or array for multimodal)
-                val content: Any = when {
-                    contentElement == null -> ""
-                    contentElement.isJsonPrimitive && contentElement.asJsonPrimitive.isString -> {
-                        contentElement.asString
-                    }
-                    contentElement.isJsonArray -> {
-                        // Store multimodal content as a list of maps using TypeToken for type safety
-                        val mapType = object : TypeToken<Map<String, Any>>() {}.type
-                        contentElement.asJsonArray.map { part ->
-                            gson.fromJson<Map<String, Any>>(part, mapType)
-                        }
-                    }
-                    else -> contentElement.toString()
-                }
-                
-                mapOf(
-                    "role" to role,
-                    "content" to content
-                )
-            }
-            
-            val storedCompletion = StoredCompletion(
-                id = id,
-                obj = "chat.completion",
-                created = created,
-                model = model.getModelName(),
-                messages = messagesList,
-                responseContent = completion,
-                metadata = metadata
-            )
-            
-            storedCompletions[id] = storedCompletion
-            LogManager.i(TAG, "Stored completion with ID: $id")
+            storeCompletion(id, created, messages, completions[0], metadata, plan.model.getModelName())
         }
         
-        val response = mapOf(
+        return mapOf(
             "id" to id,
             "object" to "chat.completion",
             "created" to created,
-            "model" to model.getModelName(),
-            "choices" to listOf(
+            "model" to plan.model.getModelName(),
+            "choices" to completions.mapIndexed { index, completion ->
                 mapOf(
-                    "index" to 0,
+                    "index" to index,
                     "message" to mapOf(
                         "role" to "assistant",
                         "content" to completion
                     ),
                     "finish_reason" to "stop"
                 )
-            ),
-            "usage" to mapOf(
-                "prompt_tokens" to promptTokens,
-                "completion_tokens" to completionTokens,
-                "total_tokens" to (promptTokens + completionTokens)
-            )
+            },
+            "usage" to usage
         )
-        
-        LogManager.i(TAG, "Chat completion completed successfully for session: $sessionId")
-        
-        val responseJson = gson.toJson(response)
-        
-        // Log request if logging is enabled
-        logRequestIfEnabled(ctx, "/v1/chat/completions", bodyText, responseJson)
-        
-        ctx.contentType("application/json").result(responseJson)
     }
     
     private fun handleChatStreamingResponse(
@@ -557,18 +1252,14 @@ class OpenAIApiServer(
         messages: com.google.gson.JsonArray,
         store: Boolean,
         metadata: Map<String, Any>?,
-        bodyText: String
+        bodyText: String,
+        plan: GenerationPlan
     ) {
         LogManager.i(TAG, "Starting chat streaming response for session: $sessionId")
         
-        // Note: Storing streaming completions is not supported in this implementation
-        // as it requires buffering the entire response before streaming
-        if (store) {
-            LogManager.w(TAG, "Store parameter is not supported with streaming responses")
-        }
-        
         val id = "chatcmpl-${System.currentTimeMillis()}"
         val created = System.currentTimeMillis() / 1000
+        val n = config.n
         
         // Use Javalin's SSE support for streaming
         ctx.contentType("text/event-stream")
@@ -578,29 +1269,38 @@ class OpenAIApiServer(
         // Get the response output stream
         val outputStream = ctx.res().outputStream
         
-        // Accumulate response for logging (using StringBuffer for thread safety)
-        val accumulatedResponse = StringBuffer()
+        // Accumulate each choice's response for logging (using StringBuffer for thread safety)
+        val accumulatedResponses = Array(n) { StringBuffer() }
         
         try {
-            var tokenCount = 0
+            val tokenCount = AtomicInteger(0)
+            // Choices that could not be started; the other choices still stream
+            val failedChoices = ConcurrentHashMap.newKeySet<Int>()
             
-            val job = if (contents is String) {
-                model.generateStream(contents, config, sessionId) { token ->
-                    try {
-                        tokenCount++
-                        
-                        // Accumulate token for logging
-                        accumulatedResponse.append(token)
-                        
-                        // Format according to OpenAI SSE format for chat
-                        val chunk = mapOf(
-                            "id" to id,
-                            "object" to "chat.completion.chunk",
-                            "created" to created,
-                            "model" to model.getModelName(),
-                            "choices" to listOf(
-                                mapOf(
-                                    "index" to 0,
+            // Token chunks as streamed, kept when the response will be cached
+            val streamedTokens = if (plan.cachesResult) {
+                Collections.synchronizedList(mutableListOf<String>())
+            } else {
+                null
+            }
+            
+            // With n > 1 choices stream in parallel, so writes are serialised on the stream
+            fun tokenHandler(index: Int): (String) -> Unit = { token ->
+                val count = tokenCount.incrementAndGet()
+                try {
+                    // Accumulate token for logging
+                    accumulatedResponses[index].append(token)
+                    streamedTokens?.add(token)
+                    
+                    // Format according to OpenAI SSE format for chat
+                    val chunk = mapOf(
+                        "id" to id,
+                        "object" to "chat.completion.chunk",
+                        "created" to created,
+                        "model" to plan.model.getModelName(),
+                        "choices" to listOf(
+                            mapOf(
+                                "index" to index,
                                 "delta" to mapOf(
                                     "content" to token
                                 ),
@@ -611,88 +1311,64 @@ class OpenAIApiServer(
                     
                     // Write SSE format: "data: {json}\n\n"
                     val sseData = "data: ${gson.toJson(chunk)}\n\n"
-                    outputStream.write(sseData.toByteArray(Charsets.UTF_8))
-                    outputStream.flush()
+                    synchronized(outputStream) {
+                        outputStream.write(sseData.toByteArray(Charsets.UTF_8))
+                        outputStream.flush()
+                    }
                     
-                    LogManager.d(TAG, "Streamed token $tokenCount")
+                    LogManager.d(TAG) { "Streamed token $count" }
                 } catch (e: IOException) {
                     // Client disconnected - stop streaming gracefully
-                    LogManager.d(TAG, "Client disconnected during streaming (token $tokenCount)")
+                    LogManager.d(TAG) { "Client disconnected during streaming (token $count)" }
                     throw e
                 } catch (e: Exception) {
                     LogManager.e(TAG, "Error writing token to stream", e)
                     throw e
                 }
             }
-            } else {
-                // Multimodal streaming
-                @Suppress("UNCHECKED_CAST")
-                model.generateStreamWithContents(contents as List<Content>, config, sessionId) { token ->
-                    try {
-                        tokenCount++
-                        
-                        // Accumulate token for logging
-                        accumulatedResponse.append(token)
-                        
-                        // Format according to OpenAI SSE format for chat
-                        val chunk = mapOf(
-                            "id" to id,
-                            "object" to "chat.completion.chunk",
-                            "created" to created,
-                            "model" to model.getModelName(),
-                            "choices" to listOf(
-                                mapOf(
-                                    "index" to 0,
-                                    "delta" to mapOf(
-                                        "content" to token
-                                    ),
-                                    "finish_reason" to null
-                                )
-                            )
-                        )
-                        
-                        // Write SSE format: "data: {json}\n\n"
-                        val sseData = "data: ${gson.toJson(chunk)}\n\n"
-                        outputStream.write(sseData.toByteArray(Charsets.UTF_8))
-                        outputStream.flush()
-                        
-                        LogManager.d(TAG, "Streamed multimodal token $tokenCount")
-                    } catch (e: IOException) {
-                        // Client disconnected - stop streaming gracefully
-                        LogManager.d(TAG, "Client disconnected during multimodal streaming (token $tokenCount)")
-                        throw e
-                    } catch (e: Exception) {
-                        LogManager.e(TAG, "Error writing multimodal token to stream", e)
-                        throw e
-                    }
-                }
-            }
             
-            // Wait for streaming to complete
-            // Using runBlocking is necessary here because Javalin handlers are not suspend functions
-            // Blocking is acceptable for streaming responses as we need to keep the connection open
-            if (job != null) {
-                runBlocking { job.join() }
-            } else {
-                LogManager.e(TAG, "Failed to start streaming: generateStream returned null")
-                // Write error chunk to client
+            // Ends one choice with finish_reason "error"; the others keep streaming
+            fun writeErrorChunk(index: Int, message: String) {
                 val errorChunk = mapOf(
                     "id" to id,
                     "object" to "chat.completion.chunk",
                     "created" to created,
-                    "model" to model.getModelName(),
+                    "model" to plan.model.getModelName(),
                     "choices" to listOf(
                         mapOf(
-                            "index" to 0,
+                            "index" to index,
                             "delta" to mapOf(
-                                "content" to "Error: Failed to start streaming"
+                                "content" to "Error: $message"
                             ),
                             "finish_reason" to "error"
                         )
                     )
                 )
-                val errorData = "data: ${gson.toJson(errorChunk)}\n\ndata: [DONE]\n\n"
-                outputStream.write(errorData.toByteArray(Charsets.UTF_8))
+                val errorData = "data: ${gson.toJson(errorChunk)}\n\n"
+                synchronized(outputStream) {
+                    outputStream.write(errorData.toByteArray(Charsets.UTF_8))
+                    outputStream.flush()
+                }
+            }
+            
+            // Wait for streaming to complete
+            // runChoices uses runBlocking because Javalin handlers are not suspend functions
+            // Blocking is acceptable for streaming responses as we need to keep the connection open
+            runChoices(n) { index ->
+                val stream = startStream(contents, choiceConfig(config, index), sessionId, plan, tokenHandler(index))
+                if (stream == null) {
+                    LogManager.e(TAG, "Failed to start streaming choice $index: generateStream returned null")
+                    failedChoices.add(index)
+                    writeErrorChunk(index, "Failed to start streaming")
+                } else if (!stream.await()) {
+                    LogManager.w(TAG, "Shared generation for choice $index failed")
+                    failedChoices.add(index)
+                    writeErrorChunk(index, "Shared generation failed")
+                }
+            }
+            
+            if (failedChoices.size == n) {
+                outputStream.write("data: [DONE]\n\n".toByteArray(Charsets.UTF_8))
                 outputStream.flush()
                 return
             }
@@ -703,51 +1379,65 @@ class OpenAIApiServer(
                     "id" to id,
                     "object" to "chat.completion.chunk",
                     "created" to created,
-                    "model" to model.getModelName(),
-                    "choices" to listOf(
+                    "model" to plan.model.getModelName(),
+                    "choices" to (0 until n).filter { it !in failedChoices }.map { index ->
                         mapOf(
-                            "index" to 0,
+                            "index" to index,
                             "delta" to mapOf<String, String>(),
                             "finish_reason" to "stop"
                         )
-                    )
+                    }
                 )
                 val finalData = "data: ${gson.toJson(finalChunk)}\n\ndata: [DONE]\n\n"
                 outputStream.write(finalData.toByteArray(Charsets.UTF_8))
                 outputStream.flush()
                 
-                LogManager.i(TAG, "Chat streaming completed with $tokenCount tokens")
+                LogManager.i(TAG, "Chat streaming completed with ${tokenCount.get()} tokens")
+                recordPromptLookup(contents, accumulatedResponses.filterIndexed { index, _ -> index !in failedChoices }.map { it.toString() }, config, plan.model)
+                config.prediction?.takeIf { 0 !in failedChoices }?.let { prediction ->
+                    val result = PredictedOutput.compare(prediction, accumulatedResponses[0].toString())
+                    LogManager.i(TAG, "Predicted output: ${result.acceptedTokens} tokens accepted, ${result.rejectedTokens} rejected")
+                }
+                
+                if (streamedTokens != null && plan.cacheKey != null) {
+                    responseCache.put(plan.cacheKey, accumulatedResponses[0].toString(), streamedTokens.toList())
+                }
+                
+                // The full response is already accumulated for logging; store it too
+                if (store && 0 !in failedChoices) {
+                    storeCompletion(id, created, messages, accumulatedResponses[0].toString(), metadata, plan.model.getModelName())
+                }
                 
                 // Log request if logging is enabled (after streaming completes)
                 val fullResponse = mapOf(
                     "id" to id,
                     "object" to "chat.completion",
                     "created" to created,
-                    "model" to model.getModelName(),
-                    "choices" to listOf(
+                    "model" to plan.model.getModelName(),
+                    "choices" to accumulatedResponses.mapIndexed { index, response ->
                         mapOf(
-                            "index" to 0,
+                            "index" to index,
                             "message" to mapOf(
                                 "role" to "assistant",
-                                "content" to accumulatedResponse.toString()
+                                "content" to response.toString()
                             ),
-                            "finish_reason" to "stop"
+                            "finish_reason" to if (index in failedChoices) "error" else "stop"
                         )
-                    )
+                    }
                 )
                 val responseJson = gson.toJson(fullResponse)
                 logRequestIfEnabled(ctx, "/v1/chat/completions", bodyText, responseJson)
             } catch (e: IOException) {
                 // Client disconnected before the final chunk could be sent — this is normal.
-                LogManager.d(TAG, "Client disconnected before final chat streaming chunk: ${e.message}")
+                LogManager.d(TAG) { "Client disconnected before final chat streaming chunk: ${e.message}" }
             } catch (e: IllegalStateException) {
                 // Handle Jetty output stream state errors gracefully
                 // This can happen if the client disconnected or the stream is already closed
-                LogManager.d(TAG, "Output stream no longer writable (client may have disconnected): ${e.message}")
+                LogManager.d(TAG) { "Output stream no longer writable (client may have disconnected): ${e.message}" }
             }
         } catch (e: IOException) {
             // Client disconnected during chat streaming — not an application error.
-            LogManager.d(TAG, "Client disconnected during chat streaming: ${e.message}")
+            LogManager.d(TAG) { "Client disconnected during chat streaming: ${e.message}" }
         } catch (e: Exception) {
             LogManager.e(TAG, "Error in chat streaming", e)
         }
@@ -784,24 +1474,41 @@ class OpenAIApiServer(
             // Extract session ID using helper method
             val sessionId = extractSessionId(ctx, request)
             
-            LogManager.d(TAG, "Text completion - Using session ID: $sessionId")
+            LogManager.d(TAG) { "Text completion - Using session ID: $sessionId" }
             
             // Build generation config from request parameters
             val config = extractGenerationConfig(request)
             
+            if (!checkChoiceCount(ctx, config)) {
+                return
+            }
+            
+            val lease = acquireModel(ctx, request) ?: return
+            val plan = planGeneration("completion", JsonPrimitive(prompt), config, lease.model)
+            
             // Acquire a permit before running inference. If max concurrency is reached the
             // calling thread blocks here until a permit becomes available (FIFO queue).
-            LogManager.d(TAG, "Acquiring concurrency permit (available: ${requestSemaphore.availablePermits()}, queue depth: ${requestSemaphore.queueLength})")
-            requestSemaphore.acquire()
-            LogManager.d(TAG, "Concurrency permit acquired for text completion")
+            // Cache hits and requests sharing another request's generation skip the queue.
             try {
-                if (stream) {
-                    handleCompletionStreamingResponse(ctx, prompt, config, sessionId, bodyText)
-                } else {
-                    handleCompletionNonStreamingResponse(ctx, prompt, config, sessionId, bodyText)
+                if (plan.needsPermit) {
+                    LogManager.d(TAG) { "Acquiring concurrency permit (available: ${requestSemaphore.availablePermits()}, queue depth: ${requestSemaphore.queueLength})" }
+                    requestSemaphore.acquire()
+                    LogManager.d(TAG, "Concurrency permit acquired for text completion")
+                }
+                try {
+                    if (stream) {
+                        handleCompletionStreamingResponse(ctx, prompt, config, sessionId, bodyText, plan)
+                    } else {
+                        handleCompletionNonStreamingResponse(ctx, prompt, config, sessionId, bodyText, plan)
+                    }
+                } finally {
+                    if (plan.needsPermit) {
+                        requestSemaphore.release()
+                    }
                 }
             } finally {
-                requestSemaphore.release()
+                plan.abandon()
+                lease.release()
             }
         } catch (e: Exception) {
             LogManager.e(TAG, "Error handling completions", e)
@@ -817,26 +1524,31 @@ class OpenAIApiServer(
         prompt: String,
         config: GenerationConfig,
         sessionId: String,
-        bodyText: String
+        bodyText: String,
+        plan: GenerationPlan
     ) {
         // Generate response with session ID
-        val completion = model.generate(prompt, config, sessionId)
+        val completions = Array(config.n) { "" }
+        runChoices(config.n) { index ->
+            completions[index] = generateText(prompt, choiceConfig(config, index), sessionId, plan)
+        }
         
         val promptTokens = prompt.split(" ").size
-        val completionTokens = completion.split(" ").size
+        val completionTokens = completions.sumOf { it.split(" ").size }
+        recordPromptLookup(prompt, completions.asList(), config, plan.model)
         
         val response = mapOf(
             "id" to "cmpl-${System.currentTimeMillis()}",
             "object" to "text_completion",
             "created" to System.currentTimeMillis() / 1000,
-            "model" to model.getModelName(),
-            "choices" to listOf(
+            "model" to plan.model.getModelName(),
+            "choices" to completions.mapIndexed { index, completion ->
                 mapOf(
                     "text" to completion,
-                    "index" to 0,
+                    "index" to index,
                     "finish_reason" to "stop"
                 )
-            ),
+            },
             "usage" to mapOf(
                 "prompt_tokens" to promptTokens,
                 "completion_tokens" to completionTokens,
@@ -857,12 +1569,14 @@ class OpenAIApiServer(
         prompt: String,
         config: GenerationConfig,
         sessionId: String,
-        bodyText: String
+        bodyText: String,
+        plan: GenerationPlan
     ) {
         LogManager.i(TAG, "Starting completion streaming response for session: $sessionId")
         
         val id = "cmpl-${System.currentTimeMillis()}"
         val created = System.currentTimeMillis() / 1000
+        val n = config.n
         
         // Use Javalin's SSE support for streaming
         ctx.contentType("text/event-stream")
@@ -872,29 +1586,39 @@ class OpenAIApiServer(
         // Get the response output stream
         val outputStream = ctx.res().outputStream
         
-        // Accumulate response for logging (using StringBuffer for thread safety)
-        val accumulatedResponse = StringBuffer()
+        // Accumulate each choice's response for logging (using StringBuffer for thread safety)
+        val accumulatedResponses = Array(n) { StringBuffer() }
         
         try {
-            var tokenCount = 0
+            val tokenCount = AtomicInteger(0)
+            // Choices that could not be started; the other choices still stream
+            val failedChoices = ConcurrentHashMap.newKeySet<Int>()
             
-            val job = model.generateStream(prompt, config, sessionId) { token ->
+            // Token chunks as streamed, kept when the response will be cached
+            val streamedTokens = if (plan.cachesResult) {
+                Collections.synchronizedList(mutableListOf<String>())
+            } else {
+                null
+            }
+            
+            // With n > 1 choices stream in parallel, so writes are serialised on the stream
+            fun tokenHandler(index: Int): (String) -> Unit = { token ->
+                val count = tokenCount.incrementAndGet()
                 try {
-                    tokenCount++
-                    
                     // Accumulate token for logging
-                    accumulatedResponse.append(token)
+                    accumulatedResponses[index].append(token)
+                    streamedTokens?.add(token)
                     
                     // Format according to OpenAI SSE format for completions
                     val chunk = mapOf(
                         "id" to id,
                         "object" to "text_completion",
                         "created" to created,
-                        "model" to model.getModelName(),
+                        "model" to plan.model.getModelName(),
                         "choices" to listOf(
                             mapOf(
                                 "text" to token,
-                                "index" to 0,
+                                "index" to index,
                                 "finish_reason" to null
                             )
                         )
@@ -902,13 +1626,15 @@ class OpenAIApiServer(
                     
                     // Write SSE format: "data: {json}\n\n"
                     val sseData = "data: ${gson.toJson(chunk)}\n\n"
-                    outputStream.write(sseData.toByteArray(Charsets.UTF_8))
-                    outputStream.flush()
+                    synchronized(outputStream) {
+                        outputStream.write(sseData.toByteArray(Charsets.UTF_8))
+                        outputStream.flush()
+                    }
                     
-                    LogManager.d(TAG, "Streamed token $tokenCount")
+                    LogManager.d(TAG) { "Streamed token $count" }
                 } catch (e: IOException) {
                     // Client disconnected - stop streaming gracefully
-                    LogManager.d(TAG, "Client disconnected during streaming (token $tokenCount)")
+                    LogManager.d(TAG) { "Client disconnected during streaming (token $count)" }
                     throw e
                 } catch (e: Exception) {
                     LogManager.e(TAG, "Error writing token to stream", e)
@@ -916,85 +1642,735 @@ class OpenAIApiServer(
                 }
             }
             
-            // Wait for streaming to complete
-            // Using runBlocking is necessary here because Javalin handlers are not suspend functions
-            // Blocking is acceptable for streaming responses as we need to keep the connection open
-            if (job != null) {
-                runBlocking { job.join() }
-            } else {
-                LogManager.e(TAG, "Failed to start streaming: generateStream returned null")
-                // Write error chunk to client
+            // Ends one choice with finish_reason "error"; the others keep streaming
+            fun writeErrorChunk(index: Int, message: String) {
                 val errorChunk = mapOf(
                     "id" to id,
                     "object" to "text_completion",
                     "created" to created,
-                    "model" to model.getModelName(),
+                    "model" to plan.model.getModelName(),
                     "choices" to listOf(
                         mapOf(
-                            "text" to "Error: Failed to start streaming",
-                            "index" to 0,
+                            "text" to "Error: $message",
+                            "index" to index,
                             "finish_reason" to "error"
                         )
                     )
                 )
-                val errorData = "data: ${gson.toJson(errorChunk)}\n\ndata: [DONE]\n\n"
-                outputStream.write(errorData.toByteArray(Charsets.UTF_8))
+                val errorData = "data: ${gson.toJson(errorChunk)}\n\n"
+                synchronized(outputStream) {
+                    outputStream.write(errorData.toByteArray(Charsets.UTF_8))
+                    outputStream.flush()
+                }
+            }
+            
+            // Wait for streaming to complete
+            // runChoices uses runBlocking because Javalin handlers are not suspend functions
+            // Blocking is acceptable for streaming responses as we need to keep the connection open
+            runChoices(n) { index ->
+                val stream = startStream(prompt, choiceConfig(config, index), sessionId, plan, tokenHandler(index))
+                if (stream == null) {
+                    LogManager.e(TAG, "Failed to start streaming choice $index: generateStream returned null")
+                    failedChoices.add(index)
+                    writeErrorChunk(index, "Failed to start streaming")
+                } else if (!stream.await()) {
+                    LogManager.w(TAG, "Shared generation for choice $index failed")
+                    failedChoices.add(index)
+                    writeErrorChunk(index, "Shared generation failed")
+                }
+            }
+            
+            if (failedChoices.size == n) {
+                outputStream.write("data: [DONE]\n\n".toByteArray(Charsets.UTF_8))
                 outputStream.flush()
                 return
             }
-            
-            // Send final chunk with finish_reason
+            
+            // Send final chunk with finish_reason
+            try {
+                val finalChunk = mapOf(
+                    "id" to id,
+                    "object" to "text_completion",
+                    "created" to created,
+                    "model" to plan.model.getModelName(),
+                    "choices" to (0 until n).filter { it !in failedChoices }.map { index ->
+                        mapOf(
+                            "text" to "",
+                            "index" to index,
+                            "finish_reason" to "stop"
+                        )
+                    }
+                )
+                val finalData = "data: ${gson.toJson(finalChunk)}\n\ndata: [DONE]\n\n"
+                outputStream.write(finalData.toByteArray(Charsets.UTF_8))
+                outputStream.flush()
+                
+                LogManager.i(TAG, "Completion streaming completed with ${tokenCount.get()} tokens")
+                recordPromptLookup(prompt, accumulatedResponses.filterIndexed { index, _ -> index !in failedChoices }.map { it.toString() }, config, plan.model)
+                
+                if (streamedTokens != null && plan.cacheKey != null) {
+                    responseCache.put(plan.cacheKey, accumulatedResponses[0].toString(), streamedTokens.toList())
+                }
+                
+                // Log request if logging is enabled (after streaming completes)
+                val fullResponse = mapOf(
+                    "id" to id,
+                    "object" to "text_completion",
+                    "created" to created,
+                    "model" to plan.model.getModelName(),
+                    "choices" to accumulatedResponses.mapIndexed { index, response ->
+                        mapOf(
+                            "text" to response.toString(),
+                            "index" to index,
+                            "finish_reason" to if (index in failedChoices) "error" else "stop"
+                        )
+                    }
+                )
+                val responseJson = gson.toJson(fullResponse)
+                logRequestIfEnabled(ctx, "/v1/completions", bodyText, responseJson)
+            } catch (e: IOException) {
+                // Client disconnected before the final chunk could be sent — this is normal.
+                LogManager.d(TAG) { "Client disconnected before final completion streaming chunk: ${e.message}" }
+            } catch (e: IllegalStateException) {
+                // Handle Jetty output stream state errors gracefully
+                // This can happen if the client disconnected or the stream is already closed
+                LogManager.d(TAG) { "Output stream no longer writable (client may have disconnected): ${e.message}" }
+            }
+        } catch (e: IOException) {
+            // Client disconnected during completion streaming — not an application error.
+            LogManager.d(TAG) { "Client disconnected during completion streaming: ${e.message}" }
+        } catch (e: Exception) {
+            LogManager.e(TAG, "Error in completion streaming", e)
+        }
+        // Note: Javalin manages the output stream lifecycle; don't close it manually
+    }
+    
+    // ---- WebSocket streaming (/v1/ws) ----
+    //
+    // One connection carries any number of concurrent generations.  The client sends
+    //   {"type": "chat.completions.create" | "completions.create", "id": "<stream id>", "request": {...}}
+    //   {"type": "cancel", "id": "<stream id>"}
+    // and the server answers each stream with one "start" frame carrying the envelope
+    // (completion ID, object, created, model), compact token frames {"id", "d"[, "c"]}
+    // and a final "done" (or "error") frame.
+    
+    private fun handleWebSocketConnect(ctx: WsConnectContext) {
+        ctx.session.idleTimeout = Duration.ofMillis(WS_IDLE_TIMEOUT_MS)
+        ctx.session.maxTextMessageSize = MAX_REQUEST_BODY_SIZE.toLong()
+        webSocketStreams[ctx.sessionId] = ConcurrentHashMap()
+        LogManager.i(TAG, "WebSocket connected: ${ctx.sessionId}")
+    }
+    
+    private fun handleWebSocketClose(connectionId: String) {
+        val streams = webSocketStreams.remove(connectionId) ?: return
+        // Stop generations nobody is listening to any more
+        streams.values.forEach { it.set(true) }
+        LogManager.i(TAG, "WebSocket closed: $connectionId (${streams.size} stream(s) cancelled)")
+    }
+    
+    private fun handleWebSocketMessage(ctx: WsMessageContext) {
+        val message = try {
+            gson.fromJson(ctx.message(), JsonObject::class.java)
+        } catch (e: Exception) {
+            null
+        }
+        val type = message?.get("type")?.takeIf { it.isJsonPrimitive }?.asString
+        val streamId = message?.get("id")?.takeIf { it.isJsonPrimitive }?.asString
+        if (message == null || type == null || streamId.isNullOrEmpty()) {
+            sendWebSocketFrame(ctx, mapOf(
+                "type" to "error",
+                "id" to streamId,
+                "error" to mapOf("message" to "Frames must be JSON objects with 'type' and 'id'")
+            ))
+            return
+        }
+        val streams = webSocketStreams[ctx.sessionId] ?: return
+        
+        when (type) {
+            "cancel" -> {
+                streams[streamId]?.set(true)
+                LogManager.d(TAG) { "WebSocket stream $streamId cancelled by client" }
+            }
+            "chat.completions.create", "completions.create" -> {
+                val request = message.get("request")?.takeIf { it.isJsonObject }?.asJsonObject
+                val error = when {
+                    request == null -> "'request' object is required"
+                    streams.size >= WS_MAX_STREAMS_PER_CONNECTION -> "Too many concurrent streams on this connection"
+                    else -> null
+                }
+                if (error != null) {
+                    sendWebSocketError(ctx, streamId, error)
+                    return
+                }
+                val cancelled = AtomicBoolean(false)
+                if (streams.putIfAbsent(streamId, cancelled) != null) {
+                    sendWebSocketError(ctx, streamId, "Stream $streamId is already active")
+                    return
+                }
+                if (activeWebSocketStreams.incrementAndGet() > WS_MAX_STREAMS) {
+                    activeWebSocketStreams.decrementAndGet()
+                    streams.remove(streamId, cancelled)
+                    sendWebSocketError(ctx, streamId, "Too many concurrent streams on this server")
+                    return
+                }
+                serverScope.launch {
+                    try {
+                        runWebSocketStream(ctx, streamId, type == "chat.completions.create", request!!, cancelled)
+                    } catch (e: Exception) {
+                        LogManager.e(TAG, "Error in WebSocket stream $streamId", e)
+                        sendWebSocketError(ctx, streamId, e.message ?: "Internal server error")
+                    } finally {
+                        streams.remove(streamId, cancelled)
+                    }
+                }.invokeOnCompletion { activeWebSocketStreams.decrementAndGet() }
+            }
+            else -> sendWebSocketError(ctx, streamId, "Unknown frame type: $type")
+        }
+    }
+    
+    /**
+     * Run one generation for a WebSocket stream, with the same parameters, caching,
+     * concurrency limit and logging as the corresponding HTTP endpoint.
+     */
+    private fun runWebSocketStream(
+        ctx: WsContext,
+        streamId: String,
+        isChat: Boolean,
+        request: JsonObject,
+        cancelled: AtomicBoolean
+    ) {
+        val endpoint = if (isChat) "/v1/chat/completions" else "/v1/completions"
+        val enabled = if (isChat) settingsManager.isChatCompletionsEnabled() else settingsManager.isTextCompletionsEnabled()
+        if (!enabled) {
+            sendWebSocketError(ctx, streamId, "${if (isChat) "Chat Completions" else "Text Completions"} endpoint is disabled in settings")
+            return
+        }
+        
+        val sessionId = extractSessionId(request, ctx.header("X-Session-ID"))
+        val messages = if (isChat) {
+            request.get("messages")?.takeIf { it.isJsonArray }?.asJsonArray ?: run {
+                sendWebSocketError(ctx, streamId, "messages is required")
+                return
+            }
+        } else {
+            null
+        }
+        val config = try {
+            extractGenerationConfig(request).let { base ->
+                if (isChat) base.copy(responseFormat = JsonMode.parse(request.get("response_format"))) else base
+            }
+        } catch (e: IllegalArgumentException) {
+            sendWebSocketError(ctx, streamId, e.message ?: "Invalid request")
+            return
+        }
+        if (config.n !in 1..MAX_CHOICES) {
+            sendWebSocketError(ctx, streamId, "n must be between 1 and $MAX_CHOICES")
+            return
+        }
+        
+        if (!admitUnderMemoryPressure()) {
+            sendWebSocketError(ctx, streamId, "Server is low on memory; try again shortly")
+            return
+        }
+        val lease = try {
+            modelRegistry.acquire(requestedModel(request))
+        } catch (e: ModelUnavailableException) {
+            sendWebSocketError(ctx, streamId, e.message ?: "Model unavailable")
+            return
+        }
+        
+        val prompt = request.get("prompt")?.asString ?: ""
+        val plan = if (messages != null) {
+            planGeneration("chat", messages, config, lease.model)
+        } else {
+            planGeneration("completion", JsonPrimitive(prompt), config, lease.model)
+        }
+        
+        try {
+            // Wait in slices so a stream cancelled while queued gives up its place
+            if (plan.needsPermit) {
+                while (!requestSemaphore.tryAcquire(WS_PERMIT_POLL_MS, TimeUnit.MILLISECONDS)) {
+                    if (cancelled.get()) {
+                        sendWebSocketFrame(ctx, mapOf("type" to "done", "id" to streamId, "finish_reason" to "cancelled"))
+                        return
+                    }
+                }
+            }
+            try {
+                if (cancelled.get()) {
+                    sendWebSocketFrame(ctx, mapOf("type" to "done", "id" to streamId, "finish_reason" to "cancelled"))
+                    return
+                }
+                // Fitted with the permit held, because the summarize policy runs the model
+                val contents: Any = if (messages != null) {
+                    try {
+                        JsonMode.applyInstruction(buildContentsFromMessages(fitContext(messages, config, plan)), config.responseFormat)
+                    } catch (e: ContextLengthExceededException) {
+                        sendWebSocketError(ctx, streamId, e.message ?: "Context length exceeded")
+                        return
+                    }
+                } else {
+                    prompt
+                }
+                streamToWebSocket(ctx, streamId, isChat, request, contents, messages, config, sessionId, plan, cancelled, endpoint)
+            } finally {
+                if (plan.needsPermit) {
+                    requestSemaphore.release()
+                }
+            }
+        } finally {
+            plan.abandon()
+            lease.release()
+        }
+    }
+    
+    private fun streamToWebSocket(
+        ctx: WsContext,
+        streamId: String,
+        isChat: Boolean,
+        request: JsonObject,
+        contents: Any,
+        messages: com.google.gson.JsonArray?,
+        config: GenerationConfig,
+        sessionId: String,
+        plan: GenerationPlan,
+        cancelled: AtomicBoolean,
+        endpoint: String
+    ) {
+        val completionId = (if (isChat) "chatcmpl-" else "cmpl-") + System.currentTimeMillis()
+        val created = System.currentTimeMillis() / 1000
+        val n = config.n
+        
+        // The envelope is sent once; token frames only carry the stream ID and delta
+        sendWebSocketFrame(ctx, mapOf(
+            "type" to "start",
+            "id" to streamId,
+            "completion_id" to completionId,
+            "object" to if (isChat) "chat.completion.chunk" else "text_completion",
+            "created" to created,
+            "model" to plan.model.getModelName(),
+            "n" to n
+        ))
+        
+        val accumulatedResponses = Array(n) { StringBuffer() }
+        val tokenCount = AtomicInteger(0)
+        // Choices that could not be started; the other choices still stream
+        val failedChoices = ConcurrentHashMap.newKeySet<Int>()
+        val streamedTokens = if (plan.cachesResult) {
+            Collections.synchronizedList(mutableListOf<String>())
+        } else {
+            null
+        }
+        
+        fun tokenHandler(index: Int): (String) -> Unit = { token ->
+            if (cancelled.get()) {
+                // In-band cancellation (or the connection closed): end the generation cleanly
+                throw StopGenerationException()
+            }
+            tokenCount.incrementAndGet()
+            accumulatedResponses[index].append(token)
+            streamedTokens?.add(token)
+            val frame = if (n > 1) {
+                mapOf("id" to streamId, "c" to index, "d" to token)
+            } else {
+                mapOf("id" to streamId, "d" to token)
+            }
+            sendWebSocketFrame(ctx, frame, throwOnFailure = true)
+        }
+        
+        runChoices(n) { index ->
+            val stream = startStream(contents, choiceConfig(config, index), sessionId, plan, tokenHandler(index))
+            val failed = if (stream == null) {
+                LogManager.e(TAG, "Failed to start WebSocket stream $streamId choice $index")
+                true
+            } else if (!stream.await() && !cancelled.get()) {
+                // A cancelled leader cuts its flight off too, but still ends as "cancelled"
+                LogManager.w(TAG, "Shared generation for WebSocket stream $streamId failed")
+                true
+            } else {
+                false
+            }
+            if (failed) {
+                failedChoices.add(index)
+                if (n > 1) {
+                    sendWebSocketFrame(ctx, mapOf("id" to streamId, "c" to index, "finish_reason" to "error"))
+                }
+            }
+        }
+        
+        if (failedChoices.size == n) {
+            // Only single-choice requests share a generation, so a shared failure lands here
+            sendWebSocketError(ctx, streamId, if (plan.flight != null) "Shared generation failed" else "Failed to start streaming")
+            return
+        }
+        
+        val wasCancelled = cancelled.get()
+        sendWebSocketFrame(ctx, mapOf(
+            "type" to "done",
+            "id" to streamId,
+            "finish_reason" to if (wasCancelled) "cancelled" else "stop",
+            "usage" to mapOf("completion_tokens" to tokenCount.get())
+        ))
+        LogManager.i(TAG, "WebSocket stream $streamId completed with ${tokenCount.get()} tokens" +
+            if (wasCancelled) " (cancelled)" else "")
+        if (wasCancelled) {
+            return
+        }
+        
+        if (streamedTokens != null && plan.cacheKey != null) {
+            responseCache.put(plan.cacheKey, accumulatedResponses[0].toString(), streamedTokens.toList())
+        }
+        if (messages != null && request.get("store")?.asBoolean == true && 0 !in failedChoices) {
+            val metadata = parseMetadata(request.get("metadata")?.takeIf { it.isJsonObject }?.asJsonObject)
+            storeCompletion(completionId, created, messages, accumulatedResponses[0].toString(), metadata, plan.model.getModelName())
+        }
+        
+        if (settingsManager.isLoggingEnabled()) {
+            val fullResponse = mapOf(
+                "id" to completionId,
+                "object" to if (isChat) "chat.completion" else "text_completion",
+                "created" to created,
+                "model" to plan.model.getModelName(),
+                "choices" to accumulatedResponses.mapIndexed { index, response ->
+                    if (isChat) {
+                        mapOf(
+                            "index" to index,
+                            "message" to mapOf("role" to "assistant", "content" to response.toString()),
+                            "finish_reason" to if (index in failedChoices) "error" else "stop"
+                        )
+                    } else {
+                        mapOf("text" to response.toString(), "index" to index,
+                            "finish_reason" to if (index in failedChoices) "error" else "stop")
+                    }
+                }
+            )
+            val ipAddress = ctx.session.remoteAddress?.toString() ?: "unknown"
+            requestLogger.logRequest(ipAddress, endpoint, request.toString(), gson.toJson(fullResponse))
+        }
+    }
+    
+    private fun sendWebSocketError(ctx: WsContext, streamId: String?, message: String) {
+        sendWebSocketFrame(ctx, mapOf(
+            "type" to "error",
+            "id" to streamId,
+            "error" to mapOf("message" to message, "type" to "invalid_request_error")
+        ))
+    }
+    
+    /**
+     * Send one frame.  Streams on the same connection send from different threads,
+     * and Jetty allows only one blocking write per session at a time.
+     * @param throwOnFailure Rethrow send errors (used by token callbacks to stop generation)
+     */
+    private fun sendWebSocketFrame(ctx: WsContext, frame: Map<String, Any?>, throwOnFailure: Boolean = false) {
+        try {
+            val json = gson.toJson(frame)
+            synchronized(ctx.session) {
+                ctx.send(json)
+            }
+        } catch (e: Exception) {
+            LogManager.d(TAG) { "WebSocket send failed (client may have disconnected): ${e.message}" }
+            if (throwOnFailure) throw IOException("WebSocket send failed", e)
+        }
+    }
+    
+    /**
+     * How a request's response is produced: replayed from the response cache, shared
+     * with an identical request that is already generating, or generated by this
+     * request.  A deterministic request that generates leads a [SingleFlight.Flight]
+     * so identical requests arriving meanwhile can join it.
+     */
+    private class GenerationPlan(
+        val model: LlamaModel,
+        val cacheKey: String?,
+        val cached: ResponseCache.Entry?,
+        val flight: SingleFlight.Flight?,
+        val isLeader: Boolean
+    ) {
+        /** Only a request that runs the model itself needs a concurrency permit. */
+        val needsPermit: Boolean get() = cached == null && (flight == null || isLeader)
+        
+        val isFollower: Boolean get() = flight != null && !isLeader
+        
+        /** Whether this request's own result goes into the response cache. */
+        val cachesResult: Boolean get() = cacheKey != null && needsPermit
+        
+        // Set once a follower has subscribed to or started waiting on its flight
+        private var attached = false
+        
+        /** Attach a follower to its flight; see [SingleFlight.join]. */
+        fun subscribe(onToken: (String) -> Unit) {
+            attached = true
+            flight!!.subscribe(onToken, joined = true)
+        }
+        
+        fun await(): String? {
+            attached = true
+            return flight!!.await()
+        }
+        
+        /**
+         * Release joiners if the leader failed before finishing its flight, or withdraw
+         * a follower that never attached; no-op otherwise.
+         */
+        fun abandon() {
+            if (isLeader) flight?.fail() else if (!attached) flight?.leave()
+        }
+    }
+    
+    /**
+     * Decide how [target] produces the response for a request of [kind] with [input].
+     * Only deterministic single-choice requests (temperature 0 or a fixed seed) are
+     * cached or shared; several choices are generated independently.
+     * A caller that becomes a flight leader must call [GenerationPlan.abandon] when done.
+     */
+    private fun planGeneration(kind: String, input: JsonElement, config: GenerationConfig, target: LlamaModel): GenerationPlan {
+        if (config.n > 1 || !ResponseCache.isDeterministic(config)) {
+            return GenerationPlan(target, null, null, null, false)
+        }
+        val key = ResponseCache.keyFor(kind, target.getModelPath() ?: target.getModelName(), input, config)
+        val cacheKey = key.takeIf { settingsManager.isResponseCacheEnabled() }
+        val cached = cacheKey?.let { responseCache.get(it) }
+        if (cached != null) {
+            LogManager.d(TAG, "Response cache hit for $kind request")
+            return GenerationPlan(target, cacheKey, cached, null, false)
+        }
+        val (flight, isLeader) = singleFlight.join(key)
+        return GenerationPlan(target, cacheKey, null, flight, isLeader)
+    }
+    
+    /**
+     * Resolve the request's `model` field to a loaded model (see [ModelRegistry]),
+     * waiting for it if it is still loading.  Sends 503 (with Retry-After while the
+     * model loads) and returns null if the model is not available.  The lease must be
+     * released when the request ends.
+     */
+    private fun acquireModel(ctx: JavalinContext, request: JsonObject): ModelRegistry.Lease? {
+        if (!admitUnderMemoryPressure()) {
+            ctx.header("Retry-After", PRESSURE_RETRY_AFTER_SECONDS.toString())
+            sendError(ctx, 503, "Server is low on memory; try again shortly", "server_error")
+            return null
+        }
+        return try {
+            modelRegistry.acquire(requestedModel(request))
+        } catch (e: ModelUnavailableException) {
+            LogManager.w(TAG, "Model unavailable: ${e.message}")
+            e.retryAfterSeconds?.let { ctx.header("Retry-After", it.toString()) }
+            sendError(ctx, 503, e.message ?: "Model unavailable", "server_error")
+            null
+        }
+    }
+    
+    private fun requestedModel(request: JsonObject): String? {
+        return request.get("model")?.takeIf { it.isJsonPrimitive }?.asString
+    }
+    
+    /**
+     * Run [task] for each of [n] choices and wait for all of them.
+     *
+     * LiteRT conversations cannot be forked after prefill, so every choice prefills
+     * the prompt on its own engine.  The request already holds one concurrency permit;
+     * up to n - 1 more are borrowed while nobody is waiting for one, and the choices
+     * run in parallel on that many engines (sequentially on the rest).  Choices never
+     * take an engine that another request holds a permit for.
+     */
+    private fun runChoices(n: Int, task: suspend (index: Int) -> Unit) {
+        if (n == 1) {
+            runBlocking { task(0) }
+            return
+        }
+        
+        val semaphore = requestSemaphore
+        var extraPermits = 0
+        while (extraPermits < n - 1 && !semaphore.hasQueuedThreads() && semaphore.tryAcquire()) {
+            extraPermits++
+        }
+        LogManager.d(TAG) { "Generating $n choices on ${extraPermits + 1} engine(s)" }
+        
+        val nextIndex = AtomicInteger(0)
+        try {
+            runBlocking(Dispatchers.IO) {
+                repeat(extraPermits + 1) {
+                    launch {
+                        while (true) {
+                            val index = nextIndex.getAndIncrement()
+                            if (index >= n) break
+                            task(index)
+                        }
+                    }
+                }
+            }
+        } finally {
+            semaphore.release(extraPermits)
+        }
+    }
+    
+    /**
+     * If the request asked for prompt-lookup measurement, record how well it would
+     * have drafted [outputs] (see [PromptLookup]).  Only text prompts are measured.
+     */
+    private fun recordPromptLookup(contents: Any, outputs: List<String>, config: GenerationConfig, target: LlamaModel) {
+        if (!PromptLookup.isRequested(config)) return
+        val prompt = contents as? String ?: return
+        for (output in outputs) {
+            if (output.startsWith("Error:")) continue
+            val result = PromptLookup.simulate(prompt, output, config)
+            target.stats.recordPromptLookup(result)
+            LogManager.i(TAG, "Prompt lookup: ${result.accepted}/${result.drafted} drafted tokens accepted " +
+                "over ${result.outputTokens} tokens")
+        }
+    }
+    
+    /**
+     * Config for choice [index]: with a fixed seed each choice gets its own seed so
+     * the choices differ but stay reproducible.
+     */
+    private fun choiceConfig(config: GenerationConfig, index: Int): GenerationConfig {
+        return if (config.seed >= 0 && index > 0) config.copy(seed = config.seed + index) else config
+    }
+    
+    /**
+     * Reject requests asking for an unsupported number of choices.
+     * @return True if the request may proceed
+     */
+    private fun checkChoiceCount(ctx: JavalinContext, config: GenerationConfig): Boolean {
+        if (config.n in 1..MAX_CHOICES) {
+            return true
+        }
+        sendError(ctx, 400, "n must be between 1 and $MAX_CHOICES")
+        return false
+    }
+    
+    /**
+     * Produce the full response text for [contents] (a prompt String or
+     * List<Content>) according to [plan].
+     */
+    private fun generateText(contents: Any, config: GenerationConfig, sessionId: String, plan: GenerationPlan): String {
+        // Streams cache and share the raw text, so strip any prose around a JSON value
+        val format = config.responseFormat
+        plan.cached?.let { return if (format != null) JsonMode.extract(it.text, format) else it.text }
+        if (plan.isFollower) {
+            val text = plan.await() ?: throw IllegalStateException("Shared generation failed")
+            return if (format != null) JsonMode.extract(text, format) else text
+        }
+        
+        val text = try {
+            if (format != null) {
+                generateJson(plan.model, contents, config, format, sessionId)
+            } else if (contents is String) {
+                plan.model.generate(contents, config, sessionId)
+            } else {
+                @Suppress("UNCHECKED_CAST")
+                plan.model.generateWithContents(contents as List<Content>, config, sessionId)
+            }
+        } catch (e: Exception) {
+            plan.abandon()
+            throw e
+        }
+        if (text.startsWith("Error:")) plan.abandon() else plan.flight?.finish(text)
+        if (plan.cacheKey != null) {
+            responseCache.put(plan.cacheKey, text)
+        }
+        return text
+    }
+    
+    /**
+     * Generate a JSON response for [contents]: streams internally so generation can
+     * stop as soon as the top-level value is complete, then strips surrounding text.
+     */
+    private fun generateJson(target: LlamaModel, contents: Any, config: GenerationConfig, format: ResponseFormat, sessionId: String): String {
+        val output = StringBuffer()
+        val sink = JsonMode.stopWhenComplete(format) { token -> output.append(token) }
+        val job = if (contents is String) {
+            target.generateStream(contents, config, sessionId, sink)
+        } else {
+            @Suppress("UNCHECKED_CAST")
+            target.generateStreamWithContents(contents as List<Content>, config, sessionId, sink)
+        }
+        if (job == null) {
+            return output.toString().ifEmpty { "Error: Failed to start generation" }
+        }
+        runBlocking { job.join() }
+        val text = output.toString()
+        return if (text.startsWith("Error:")) text else JsonMode.extract(text, format)
+    }
+    
+    /**
+     * Start streaming generation for [contents] (a prompt String or List<Content>)
+     * according to [plan]: replay a cached response at full speed, attach to an
+     * identical in-flight generation (receiving its tokens so far, then live), or
+     * run the model.  A leader's tokens are fanned out to every joined request.
+     * @return Deferred to await, completing with false if the shared generation this
+     *   stream leads or follows failed or was cut off; null if generation could not start
+     */
+    private fun startStream(
+        contents: Any,
+        config: GenerationConfig,
+        sessionId: String,
+        plan: GenerationPlan,
+        onToken: (String) -> Unit
+    ): Deferred<Boolean>? {
+        plan.cached?.let { cached ->
+            return serverScope.async {
+                try {
+                    cached.replayTokens().forEach(onToken)
+                } catch (e: Exception) {
+                    // onToken already logged the disconnect
+                }
+                true
+            }
+        }
+        
+        val flight = plan.flight
+        if (flight != null) {
+            if (!plan.isLeader) {
+                plan.subscribe(onToken)
+                return serverScope.async { flight.awaitResult() != null }
+            }
+            flight.subscribe(onToken)
+        }
+        
+        // The leader's flight only finishes with the streamed text if the generation
+        // completed (or JSON mode stopped it); an error token, or every client having
+        // disconnected, fails it so that joiners do not report a truncated text as success.
+        val failed = AtomicBoolean(false)
+        val baseSink: (String) -> Unit = if (flight != null) { token ->
+            if (token.startsWith("Error:")) failed.set(true)
             try {
-                val finalChunk = mapOf(
-                    "id" to id,
-                    "object" to "text_completion",
-                    "created" to created,
-                    "model" to model.getModelName(),
-                    "choices" to listOf(
-                        mapOf(
-                            "text" to "",
-                            "index" to 0,
-                            "finish_reason" to "stop"
-                        )
-                    )
-                )
-                val finalData = "data: ${gson.toJson(finalChunk)}\n\ndata: [DONE]\n\n"
-                outputStream.write(finalData.toByteArray(Charsets.UTF_8))
-                outputStream.flush()
-                
-                LogManager.i(TAG, "Completion streaming completed with $tokenCount tokens")
-                
-                // Log request if logging is enabled (after streaming completes)
-                val fullResponse = mapOf(
-                    "id" to id,
-                    "object" to "text_completion",
-                    "created" to created,
-                    "model" to model.getModelName(),
-                    "choices" to listOf(
-                        mapOf(
-                            "text" to accumulatedResponse.toString(),
-                            "index" to 0,
-                            "finish_reason" to "stop"
-                        )
-                    )
-                )
-                val responseJson = gson.toJson(fullResponse)
-                logRequestIfEnabled(ctx, "/v1/completions", bodyText, responseJson)
+                flight.emit(token)
             } catch (e: IOException) {
-                // Client disconnected before the final chunk could be sent — this is normal.
-                LogManager.d(TAG, "Client disconnected before final completion streaming chunk: ${e.message}")
-            } catch (e: IllegalStateException) {
-                // Handle Jetty output stream state errors gracefully
-                // This can happen if the client disconnected or the stream is already closed
-                LogManager.d(TAG, "Output stream no longer writable (client may have disconnected): ${e.message}")
+                failed.set(true)
+                throw e
             }
-        } catch (e: IOException) {
-            // Client disconnected during completion streaming — not an application error.
-            LogManager.d(TAG, "Client disconnected during completion streaming: ${e.message}")
-        } catch (e: Exception) {
-            LogManager.e(TAG, "Error in completion streaming", e)
+        } else {
+            onToken
+        }
+        // In JSON mode, stop once the top-level value is complete
+        val tokenSink = config.responseFormat?.let { JsonMode.stopWhenComplete(it, baseSink) } ?: baseSink
+        val generation = if (contents is String) {
+            plan.model.generateStream(contents, config, sessionId, tokenSink)
+        } else {
+            @Suppress("UNCHECKED_CAST")
+            plan.model.generateStreamWithContents(contents as List<Content>, config, sessionId, tokenSink)
+        }
+        if (generation == null) {
+            flight?.fail()
+            return null
+        }
+        if (flight == null) {
+            return serverScope.async {
+                generation.join()
+                true
+            }
+        }
+        return serverScope.async {
+            try {
+                generation.join()
+            } finally {
+                if (failed.get() || generation.isCancelled) flight.fail() else flight.finish()
+            }
+            !failed.get() && !generation.isCancelled
         }
-        // Note: Javalin manages the output stream lifecycle; don't close it manually
     }
     
     /**
@@ -1006,12 +2382,15 @@ class OpenAIApiServer(
      * - content can be an array: [{"type": "text", "text": "Hello"}, {"type": "image_url", "image_url": {"url": "..."}}]
      */
     private fun buildContentsFromMessages(messages: com.google.gson.JsonArray): Any {
-        // Check if any message has multimodal content
+        // Check if any message has an image or audio part.  Only those requests are
+        // built as Content lists, which LlamaModel routes to the multimodal engine pool
+        // (loading the encoders on first use); content arrays holding only text parts
+        // stay on the text-only pools.
         var hasMultimodal = false
         for (message in messages) {
             val msgObj = message.asJsonObject
             val contentElement = msgObj.get("content")
-            if (contentElement != null && contentElement.isJsonArray) {
+            if (contentElement != null && contentElement.isJsonArray && contentElement.asJsonArray.any { isMediaPart(it) }) {
                 hasMultimodal = true
                 break
             }
@@ -1023,7 +2402,16 @@ class OpenAIApiServer(
             for (message in messages) {
                 val msgObj = message.asJsonObject
                 val role = msgObj.get("role")?.asString ?: ""
-                val content = msgObj.get("content")?.asString ?: ""
+                val contentElement = msgObj.get("content")
+                val content = when {
+                    contentElement == null || contentElement.isJsonNull -> ""
+                    contentElement.isJsonArray -> contentElement.asJsonArray.joinToString("") { part ->
+                        part.takeIf { it.isJsonObject }?.asJsonObject?.get("text")
+                            ?.takeIf { it.isJsonPrimitive }?.asString ?: ""
+                    }
+                    contentElement.isJsonPrimitive -> contentElement.asString
+                    else -> contentElement.toString()
+                }
                 promptBuilder.append("$role: $content\n")
             }
             return promptBuilder.toString()
@@ -1065,6 +2453,42 @@ class OpenAIApiServer(
         
         return contentsList
     }
+
+    /**
+     * [messages] shortened by the configured context policy (see [ContextManager]) so
+     * that they fit in the plan's model's context with room for max_tokens.  The
+     * summarize policy runs the model to summarize the removed turns, so call this
+     * while holding the permit when [GenerationPlan.needsPermit]; cache hits and
+     * followers, which run no inference of their own, use cached summaries only and
+     * drop turns otherwise.
+     * @throws ContextLengthExceededException if the system prompt and last turn alone do not fit
+     */
+    private fun fitContext(messages: com.google.gson.JsonArray, config: GenerationConfig, plan: GenerationPlan): com.google.gson.JsonArray {
+        val target = plan.model
+        val reserved = config.responseFormat?.let {
+            JSON_INSTRUCTION_TOKENS + ContextManager.estimateTokens(it.schema ?: "")
+        } ?: 0
+        val result = contextManager.fit(
+            messages,
+            target.getMaxContextLength(),
+            config.maxTokens,
+            reserved,
+            settingsManager.getContextPolicy()
+        ) { transcript ->
+            if (!plan.needsPermit) return@fit null
+            val prompt = "system: Summarize the following conversation in a few sentences. Keep names, " +
+                "facts, decisions and open questions.\n$transcript\nsummary: "
+            target.generate(prompt, GenerationConfig(maxTokens = ContextManager.SUMMARY_MAX_TOKENS, temperature = 0.0))
+                .takeIf { !it.startsWith("Error:") }
+        }
+        return result.messages
+    }
+    
+    /** Whether a content [part] is an image or audio input (needs the encoders). */
+    private fun isMediaPart(part: JsonElement): Boolean {
+        val type = part.takeIf { it.isJsonObject }?.asJsonObject?.get("type")?.takeIf { it.isJsonPrimitive }?.asString
+        return type == "image_url" || type == "input_audio"
+    }
     
     /**
      * Parse multimodal content from OpenAI format to LiteRT Content objects.
@@ -1204,10 +2628,10 @@ class OpenAIApiServer(
      */
     private fun handleGetStoredCompletion(ctx: JavalinContext) {
         val completionId = ctx.pathParam("completion_id")
-        LogManager.d(TAG, "Handling GET /v1/chat/completions/$completionId")
+        LogManager.d(TAG) { "Handling GET /v1/chat/completions/$completionId" }
         
         try {
-            val storedCompletion = storedCompletions[completionId]
+            val storedCompletion = completionStore.get(completionId)
             
             if (storedCompletion == null) {
                 val errorResponse = mapOf(
@@ -1220,28 +2644,7 @@ class OpenAIApiServer(
                 return
             }
             
-            // Use helper function to get all messages
-            val allMessages = getAllMessages(storedCompletion)
-            
-            val response = mutableMapOf<String, Any>(
-                "id" to storedCompletion.id,
-                "object" to storedCompletion.obj,
-                "created" to storedCompletion.created,
-                "model" to storedCompletion.model,
-                "choices" to listOf(
-                    mapOf(
-                        "index" to 0,
-                        "message" to mapOf(
-                            "role" to "assistant",
-                            "content" to storedCompletion.responseContent
-                        ),
-                        "finish_reason" to "stop"
-                    )
-                )
-            )
-            
-            // Add metadata if present
-            storedCompletion.metadata?.let { response["metadata"] = it }
+            val response = storedCompletionResponse(storedCompletion)
             
             LogManager.i(TAG, "Retrieved stored completion: $completionId")
             ctx.contentType("application/json").result(gson.toJson(response))
@@ -1260,10 +2663,10 @@ class OpenAIApiServer(
      */
     private fun handleGetStoredCompletionMessages(ctx: JavalinContext) {
         val completionId = ctx.pathParam("completion_id")
-        LogManager.d(TAG, "Handling GET /v1/chat/completions/$completionId/messages")
+        LogManager.d(TAG) { "Handling GET /v1/chat/completions/$completionId/messages" }
         
         try {
-            val storedCompletion = storedCompletions[completionId]
+            val storedCompletion = completionStore.get(completionId)
             
             if (storedCompletion == null) {
                 val errorResponse = mapOf(
@@ -1287,7 +2690,7 @@ class OpenAIApiServer(
                         "object" to "chat.completion.message",
                         "created" to storedCompletion.created,
                         "role" to msg["role"],
-                        "content" to msg["content"]
+                        "content" to blobStore.rehydrate(msg["content"])
                     )
                 }
             )
@@ -1309,10 +2712,10 @@ class OpenAIApiServer(
      */
     private fun handleUpdateStoredCompletion(ctx: JavalinContext) {
         val completionId = ctx.pathParam("completion_id")
-        LogManager.d(TAG, "Handling POST /v1/chat/completions/$completionId")
+        LogManager.d(TAG) { "Handling POST /v1/chat/completions/$completionId" }
         
         try {
-            val storedCompletion = storedCompletions[completionId]
+            val storedCompletion = completionStore.get(completionId)
             
             if (storedCompletion == null) {
                 val errorResponse = mapOf(
@@ -1343,25 +2746,9 @@ class OpenAIApiServer(
             }
             
             // Update metadata
-            storedCompletion.metadata = newMetadata
+            val updated = completionStore.updateMetadata(completionId, newMetadata) ?: storedCompletion
             
-            val response = mutableMapOf<String, Any>(
-                "id" to storedCompletion.id,
-                "object" to storedCompletion.obj,
-                "created" to storedCompletion.created,
-                "model" to storedCompletion.model,
-                "choices" to listOf(
-                    mapOf(
-                        "index" to 0,
-                        "message" to mapOf(
-                            "role" to "assistant",
-                            "content" to storedCompletion.responseContent
-                        ),
-                        "finish_reason" to "stop"
-                    )
-                ),
-                "metadata" to newMetadata
-            )
+            val response = storedCompletionResponse(updated)
             
             LogManager.i(TAG, "Updated metadata for completion: $completionId")
             ctx.contentType("application/json").result(gson.toJson(response))
@@ -1374,6 +2761,382 @@ class OpenAIApiServer(
         }
     }
     
+    /**
+     * Handle GET /v1/chat/completions
+     * List stored chat completions with cursor pagination.
+     * Query parameters: after, limit (1-100, default 20), order (asc|desc, default asc),
+     * model, and metadata[key]=value filters (all must match).
+     */
+    private fun handleListStoredCompletions(ctx: JavalinContext) {
+        LogManager.d(TAG, "Handling GET /v1/chat/completions")
+        
+        try {
+            val limit = (ctx.queryParam("limit")?.toIntOrNull() ?: DEFAULT_LIST_LIMIT)
+                .coerceIn(1, MAX_LIST_LIMIT)
+            val order = ctx.queryParam("order") ?: "asc"
+            if (order != "asc" && order != "desc") {
+                val errorResponse = mapOf(
+                    "error" to mapOf(
+                        "message" to "order must be 'asc' or 'desc'",
+                        "type" to "invalid_request_error"
+                    )
+                )
+                ctx.status(400).contentType("application/json").result(gson.toJson(errorResponse))
+                return
+            }
+            
+            // metadata[key]=value query parameters
+            val metadataFilter = ctx.queryParamMap()
+                .filterKeys { it.startsWith("metadata[") && it.endsWith("]") }
+                .mapNotNull { (key, values) ->
+                    val value = values.firstOrNull() ?: return@mapNotNull null
+                    key.removePrefix("metadata[").removeSuffix("]") to value
+                }
+                .toMap()
+            
+            val page = completionStore.list(
+                after = ctx.queryParam("after"),
+                limit = limit,
+                ascending = order == "asc",
+                model = ctx.queryParam("model"),
+                metadata = metadataFilter
+            )
+            
+            val response = mapOf(
+                "object" to "list",
+                "data" to page.data.map { storedCompletionResponse(it) },
+                "first_id" to page.data.firstOrNull()?.id,
+                "last_id" to page.data.lastOrNull()?.id,
+                "has_more" to page.hasMore
+            )
+            
+            ctx.contentType("application/json").result(gson.toJson(response))
+        } catch (e: Exception) {
+            LogManager.e(TAG, "Error listing stored completions", e)
+            val errorResponse = mapOf(
+                "error" to mapOf("message" to (e.message ?: "Failed to list completions"))
+            )
+            ctx.status(500).contentType("application/json").result(gson.toJson(errorResponse))
+        }
+    }
+    
+    /**
+     * Handle DELETE /v1/chat/completions/{completion_id}
+     * Delete a stored chat completion.
+     */
+    private fun handleDeleteStoredCompletion(ctx: JavalinContext) {
+        val completionId = ctx.pathParam("completion_id")
+        LogManager.d(TAG) { "Handling DELETE /v1/chat/completions/$completionId" }
+        
+        try {
+            if (!deleteStoredCompletion(completionId)) {
+                val errorResponse = mapOf(
+                    "error" to mapOf(
+                        "message" to "Completion not found: $completionId",
+                        "type" to "invalid_request_error"
+                    )
+                )
+                ctx.status(404).contentType("application/json").result(gson.toJson(errorResponse))
+                return
+            }
+            
+            val response = mapOf(
+                "object" to "chat.completion.deleted",
+                "id" to completionId,
+                "deleted" to true
+            )
+            ctx.contentType("application/json").result(gson.toJson(response))
+        } catch (e: Exception) {
+            LogManager.e(TAG, "Error deleting completion $completionId", e)
+            val errorResponse = mapOf(
+                "error" to mapOf("message" to (e.message ?: "Failed to delete completion"))
+            )
+            ctx.status(500).contentType("application/json").result(gson.toJson(errorResponse))
+        }
+    }
+    
+    /**
+     * Whether the batch worker may start the request with [body] now: memory pressure
+     * admits new requests and the model the body routes to has an idle engine.  A
+     * model that is not loaded yet is checked through the primary model, so it is only
+     * loaded for a batch while the server is otherwise quiet.
+     */
+    private fun isIdleForBatch(body: JsonObject): Boolean {
+        if (!memoryPressure.isAdmitting) return false
+        val target = modelRegistry.residentModel(requestedModel(body)) ?: modelRegistry.primaryModel()
+        return target.hasIdleEngine()
+    }
+    
+    /**
+     * Run one request from a batch file.  Called by [BatchManager] while it holds a
+     * permit from requestSemaphore.
+     */
+    private fun executeBatchRequest(endpoint: String, body: JsonObject): Map<String, Any> {
+        if (endpoint != "/v1/chat/completions") {
+            throw IllegalArgumentException("Unsupported batch endpoint: $endpoint")
+        }
+        if (!settingsManager.isChatCompletionsEnabled()) {
+            throw IllegalStateException("Chat Completions endpoint is disabled in settings")
+        }
+        if (!admitUnderMemoryPressure()) {
+            throw IllegalStateException("Server is low on memory")
+        }
+        
+        val messages = body.get("messages")?.takeIf { it.isJsonArray }?.asJsonArray
+            ?: throw IllegalArgumentException("messages is required")
+        val store = body.get("store")?.asBoolean ?: false
+        val metadata = parseMetadata(body.get("metadata")?.takeIf { it.isJsonObject }?.asJsonObject)
+        val config = extractGenerationConfig(body).copy(
+            prediction = PredictedOutput.parse(body.get("prediction")),
+            responseFormat = JsonMode.parse(body.get("response_format"))
+        )
+        require(config.n in 1..MAX_CHOICES) { "n must be between 1 and $MAX_CHOICES" }
+        require(config.prediction == null || config.n == 1) { "prediction is not supported with n greater than 1" }
+        val lease = modelRegistry.acquire(requestedModel(body))
+        val plan = try {
+            planGeneration("chat", messages, config, lease.model)
+        } catch (e: Exception) {
+            lease.release()
+            throw e
+        }
+        
+        return try {
+            val contents = JsonMode.applyInstruction(buildContentsFromMessages(fitContext(messages, config, plan)), config.responseFormat)
+            createChatCompletion(contents, config, "batch", messages, store, metadata, plan)
+        } finally {
+            plan.abandon()
+            lease.release()
+        }
+    }
+    
+    private fun fileResponse(file: ApiFile): Map<String, Any> {
+        return mapOf(
+            "id" to file.id,
+            "object" to "file",
+            "bytes" to file.bytes,
+            "created_at" to file.createdAt,
+            "filename" to file.filename,
+            "purpose" to file.purpose
+        )
+    }
+    
+    private fun batchResponse(job: BatchJob): Map<String, Any?> {
+        return mapOf(
+            "id" to job.id,
+            "object" to "batch",
+            "endpoint" to job.endpoint,
+            "errors" to job.errors?.let { mapOf("object" to "list", "data" to it) },
+            "input_file_id" to job.inputFileId,
+            "completion_window" to job.completionWindow,
+            "status" to job.status,
+            "output_file_id" to job.outputFileId,
+            "error_file_id" to job.errorFileId,
+            "created_at" to job.createdAt,
+            "in_progress_at" to job.inProgressAt,
+            "expires_at" to job.expiresAt,
+            "finalizing_at" to job.finalizingAt,
+            "completed_at" to job.completedAt,
+            "failed_at" to job.failedAt,
+            "expired_at" to job.expiredAt,
+            "cancelling_at" to job.cancellingAt,
+            "cancelled_at" to job.cancelledAt,
+            "request_counts" to mapOf(
+                "total" to job.total,
+                "completed" to job.completed,
+                "failed" to job.failed
+            ),
+            "metadata" to job.metadata
+        )
+    }
+    
+    private fun sendError(
+        ctx: JavalinContext,
+        status: Int,
+        message: String,
+        type: String = "invalid_request_error",
+        code: String? = null
+    ) {
+        val error = mutableMapOf<String, Any>(
+            "message" to message,
+            "type" to type
+        )
+        code?.let { error["code"] = it }
+        val errorResponse = mapOf("error" to error)
+        ctx.status(status).contentType("application/json").result(gson.toJson(errorResponse))
+    }
+    
+    /**
+     * Handle POST /v1/files
+     * Upload a file (multipart form with `file` and `purpose` fields).
+     * Only purpose=batch is accepted; batch output files are created by the server.
+     */
+    private fun handleUploadFile(ctx: JavalinContext) {
+        LogManager.d(TAG, "Handling POST /v1/files")
+        
+        try {
+            val purpose = ctx.formParam("purpose")
+            if (purpose != FileStore.PURPOSE_BATCH) {
+                sendError(ctx, 400, "purpose must be '${FileStore.PURPOSE_BATCH}'")
+                return
+            }
+            val uploaded = ctx.uploadedFile("file")
+            if (uploaded == null) {
+                sendError(ctx, 400, "file is required")
+                return
+            }
+            if (uploaded.size() > MAX_UPLOAD_FILE_SIZE) {
+                sendError(ctx, 413, "File too large (max ${MAX_UPLOAD_FILE_SIZE / 1024 / 1024} MB)")
+                return
+            }
+            
+            val file = fileStore.create(uploaded.content(), uploaded.filename(), purpose)
+            ctx.contentType("application/json").result(gson.toJson(fileResponse(file)))
+        } catch (e: Exception) {
+            LogManager.e(TAG, "Error uploading file", e)
+            sendError(ctx, 500, e.message ?: "Failed to upload file", "server_error")
+        }
+    }
+    
+    /**
+     * Handle GET /v1/files
+     * List uploaded and batch output files, optionally filtered by `purpose`.
+     */
+    private fun handleListFiles(ctx: JavalinContext) {
+        LogManager.d(TAG, "Handling GET /v1/files")
+        
+        val files = fileStore.list(ctx.queryParam("purpose"))
+        val response = mapOf(
+            "object" to "list",
+            "data" to files.map { fileResponse(it) }
+        )
+        ctx.contentType("application/json").result(gson.toJson(response))
+    }
+    
+    /**
+     * Handle GET /v1/files/{file_id}
+     */
+    private fun handleGetFile(ctx: JavalinContext) {
+        val fileId = ctx.pathParam("file_id")
+        val file = fileStore.get(fileId)
+        if (file == null) {
+            sendError(ctx, 404, "File not found: $fileId")
+            return
+        }
+        ctx.contentType("application/json").result(gson.toJson(fileResponse(file)))
+    }
+    
+    /**
+     * Handle GET /v1/files/{file_id}/content
+     * Return the raw contents of a file (e.g. batch results as JSONL).
+     */
+    private fun handleGetFileContent(ctx: JavalinContext) {
+        val fileId = ctx.pathParam("file_id")
+        val content = fileStore.contentFile(fileId)
+        if (content == null) {
+            sendError(ctx, 404, "File not found: $fileId")
+            return
+        }
+        ctx.contentType("application/octet-stream").result(content.inputStream())
+    }
+    
+    /**
+     * Handle DELETE /v1/files/{file_id}
+     */
+    private fun handleDeleteFile(ctx: JavalinContext) {
+        val fileId = ctx.pathParam("file_id")
+        if (!fileStore.delete(fileId)) {
+            sendError(ctx, 404, "File not found: $fileId")
+            return
+        }
+        val response = mapOf(
+            "id" to fileId,
+            "object" to "file",
+            "deleted" to true
+        )
+        ctx.contentType("application/json").result(gson.toJson(response))
+    }
+    
+    /**
+     * Handle POST /v1/batches
+     * Create a batch from an uploaded JSONL file of requests.  The batch runs in the
+     * background whenever no interactive request is waiting for the model.
+     */
+    private fun handleCreateBatch(ctx: JavalinContext) {
+        LogManager.d(TAG, "Handling POST /v1/batches")
+        
+        // Batches run chat completions, so they follow the same setting
+        if (!checkEndpointEnabled(ctx, "Chat Completions", settingsManager.isChatCompletionsEnabled())) {
+            return
+        }
+        
+        try {
+            val request = gson.fromJson(ctx.body(), JsonObject::class.java)
+            val inputFileId = request?.get("input_file_id")?.asString
+            val endpoint = request?.get("endpoint")?.asString
+            if (inputFileId == null || endpoint == null) {
+                sendError(ctx, 400, "input_file_id and endpoint are required")
+                return
+            }
+            val completionWindow = request.get("completion_window")?.asString ?: BatchManager.COMPLETION_WINDOW_24H
+            val metadata = parseMetadata(request.get("metadata")?.takeIf { it.isJsonObject }?.asJsonObject)
+            
+            val job = batchManager.create(inputFileId, endpoint, completionWindow, metadata)
+            ctx.contentType("application/json").result(gson.toJson(batchResponse(job)))
+        } catch (e: IllegalArgumentException) {
+            sendError(ctx, 400, e.message ?: "Invalid batch request")
+        } catch (e: Exception) {
+            LogManager.e(TAG, "Error creating batch", e)
+            sendError(ctx, 500, e.message ?: "Failed to create batch", "server_error")
+        }
+    }
+    
+    /**
+     * Handle GET /v1/batches
+     * List batches, newest first, with `after` / `limit` pagination.
+     */
+    private fun handleListBatches(ctx: JavalinContext) {
+        LogManager.d(TAG, "Handling GET /v1/batches")
+        
+        val limit = (ctx.queryParam("limit")?.toIntOrNull() ?: DEFAULT_LIST_LIMIT)
+            .coerceIn(1, MAX_LIST_LIMIT)
+        val page = batchManager.list(ctx.queryParam("after"), limit)
+        val response = mapOf(
+            "object" to "list",
+            "data" to page.data.map { batchResponse(it) },
+            "first_id" to page.data.firstOrNull()?.id,
+            "last_id" to page.data.lastOrNull()?.id,
+            "has_more" to page.hasMore
+        )
+        ctx.contentType("application/json").result(gson.toJson(response))
+    }
+    
+    /**
+     * Handle GET /v1/batches/{batch_id}
+     */
+    private fun handleGetBatch(ctx: JavalinContext) {
+        val batchId = ctx.pathParam("batch_id")
+        val job = batchManager.get(batchId)
+        if (job == null) {
+            sendError(ctx, 404, "Batch not found: $batchId")
+            return
+        }
+        ctx.contentType("application/json").result(gson.toJson(batchResponse(job)))
+    }
+    
+    /**
+     * Handle POST /v1/batches/{batch_id}/cancel
+     * Cancel a batch; results of requests that already ran are kept.
+     */
+    private fun handleCancelBatch(ctx: JavalinContext) {
+        val batchId = ctx.pathParam("batch_id")
+        val job = batchManager.cancel(batchId)
+        if (job == null) {
+            sendError(ctx, 404, "Batch not found: $batchId")
+            return
+        }
+        ctx.contentType("application/json").result(gson.toJson(batchResponse(job)))
+    }
+    
     /**
      * Extract session ID from request using multiple methods in priority order:
      * 1. conversation_id field (OpenAI Conversations API standard)
@@ -1385,10 +3148,14 @@ class OpenAIApiServer(
      * Validates and sanitizes session IDs to prevent injection attacks.
      */
     private fun extractSessionId(ctx: JavalinContext, request: JsonObject): String {
+        return extractSessionId(request, ctx.header("X-Session-ID"))
+    }
+    
+    private fun extractSessionId(request: JsonObject, headerSessionId: String?): String {
         val rawSessionId = request.get("conversation_id")?.asString
             ?: request.get("user")?.asString
             ?: request.get("session_id")?.asString
-            ?: ctx.header("X-Session-ID")
+            ?: headerSessionId
             ?: "default"
         
         // Sanitize session ID: allow only alphanumeric, dash, underscore, dot, and @
@@ -1407,11 +3174,14 @@ class OpenAIApiServer(
         val extraContext = parseExtraBody(request.getAsJsonObject("extra_body"))
         
         return GenerationConfig(
-            maxTokens = request.get("max_tokens")?.asInt ?: 100,
+            maxTokens = (request.get("max_tokens")?.asInt ?: 100).let {
+                if (settingsManager.isThermalThrottlingEnabled()) thermalController.capMaxTokens(it) else it
+            },
             temperature = request.get("temperature")?.asDouble ?: 0.7,
             topK = request.get("top_k")?.asInt ?: 40,
             topP = request.get("top_p")?.asDouble ?: 0.95,
             seed = request.get("seed")?.asInt ?: -1,
+            n = request.get("n")?.asInt ?: 1,
             extraContext = extraContext
         )
     }
@@ -1426,7 +3196,7 @@ class OpenAIApiServer(
             return null
         }
         
-        LogManager.d(TAG, "Extra body provided in request with ${extraBodyObj.size()} properties")
+        LogManager.d(TAG) { "Extra body provided in request with ${extraBodyObj.size()} properties" }
         
         // Convert JsonObject to Map<String, Any>
         return extraBodyObj.entrySet().associate { entry ->
@@ -0,0 +1,101 @@
+package com.wannaphong.hostai
+
+import com.google.gson.JsonElement
+
+/**
+ * Support for the OpenAI `prediction` parameter (predicted outputs).
+ *
+ * Clients that edit code or documents send the text they expect back.  LiteRT-LM
+ * cannot verify a block of predicted tokens in one step, so generation is not
+ * shortened; the prediction is compared with the actual output to report
+ * `accepted_prediction_tokens` and `rejected_prediction_tokens` in
+ * `usage.completion_tokens_details`, as OpenAI does.  Accepted tokens are the
+ * longest common subsequence of prediction and output; the rest of the prediction
+ * is rejected.  Tokens are approximated by whitespace-separated words, like the
+ * other usage figures.
+ */
+object PredictedOutput {
+    private const val TAG = "PredictedOutput"
+
+    // Above this many prediction x output words, use a bag-of-words overlap instead of LCS
+    private const val MAX_LCS_CELLS = 4_000_000L
+
+    private val WHITESPACE = Regex("\\s+")
+
+    data class Result(
+        val acceptedTokens: Int,
+        val rejectedTokens: Int
+    )
+
+    /**
+     * Parse a `prediction` value: `{"type": "content", "content": <string or text parts>}`.
+     * @return The predicted text, or null if [element] is absent
+     * @throws IllegalArgumentException if the value is malformed
+     */
+    fun parse(element: JsonElement?): String? {
+        if (element == null || element.isJsonNull) return null
+        require(element.isJsonObject) { "prediction must be an object" }
+        val obj = element.asJsonObject
+        val type = obj.get("type")?.takeIf { it.isJsonPrimitive }?.asString
+        require(type == "content") { "prediction.type must be 'content'" }
+        val content = obj.get("content")
+        return when {
+            content != null && content.isJsonPrimitive -> content.asString
+            content != null && content.isJsonArray -> content.asJsonArray.joinToString("") { part ->
+                val partObj = part.takeIf { it.isJsonObject }?.asJsonObject
+                require(partObj?.get("type")?.asString == "text") { "prediction.content parts must be of type 'text'" }
+                partObj?.get("text")?.asString ?: ""
+            }
+            else -> throw IllegalArgumentException("prediction.content is required")
+        }
+    }
+
+    /**
+     * Compare [prediction] with the generated [output].
+     */
+    fun compare(prediction: String, output: String): Result {
+        val predicted = tokenize(prediction)
+        val actual = tokenize(output)
+        val accepted = if (predicted.size.toLong() * actual.size <= MAX_LCS_CELLS) {
+            lcsLength(predicted, actual)
+        } else {
+            bagOverlap(predicted, actual)
+        }
+        LogManager.d(TAG) { "Prediction: $accepted of ${predicted.size} tokens accepted" }
+        return Result(accepted, predicted.size - accepted)
+    }
+
+    // Length of the longest common subsequence, in O(min) memory
+    private fun lcsLength(a: List<String>, b: List<String>): Int {
+        val (outer, inner) = if (a.size >= b.size) a to b else b to a
+        var previous = IntArray(inner.size + 1)
+        var current = IntArray(inner.size + 1)
+        for (x in outer) {
+            for (j in inner.indices) {
+                current[j + 1] = if (x == inner[j]) previous[j] + 1 else maxOf(previous[j + 1], current[j])
+            }
+            val swap = previous
+            previous = current
+            current = swap
+        }
+        return previous[inner.size]
+    }
+
+    private fun bagOverlap(a: List<String>, b: List<String>): Int {
+        val counts = HashMap<String, Int>()
+        for (word in b) counts[word] = (counts[word] ?: 0) + 1
+        var overlap = 0
+        for (word in a) {
+            val count = counts[word] ?: 0
+            if (count > 0) {
+                counts[word] = count - 1
+                overlap++
+            }
+        }
+        return overlap
+    }
+
+    private fun tokenize(text: String): List<String> {
+        return text.split(WHITESPACE).filter { it.isNotEmpty() }
+    }
+}
@@ -0,0 +1,106 @@
+package com.wannaphong.hostai
+
+/**
+ * Prompt-lookup (n-gram) drafting, as used by draft-model-free speculative decoding.
+ * This is a measurement only: generation is never changed.
+ *
+ * The draft for the next position is found by matching the last [DEFAULT_NGRAM]
+ * tokens of the text so far (prompt plus output) against an earlier occurrence and
+ * proposing the tokens that followed it.  Summaries and rewrites copy long spans
+ * from the prompt, so such drafts are often accepted in full.
+ *
+ * The LiteRT conversation API generates whole messages and cannot verify a block of
+ * drafted tokens, so the engine itself still decodes one token at a time.  [simulate]
+ * replays a finished generation against the drafter to measure how often its drafts
+ * match the actual traffic, i.e. how many drafted tokens the target model would
+ * accept.  Tokens are approximated by whitespace-separated words, so this is not a
+ * speedup estimate.
+ *
+ * Requested per call with `extra_body: {"prompt_lookup_measure": true}`.
+ */
+object PromptLookup {
+    private const val TAG = "PromptLookup"
+
+    const val EXTRA_MEASURE = "prompt_lookup_measure"
+    const val EXTRA_NGRAM = "prompt_lookup_ngram"
+    const val EXTRA_MAX_DRAFT = "prompt_lookup_max_draft"
+
+    const val DEFAULT_NGRAM = 3
+    const val DEFAULT_MAX_DRAFT = 10
+
+    private val WHITESPACE = Regex("\\s+")
+
+    /**
+     * Outcome of replaying one output.
+     * @property outputTokens Tokens in the output
+     * @property drafted Tokens proposed by the drafter
+     * @property accepted Proposed tokens that matched the output
+     */
+    data class Result(
+        val outputTokens: Int,
+        val drafted: Int,
+        val accepted: Int
+    )
+
+    /**
+     * Whether [config] asks for prompt-lookup measurement via extra_body.
+     */
+    fun isRequested(config: GenerationConfig): Boolean {
+        return config.extraContext?.get(EXTRA_MEASURE) == true
+    }
+
+    /**
+     * Replay [output] against drafts taken from [prompt] and the output so far,
+     * using the n-gram size and draft length from [config]'s extra_body (if set).
+     */
+    fun simulate(prompt: String, output: String, config: GenerationConfig): Result {
+        val ngram = (config.extraContext?.get(EXTRA_NGRAM) as? Number)?.toInt() ?: DEFAULT_NGRAM
+        val maxDraft = (config.extraContext?.get(EXTRA_MAX_DRAFT) as? Number)?.toInt() ?: DEFAULT_MAX_DRAFT
+        return simulate(prompt, output, ngram.coerceIn(1, 8), maxDraft.coerceIn(1, 64))
+    }
+
+    fun simulate(prompt: String, output: String, ngram: Int, maxDraft: Int): Result {
+        val target = tokenize(output)
+        val context = ArrayList<String>(tokenize(prompt))
+        // n-gram -> index of the token that followed its most recent occurrence
+        val index = HashMap<List<String>, Int>()
+        var indexedUpTo = ngram  // n-grams ending before this index are in [index]
+
+        var position = 0
+        var drafted = 0
+        var accepted = 0
+        while (position < target.size) {
+            // Index every n-gram except the trailing one, which is the lookup key
+            while (indexedUpTo < context.size) {
+                index[context.subList(indexedUpTo - ngram, indexedUpTo).toList()] = indexedUpTo
+                indexedUpTo++
+            }
+
+            var matched = 0
+            if (context.size >= ngram) {
+                val start = index[context.subList(context.size - ngram, context.size)]
+                if (start != null) {
+                    val draft = context.subList(start, minOf(start + maxDraft, context.size))
+                    drafted += draft.size
+                    while (matched < draft.size && position + matched < target.size &&
+                        draft[matched] == target[position + matched]) {
+                        matched++
+                    }
+                    accepted += matched
+                }
+            }
+
+            // One target step verifies the draft and yields one more token of its own
+            val advance = minOf(matched + 1, target.size - position)
+            for (i in 0 until advance) context.add(target[position + i])
+            position += advance
+        }
+
+        LogManager.d(TAG) { "Replayed ${target.size} tokens: $accepted/$drafted drafted accepted" }
+        return Result(target.size, drafted, accepted)
+    }
+
+    private fun tokenize(text: String): List<String> {
+        return text.split(WHITESPACE).filter { it.isNotEmpty() }
+    }
+}
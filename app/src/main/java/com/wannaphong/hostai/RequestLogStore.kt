@@ -0,0 +1,394 @@
+package com.wannaphong.hostai
+
+import com.google.gson.Gson
+import com.google.gson.JsonSyntaxException
+import com.google.gson.reflect.TypeToken
+import com.google.gson.stream.JsonWriter
+import java.io.BufferedOutputStream
+import java.io.File
+import java.io.FileOutputStream
+import java.io.InputStream
+import java.io.OutputStream
+import java.util.zip.GZIPInputStream
+import java.util.zip.GZIPOutputStream
+
+/**
+ * Append-only, segmented on-disk store for [LoggedRequest] entries.
+ *
+ * Entries are written as one JSON object per line (JSONL) to an active segment
+ * file, so a write costs O(entry) regardless of how many entries are stored.
+ * When the active segment grows past [segmentMaxBytes] or spans more than
+ * [segmentMaxAgeMs] it is closed and gzip-compressed.  A small index file records
+ * each segment's time range, entry count and size: startup only reads the index,
+ * and time-range queries only open the segments that overlap the range.
+ *
+ * Retention is applied per segment: whole segments are deleted once all their
+ * entries are older than [retentionMs], and the oldest segments are dropped while
+ * the store exceeds [maxTotalBytes].
+ *
+ * Not thread-safe: all calls must be made from a single thread
+ * (RequestLogger confines the store to its executor).
+ */
+class RequestLogStore(
+    private val dir: File,
+    private val retentionMs: Long,
+    private val maxTotalBytes: Long,
+    private val segmentMaxBytes: Long = DEFAULT_SEGMENT_MAX_BYTES,
+    private val segmentMaxAgeMs: Long = DEFAULT_SEGMENT_MAX_AGE_MS
+) {
+    /**
+     * Index record for one segment file.  [bytes] is the on-disk size (compressed
+     * size once [compressed] is true).
+     */
+    data class SegmentInfo(
+        var name: String,
+        val firstTimestamp: Long,
+        var lastTimestamp: Long,
+        var count: Int,
+        var bytes: Long,
+        var compressed: Boolean
+    )
+
+    private val gson = Gson()
+    private val indexFile = File(dir, INDEX_FILE_NAME)
+
+    // Oldest first.  Only the last segment may be uncompressed (the active one).
+    private val segments = mutableListOf<SegmentInfo>()
+    private var activeOut: OutputStream? = null
+    private var indexDirty = false
+
+    /** Total number of stored entries; safe to read from any thread. */
+    @Volatile var totalCount = 0
+        private set
+
+    companion object {
+        private const val TAG = "RequestLogStore"
+        private const val INDEX_FILE_NAME = "index.json"
+        private const val SEGMENT_PREFIX = "seg-"
+        private const val SEGMENT_SUFFIX = ".jsonl"
+        private const val COMPRESSED_SUFFIX = ".jsonl.gz"
+        const val DEFAULT_SEGMENT_MAX_BYTES = 1L * 1024 * 1024 // 1 MB before compression
+        const val DEFAULT_SEGMENT_MAX_AGE_MS = 24L * 60L * 60L * 1000L // One segment per day at most
+    }
+
+    /**
+     * Load the index and reconcile it with the files on disk.  Segments whose size
+     * does not match the index (e.g. after a crash before the index was saved) are
+     * rescanned; an uncompressed segment that is not the newest is compressed.
+     */
+    fun open() {
+        if (!dir.exists() && !dir.mkdirs()) {
+            LogManager.w(TAG, "Failed to create request log directory: ${dir.absolutePath}")
+        }
+
+        val indexed = loadIndex().associateBy { it.name }
+        val files = dir.listFiles { f -> f.name.startsWith(SEGMENT_PREFIX) }?.toList() ?: emptyList()
+
+        segments.clear()
+        for (file in files) {
+            if (file.name.endsWith(SEGMENT_SUFFIX) &&
+                File(dir, file.name.removeSuffix(SEGMENT_SUFFIX) + COMPRESSED_SUFFIX).exists()) {
+                // Compression finished but the source was not deleted before a crash.
+                file.delete()
+                continue
+            }
+            val known = indexed[file.name]
+            val info = if (known != null && known.bytes == file.length()) {
+                known
+            } else {
+                indexDirty = true
+                scanSegment(file)
+            }
+            if (info != null) segments.add(info)
+        }
+        segments.sortBy { it.firstTimestamp }
+        if (segments.size != indexed.size) indexDirty = true
+
+        // Only the newest segment may stay uncompressed.
+        for (i in 0 until segments.size - 1) {
+            if (!segments[i].compressed) compressSegment(segments[i])
+        }
+
+        totalCount = segments.sumOf { it.count }
+        writeIndexIfDirty()
+        LogManager.i(TAG, "Opened request log store: ${segments.size} segment(s), $totalCount entries")
+    }
+
+    /**
+     * Append one entry to the active segment, rotating first if needed.
+     */
+    fun append(entry: LoggedRequest) {
+        var active = activeSegment()
+        if (active != null && shouldRotate(active, entry.timestamp)) {
+            rotate()
+            active = null
+        }
+        if (active == null) {
+            active = startSegment(entry.timestamp)
+        }
+
+        val bytes = (gson.toJson(entry) + "\n").toByteArray(Charsets.UTF_8)
+        val out = activeOut ?: BufferedOutputStream(FileOutputStream(File(dir, active.name), true)).also {
+            activeOut = it
+        }
+        out.write(bytes)
+        out.flush()
+
+        active.count++
+        active.bytes += bytes.size
+        active.lastTimestamp = maxOf(active.lastTimestamp, entry.timestamp)
+        totalCount++
+        indexDirty = true
+    }
+
+    /**
+     * Return entries with timestamps in [fromMs, toMs], oldest first.  When more than
+     * [limit] entries match, only the most recent [limit] are returned.
+     */
+    fun query(fromMs: Long = 0L, toMs: Long = Long.MAX_VALUE, limit: Int = Int.MAX_VALUE): List<LoggedRequest> {
+        val result = ArrayDeque<LoggedRequest>()
+        forEachEntry(fromMs, toMs) { entry ->
+            result.addLast(entry)
+            if (result.size > limit) result.removeFirst()
+        }
+        return result.toList()
+    }
+
+    /**
+     * Stream every entry in [fromMs, toMs] as a JSON array to [writer] without
+     * holding them all in memory.  Returns the number of entries written.
+     */
+    fun exportTo(writer: JsonWriter, fromMs: Long = 0L, toMs: Long = Long.MAX_VALUE): Int {
+        var written = 0
+        writer.beginArray()
+        forEachEntry(fromMs, toMs) { entry ->
+            gson.toJson(entry, LoggedRequest::class.java, writer)
+            written++
+        }
+        writer.endArray()
+        return written
+    }
+
+    /**
+     * Delete segments that are entirely older than the retention window, then the
+     * oldest segments while the store is over its size budget.
+     * @return Number of entries removed
+     */
+    fun applyRetention(now: Long = System.currentTimeMillis()): Int {
+        val cutoff = now - retentionMs
+        var removed = 0
+
+        val iterator = segments.iterator()
+        while (iterator.hasNext()) {
+            val segment = iterator.next()
+            if (segment.lastTimestamp >= cutoff) continue
+            if (segment === segments.last() && !segment.compressed) closeActiveStream()
+            deleteSegmentFile(segment)
+            removed += segment.count
+            iterator.remove()
+        }
+
+        // Size budget: never drop the active segment, it is bounded by segmentMaxBytes.
+        while (segments.size > 1 && segments.sumOf { it.bytes } > maxTotalBytes) {
+            val oldest = segments.removeAt(0)
+            deleteSegmentFile(oldest)
+            removed += oldest.count
+        }
+
+        if (removed > 0) {
+            totalCount = segments.sumOf { it.count }
+            indexDirty = true
+            writeIndexIfDirty()
+            LogManager.i(TAG, "Retention removed $removed entries")
+        }
+        return removed
+    }
+
+    /**
+     * Delete every segment and reset the index.
+     */
+    fun clear() {
+        closeActiveStream()
+        segments.forEach { deleteSegmentFile(it) }
+        segments.clear()
+        totalCount = 0
+        indexDirty = true
+        writeIndexIfDirty()
+    }
+
+    /**
+     * Persist the index if entries were appended since the last write.  Cheap to
+     * call periodically: the index is one small record per segment.
+     */
+    fun writeIndexIfDirty() {
+        if (!indexDirty) return
+        try {
+            val tmp = File(dir, "$INDEX_FILE_NAME.tmp")
+            tmp.writeText(gson.toJson(segments))
+            if (!tmp.renameTo(indexFile)) {
+                indexFile.delete()
+                tmp.renameTo(indexFile)
+            }
+            indexDirty = false
+        } catch (e: Exception) {
+            LogManager.e(TAG, "Failed to write request log index", e)
+        }
+    }
+
+    /**
+     * Flush and release the active segment file handle and persist the index.
+     */
+    fun close() {
+        closeActiveStream()
+        writeIndexIfDirty()
+    }
+
+    private fun activeSegment(): SegmentInfo? = segments.lastOrNull()?.takeIf { !it.compressed }
+
+    private fun shouldRotate(active: SegmentInfo, timestamp: Long): Boolean {
+        return active.bytes >= segmentMaxBytes || timestamp - active.firstTimestamp >= segmentMaxAgeMs
+    }
+
+    private fun startSegment(timestamp: Long): SegmentInfo {
+        var suffix = 0
+        var name = "$SEGMENT_PREFIX$timestamp$SEGMENT_SUFFIX"
+        while (File(dir, name).exists() || File(dir, name.removeSuffix(SEGMENT_SUFFIX) + COMPRESSED_SUFFIX).exists()) {
+            suffix++
+            name = "$SEGMENT_PREFIX$timestamp-$suffix$SEGMENT_SUFFIX"
+        }
+        val info = SegmentInfo(name, timestamp, timestamp, 0, 0L, false)
+        segments.add(info)
+        indexDirty = true
+        return info
+    }
+
+    /**
+     * Close and compress the active segment, then enforce retention.
+     */
+    private fun rotate() {
+        val active = activeSegment() ?: return
+        closeActiveStream()
+        compressSegment(active)
+        writeIndexIfDirty()
+        applyRetention()
+    }
+
+    private fun closeActiveStream() {
+        try {
+            activeOut?.close()
+        } catch (e: Exception) {
+            LogManager.w(TAG, "Error closing active log segment: ${e.message}")
+        }
+        activeOut = null
+    }
+
+    private fun compressSegment(segment: SegmentInfo) {
+        val source = File(dir, segment.name)
+        val targetName = segment.name.removeSuffix(SEGMENT_SUFFIX) + COMPRESSED_SUFFIX
+        val target = File(dir, targetName)
+        val tmp = File(dir, "$targetName.tmp")
+        try {
+            source.inputStream().use { input ->
+                GZIPOutputStream(FileOutputStream(tmp)).use { output -> input.copyTo(output) }
+            }
+            if (!tmp.renameTo(target)) {
+                throw IllegalStateException("rename failed for ${tmp.name}")
+            }
+            source.delete()
+            segment.name = targetName
+            segment.bytes = target.length()
+            segment.compressed = true
+            indexDirty = true
+            LogManager.d(TAG) { "Compressed log segment $targetName (${segment.count} entries)" }
+        } catch (e: Exception) {
+            // Leave the segment uncompressed; it is still readable.
+            LogManager.e(TAG, "Failed to compress log segment ${segment.name}", e)
+            tmp.delete()
+        }
+    }
+
+    private fun deleteSegmentFile(segment: SegmentInfo) {
+        val file = File(dir, segment.name)
+        if (file.exists() && !file.delete()) {
+            LogManager.w(TAG, "Failed to delete log segment: ${segment.name}")
+        }
+    }
+
+    private fun openSegment(file: File, compressed: Boolean): InputStream {
+        val raw = file.inputStream()
+        return if (compressed) GZIPInputStream(raw) else raw
+    }
+
+    private inline fun forEachEntry(fromMs: Long, toMs: Long, action: (LoggedRequest) -> Unit) {
+        for (segment in segments.toList()) {
+            if (segment.lastTimestamp < fromMs || segment.firstTimestamp > toMs) continue
+            val file = File(dir, segment.name)
+            if (!file.exists()) continue
+            try {
+                openSegment(file, segment.compressed).bufferedReader(Charsets.UTF_8).useLines { lines ->
+                    for (line in lines) {
+                        val entry = parseLine(line) ?: continue
+                        if (entry.timestamp in fromMs..toMs) action(entry)
+                    }
+                }
+            } catch (e: Exception) {
+                LogManager.e(TAG, "Failed to read log segment ${segment.name}", e)
+            }
+        }
+    }
+
+    private fun parseLine(line: String): LoggedRequest? {
+        if (line.isBlank()) return null
+        return try {
+            gson.fromJson(line, LoggedRequest::class.java)
+        } catch (e: JsonSyntaxException) {
+            // A torn final line after a crash; skip it.
+            null
+        }
+    }
+
+    /**
+     * Rebuild a segment's index record by reading it.  Only used when the index
+     * is missing or stale, so the cost is bounded by one segment in practice.
+     */
+    private fun scanSegment(file: File): SegmentInfo? {
+        val compressed = file.name.endsWith(COMPRESSED_SUFFIX)
+        if (!compressed && !file.name.endsWith(SEGMENT_SUFFIX)) {
+            // Leftover temp file from an interrupted compression or index write.
+            file.delete()
+            return null
+        }
+        var first = Long.MAX_VALUE
+        var last = Long.MIN_VALUE
+        var count = 0
+        try {
+            openSegment(file, compressed).bufferedReader(Charsets.UTF_8).useLines { lines ->
+                for (line in lines) {
+                    val entry = parseLine(line) ?: continue
+                    first = minOf(first, entry.timestamp)
+                    last = maxOf(last, entry.timestamp)
+                    count++
+                }
+            }
+        } catch (e: Exception) {
+            LogManager.e(TAG, "Failed to scan log segment ${file.name}", e)
+        }
+        if (count == 0) {
+            file.delete()
+            return null
+        }
+        LogManager.i(TAG, "Rebuilt index for log segment ${file.name} ($count entries)")
+        return SegmentInfo(file.name, first, last, count, file.length(), compressed)
+    }
+
+    private fun loadIndex(): List<SegmentInfo> {
+        if (!indexFile.exists()) return emptyList()
+        return try {
+            val type = object : TypeToken<List<SegmentInfo>>() {}.type
+            gson.fromJson<List<SegmentInfo>>(indexFile.readText(), type) ?: emptyList()
+        } catch (e: Exception) {
+            LogManager.e(TAG, "Malformed request log index, rebuilding from segments", e)
+            emptyList()
+        }
+    }
+}
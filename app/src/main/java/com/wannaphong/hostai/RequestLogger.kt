@@ -8,8 +8,9 @@ import java.io.File
 import java.text.SimpleDateFormat
 import java.util.Date
 import java.util.Locale
-import java.util.concurrent.ConcurrentLinkedQueue
+import java.util.concurrent.Callable
 import java.util.concurrent.Executors
+import java.util.concurrent.RejectedExecutionException
 import java.util.concurrent.ScheduledExecutorService
 import java.util.concurrent.TimeUnit
 
@@ -28,22 +29,29 @@ data class LoggedRequest(
 /**
  * Manages logging of chat and completion requests
  * Singleton to ensure logs are shared across all activities
- * Logs are persisted to disk and automatically cleaned up after 90 days
+ * Logs are persisted to an append-only segmented store (see [RequestLogStore]) and
+ * automatically cleaned up after 90 days or once the store exceeds its size budget.
+ * All store access is confined to a single background executor.
  */
 class RequestLogger private constructor(private val context: Context) {
-    private val logs = ConcurrentLinkedQueue<LoggedRequest>()
     private val gson: Gson = GsonBuilder().setPrettyPrinting().create()
     private val dateFormat = SimpleDateFormat("yyyy-MM-dd HH:mm:ss", Locale.getDefault())
-    private val logsFile: File
+    private val store = RequestLogStore(
+        dir = File(context.filesDir, LOGS_DIR_NAME),
+        retentionMs = LOG_RETENTION_DAYS * MILLIS_PER_DAY,
+        maxTotalBytes = MAX_STORE_BYTES
+    )
+    private val blobStore = BlobStore.getInstance(context)
     private val saveExecutor: ScheduledExecutorService = Executors.newSingleThreadScheduledExecutor()
     private var pendingSave = false
     
     companion object {
         private const val TAG = "RequestLogger"
-        private const val MAX_LOGS = 1000 // Limit to prevent excessive memory usage
         private const val LOG_RETENTION_DAYS = 90 // Keep logs for 90 days
-        private const val LOGS_FILE_NAME = "request_logs.json"
-        private const val SAVE_DELAY_MS = 5000L // Batch saves every 5 seconds
+        private const val MAX_STORE_BYTES = 64L * 1024L * 1024L // Drop oldest segments beyond 64 MB
+        private const val LOGS_DIR_NAME = "request_logs"
+        private const val LEGACY_LOGS_FILE_NAME = "request_logs.json"
+        private const val SAVE_DELAY_MS = 5000L // Batch index writes every 5 seconds
         private const val MILLIS_PER_DAY = 24L * 60L * 60L * 1000L // Milliseconds in a day
         
         @Volatile
@@ -57,97 +65,89 @@ class RequestLogger private constructor(private val context: Context) {
     }
     
     init {
-        logsFile = File(context.filesDir, LOGS_FILE_NAME)
-        // Load and clean logs asynchronously to avoid blocking
+        // Open the store and clean logs asynchronously to avoid blocking.
+        // Only the small segment index is read here, not the log entries.
         saveExecutor.execute {
-            loadLogsFromDisk()
-            cleanOldLogs()
+            try {
+                store.open()
+                migrateLegacyLogs()
+                store.applyRetention()
+            } catch (e: Exception) {
+                LogManager.e(TAG, "Failed to open request log store", e)
+            }
         }
     }
     
     /**
-     * Load logs from disk
+     * Import logs from the single-file format used by earlier versions, then
+     * delete the old file.  Runs once on the executor.
      */
-    private fun loadLogsFromDisk() {
+    private fun migrateLegacyLogs() {
+        val legacyFile = File(context.filesDir, LEGACY_LOGS_FILE_NAME)
+        if (!legacyFile.exists()) return
         try {
-            if (logsFile.exists()) {
-                val json = logsFile.readText()
-                if (json.isNotEmpty()) {
-                    try {
-                        val logsList = gson.fromJson(json, Array<LoggedRequest>::class.java).toList()
-                        logs.addAll(logsList)
-                        LogManager.i(TAG, "Loaded ${logs.size} logs from disk")
-                    } catch (e: JsonSyntaxException) {
-                        LogManager.e(TAG, "Malformed JSON in logs file, skipping load", e)
-                    }
+            val json = legacyFile.readText()
+            if (json.isNotEmpty()) {
+                try {
+                    val logsList = gson.fromJson(json, Array<LoggedRequest>::class.java)?.toList() ?: emptyList()
+                    logsList.sortedBy { it.timestamp }.forEach { store.append(it) }
+                    store.writeIndexIfDirty()
+                    LogManager.i(TAG, "Migrated ${logsList.size} logs from $LEGACY_LOGS_FILE_NAME")
+                } catch (e: JsonSyntaxException) {
+                    LogManager.e(TAG, "Malformed JSON in legacy logs file, skipping migration", e)
                 }
             }
+            if (!legacyFile.delete()) {
+                LogManager.w(TAG, "Failed to delete legacy logs file")
+            }
         } catch (e: Exception) {
-            LogManager.e(TAG, "Failed to load logs from disk", e)
-        }
-    }
-    
-    /**
-     * Save logs to disk
-     */
-    private fun saveLogsToDisk() {
-        try {
-            val logsList = logs.toList()
-            val json = gson.toJson(logsList)
-            logsFile.writeText(json)
-            LogManager.d(TAG, "Saved ${logsList.size} logs to disk")
-        } catch (e: Exception) {
-            LogManager.e(TAG, "Failed to save logs to disk", e)
+            LogManager.e(TAG, "Failed to migrate legacy logs", e)
         }
     }
     
     /**
-     * Schedule a delayed save to disk (batches multiple saves)
+     * Schedule a delayed index write (batches many appends into one small write)
      */
     private fun scheduleSaveToDisk() {
         synchronized(this) {
             if (!pendingSave) {
                 pendingSave = true
                 saveExecutor.schedule({
-                    saveLogsToDisk()
                     synchronized(this) {
                         pendingSave = false
                     }
+                    store.writeIndexIfDirty()
                 }, SAVE_DELAY_MS, TimeUnit.MILLISECONDS)
             }
         }
     }
     
     /**
-     * Save logs to disk immediately (used for critical operations like clearing logs)
+     * Run [block] on the store executor and wait for its result.
      */
-    private fun saveLogsToDiskImmediate() {
-        synchronized(this) {
-            pendingSave = false
-        }
-        saveLogsToDisk()
+    private fun <T> onStore(block: () -> T): T {
+        return saveExecutor.submit(Callable { block() }).get()
     }
     
     /**
-     * Clean logs older than 90 days
+     * Run [block] on the store executor after the queued appends, without waiting,
+     * and pass its result to [onDone] on that thread (null if [block] failed or the
+     * logger is shut down).  For callers on the main thread.
      */
-    private fun cleanOldLogs() {
+    private fun <T> onStoreAsync(block: () -> T, onDone: (T?) -> Unit) {
         try {
-            val cutoffTime = System.currentTimeMillis() - (LOG_RETENTION_DAYS * MILLIS_PER_DAY)
-            val sizeBefore = logs.size
-            
-            // Remove logs older than the cutoff time
-            logs.removeIf { it.timestamp < cutoffTime }
-            
-            val sizeAfter = logs.size
-            val removed = sizeBefore - sizeAfter
-            
-            if (removed > 0) {
-                LogManager.i(TAG, "Cleaned $removed old logs (older than $LOG_RETENTION_DAYS days)")
-                saveLogsToDiskImmediate()
+            saveExecutor.execute {
+                val result = try {
+                    block()
+                } catch (e: Exception) {
+                    LogManager.e(TAG, "Request log store operation failed", e)
+                    null
+                }
+                onDone(result)
             }
-        } catch (e: Exception) {
-            LogManager.e(TAG, "Failed to clean old logs", e)
+        } catch (e: RejectedExecutionException) {
+            LogManager.w(TAG, "Request logger is shut down")
+            onDone(null)
         }
     }
     
@@ -163,72 +163,96 @@ class RequestLogger private constructor(private val context: Context) {
         val timestamp = System.currentTimeMillis()
         val date = dateFormat.format(Date(timestamp))
         
-        val logEntry = LoggedRequest(
-            timestamp = timestamp,
-            date = date,
-            ipAddress = ipAddress,
-            endpoint = endpoint,
-            requestBody = requestBody,
-            responseBody = responseBody
-        )
-        
-        logs.add(logEntry)
-        
-        // Remove oldest entries if we exceed the limit
-        while (logs.size > MAX_LOGS) {
-            logs.poll()
+        // Append on the executor: O(entry) I/O, never blocks the request thread.
+        // Base64 media is moved to the blob store so the entry only holds references.
+        try {
+            saveExecutor.execute {
+                try {
+                    val logEntry = LoggedRequest(
+                        timestamp = timestamp,
+                        date = date,
+                        ipAddress = ipAddress,
+                        endpoint = endpoint,
+                        requestBody = blobStore.offloadRequestJson(requestBody),
+                        responseBody = responseBody
+                    )
+                    store.append(logEntry)
+                } catch (e: Exception) {
+                    LogManager.e(TAG, "Failed to append request log", e)
+                }
+            }
+            scheduleSaveToDisk()
+        } catch (e: RejectedExecutionException) {
+            LogManager.w(TAG, "Request logger is shut down; dropping log entry")
+            return
         }
         
-        // Schedule a save to disk (batched)
-        scheduleSaveToDisk()
-        
-        LogManager.d(TAG, "Logged request from $ipAddress to $endpoint at $date")
+        LogManager.d(TAG) { "Logged request from $ipAddress to $endpoint at $date" }
     }
     
     /**
-     * Get all logged requests
+     * Get all logged requests, oldest first
      */
     fun getAllLogs(): List<LoggedRequest> {
-        return logs.toList()
+        return onStore { store.query() }
+    }
+    
+    /**
+     * Get logged requests with timestamps in [fromMs, toMs], oldest first.
+     * Only segments overlapping the range are read.  At most [limit] of the most
+     * recent matching entries are returned.
+     */
+    fun getLogs(fromMs: Long, toMs: Long = Long.MAX_VALUE, limit: Int = Int.MAX_VALUE): List<LoggedRequest> {
+        return onStore { store.query(fromMs, toMs, limit) }
     }
     
     /**
      * Get logs count
      */
     fun getLogsCount(): Int {
-        return logs.size
+        return store.totalCount
     }
     
     /**
-     * Clear all logs
+     * Clear all logs without blocking the caller; [onDone] runs on the store
+     * executor once they are cleared.
      */
-    fun clearLogs() {
-        val count = logs.size
-        logs.clear()
-        saveLogsToDiskImmediate()
-        LogManager.i(TAG, "Cleared $count logged requests")
+    fun clearLogs(onDone: () -> Unit = {}) {
+        onStoreAsync({
+            val before = store.totalCount
+            store.clear()
+            before
+        }) { count ->
+            if (count != null) LogManager.i(TAG, "Cleared $count logged requests")
+            onDone()
+        }
     }
     
     /**
-     * Export logs to JSON file
-     * Returns the file path on success, null on failure
+     * Export logs to a JSON file without blocking the caller.  [onDone] runs on the
+     * store executor with the file on success, null on failure.
      */
-    fun exportLogsToJson(): File? {
-        return try {
-            val logsList = logs.toList()
-            val json = gson.toJson(logsList)
-            
-            val timestamp = SimpleDateFormat("yyyyMMdd_HHmmss", Locale.getDefault()).format(Date())
-            val fileName = "request_logs_$timestamp.json"
-            val file = File(context.getExternalFilesDir(null), fileName)
-            
-            file.writeText(json)
-            
-            LogManager.i(TAG, "Exported ${logsList.size} logs to ${file.absolutePath}")
-            file
-        } catch (e: Exception) {
-            LogManager.e(TAG, "Failed to export logs to JSON", e)
-            null
+    fun exportLogsToJson(onDone: (File?) -> Unit) {
+        val timestamp = SimpleDateFormat("yyyyMMdd_HHmmss", Locale.getDefault()).format(Date())
+        val fileName = "request_logs_$timestamp.json"
+        val file = File(context.getExternalFilesDir(null), fileName)
+        
+        // Stream entries segment by segment instead of materialising them all
+        onStoreAsync({
+            file.bufferedWriter().use { writer ->
+                val jsonWriter = gson.newJsonWriter(writer)
+                val written = store.exportTo(jsonWriter)
+                jsonWriter.flush()
+                written
+            }
+        }) { count ->
+            if (count != null) {
+                LogManager.i(TAG, "Exported $count logs to ${file.absolutePath}")
+                onDone(file)
+            } else {
+                LogManager.e(TAG, "Failed to export logs to JSON")
+                onDone(null)
+            }
         }
     }
     
@@ -236,8 +260,7 @@ class RequestLogger private constructor(private val context: Context) {
      * Export logs as JSON string
      */
     fun exportLogsToJsonString(): String {
-        val logsList = logs.toList()
-        return gson.toJson(logsList)
+        return gson.toJson(getAllLogs())
     }
     
     /**
@@ -246,9 +269,8 @@ class RequestLogger private constructor(private val context: Context) {
      */
     fun shutdown() {
         try {
-            // Save any pending logs immediately
-            saveLogsToDiskImmediate()
-            // Shutdown the executor
+            // Flush the active segment and index before stopping the executor
+            saveExecutor.execute { store.close() }
             saveExecutor.shutdown()
             if (!saveExecutor.awaitTermination(5, TimeUnit.SECONDS)) {
                 saveExecutor.shutdownNow()
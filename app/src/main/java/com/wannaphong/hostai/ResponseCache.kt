@@ -0,0 +1,135 @@
+package com.wannaphong.hostai
+
+import android.util.LruCache
+import com.google.gson.JsonArray
+import com.google.gson.JsonElement
+import com.google.gson.JsonObject
+import java.security.MessageDigest
+import java.util.concurrent.atomic.AtomicLong
+
+/**
+ * Exact-match cache of generated responses for deterministic requests.
+ *
+ * A request is cacheable when it samples greedily (temperature 0) or pins a seed:
+ * the same model, input and sampling parameters then produce the same output, so
+ * repeating it only costs a lookup.  Keys are SHA-256 digests of a canonical JSON
+ * form of the request (object keys sorted), so key order and whitespace in the
+ * client's JSON do not matter.  Entries keep the streamed token chunks so that a
+ * streaming hit can replay them.
+ *
+ * Bounded by total response size ([maxChars]), evicting least recently used entries.
+ * Thread-safe: LruCache is synchronised.
+ */
+class ResponseCache(maxChars: Int = DEFAULT_MAX_CHARS) {
+
+    /**
+     * A cached response.  [tokens] holds the chunks as streamed, or is empty when the
+     * response came from a non-streaming request.
+     */
+    data class Entry(
+        val text: String,
+        val tokens: List<String>
+    ) {
+        /**
+         * Chunks for a streaming replay.  Non-streamed entries are split after
+         * whitespace so clients still receive incremental deltas.
+         */
+        fun replayTokens(): List<String> {
+            if (tokens.isNotEmpty()) return tokens
+            return WORD_BOUNDARY.split(text).filter { it.isNotEmpty() }
+        }
+    }
+
+    private val cache = object : LruCache<String, Entry>(maxChars) {
+        override fun sizeOf(key: String, value: Entry): Int = value.text.length.coerceAtLeast(1)
+    }
+    private val hits = AtomicLong(0)
+    private val misses = AtomicLong(0)
+
+    companion object {
+        private const val TAG = "ResponseCache"
+        // About 8 MB of UTF-16 text
+        const val DEFAULT_MAX_CHARS = 4 * 1024 * 1024
+        private val WORD_BOUNDARY = Regex("(?<=\\s)")
+
+        /**
+         * Whether output for [config] is reproducible and may be cached.
+         */
+        fun isDeterministic(config: GenerationConfig): Boolean {
+            return config.temperature == 0.0 || config.seed >= 0
+        }
+
+        /**
+         * Canonical cache key for a request of [kind] ("chat" or "completion") with
+         * [input] (the messages array or prompt) on model [modelId].
+         */
+        fun keyFor(kind: String, modelId: String, input: JsonElement, config: GenerationConfig): String {
+            val canonical = JsonObject().apply {
+                addProperty("kind", kind)
+                addProperty("model", modelId)
+                add("input", canonicalize(input))
+                addProperty("max_tokens", config.maxTokens)
+                addProperty("temperature", config.temperature)
+                addProperty("top_k", config.topK)
+                addProperty("top_p", config.topP)
+                addProperty("seed", config.seed)
+                config.responseFormat?.let { format ->
+                    addProperty("response_format", format.type)
+                    addProperty("response_schema", format.schema)
+                }
+                config.extraContext?.toSortedMap()?.forEach { (key, value) ->
+                    addProperty("extra.$key", value.toString())
+                }
+            }
+            val digest = MessageDigest.getInstance("SHA-256")
+                .digest(canonical.toString().toByteArray(Charsets.UTF_8))
+            return digest.joinToString("") { "%02x".format(it) }
+        }
+
+        // Copy of [element] with object keys in sorted order
+        private fun canonicalize(element: JsonElement): JsonElement {
+            return when {
+                element.isJsonObject -> {
+                    val sorted = JsonObject()
+                    element.asJsonObject.entrySet()
+                        .sortedBy { it.key }
+                        .forEach { (key, value) -> sorted.add(key, canonicalize(value)) }
+                    sorted
+                }
+                element.isJsonArray -> {
+                    val array = JsonArray()
+                    element.asJsonArray.forEach { array.add(canonicalize(it)) }
+                    array
+                }
+                else -> element
+            }
+        }
+    }
+
+    fun get(key: String): Entry? {
+        val entry = cache.get(key)
+        if (entry != null) hits.incrementAndGet() else misses.incrementAndGet()
+        return entry
+    }
+
+    /**
+     * Cache a completed response.  Error results from [LlamaModel] (which are
+     * returned as text starting with "Error:") are not cached.
+     */
+    fun put(key: String, text: String, tokens: List<String> = emptyList()) {
+        if (text.isEmpty() || text.startsWith("Error:") ||
+            tokens.lastOrNull()?.startsWith("Error:") == true) {
+            return
+        }
+        cache.put(key, Entry(text, tokens))
+        LogManager.d(TAG) { "Cached response for ${key.take(12)}… (${text.length} chars)" }
+    }
+
+    fun clear() {
+        cache.evictAll()
+    }
+
+    fun getHitCount(): Long = hits.get()
+
+    fun getMissCount(): Long = misses.get()
+}
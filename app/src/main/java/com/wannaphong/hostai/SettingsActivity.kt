@@ -3,10 +3,12 @@ package com.wannaphong.hostai
 import android.app.ActivityManager
 import android.content.Intent
 import android.os.Bundle
+import android.view.View
 import android.widget.Toast
 import androidx.appcompat.app.AppCompatActivity
 import androidx.core.content.FileProvider
 import com.wannaphong.hostai.databinding.ActivitySettingsBinding
+import java.io.File
 
 class SettingsActivity : AppCompatActivity() {
     
@@ -28,6 +30,7 @@ class SettingsActivity : AppCompatActivity() {
         loadSettings()
         setupUI()
         updateMemoryUsage()
+        updateConcurrencyAdvice()
         updateLogsCount()
     }
     
@@ -40,6 +43,12 @@ class SettingsActivity : AppCompatActivity() {
 
         // Load max context length setting
         binding.maxContextLengthEditText.setText(settingsManager.getMaxContextLength().toString())
+
+        // Load engine pools setting
+        binding.enginePoolsEditText.setText(settingsManager.getEnginePools())
+
+        // Load model memory budget setting
+        binding.modelMemoryBudgetEditText.setText(settingsManager.getModelMemoryBudgetMb().toString())
         
         // Load feature toggles
         binding.webChatSwitch.isChecked = settingsManager.isWebChatEnabled()
@@ -58,11 +67,21 @@ class SettingsActivity : AppCompatActivity() {
         
         // Load multimodal setting
         binding.multimodalSwitch.isChecked = settingsManager.isMultimodalEnabled()
+        
+        // Load response cache setting
+        binding.responseCacheSwitch.isChecked = settingsManager.isResponseCacheEnabled()
+        binding.thermalThrottlingSwitch.isChecked = settingsManager.isThermalThrottlingEnabled()
+        when (settingsManager.getContextPolicy()) {
+            ContextManager.Policy.SLIDING_WINDOW -> binding.contextSlidingWindowRadio.isChecked = true
+            ContextManager.Policy.SUMMARIZE -> binding.contextSummarizeRadio.isChecked = true
+            ContextManager.Policy.DROP_OLDEST -> binding.contextDropOldestRadio.isChecked = true
+        }
     }
     
     private fun setupUI() {
         binding.refreshMemoryButton.setOnClickListener {
             updateMemoryUsage()
+            updateConcurrencyAdvice()
         }
         
         binding.exportLogsButton.setOnClickListener {
@@ -103,6 +122,32 @@ class SettingsActivity : AppCompatActivity() {
         )
     }
     
+    /**
+     * Show how many concurrent requests the selected model fits in available memory
+     * (see [MemoryPlanner]).
+     */
+    private fun updateConcurrencyAdvice() {
+        val model = ModelManager(this).getSelectedModel()
+        if (model == null || model.sizeBytes <= 0) {
+            binding.concurrencyAdviceText.visibility = View.GONE
+            return
+        }
+        val planner = MemoryPlanner(this)
+        val contextLength = minOf(
+            settingsManager.getMaxContextLength(),
+            model.metadata?.maxContextLength ?: Int.MAX_VALUE
+        )
+        val estimate = planner.estimate(model.path, model.metadata, model.sizeBytes, contextLength, settingsManager.getBackend())
+        val plan = planner.plan(estimate, Int.MAX_VALUE)
+        binding.concurrencyAdviceText.text = getString(
+            R.string.concurrency_advice,
+            model.name,
+            (estimate.perEngineBytes / 1024 / 1024).toString(),
+            plan.safeEngines
+        )
+        binding.concurrencyAdviceText.visibility = View.VISIBLE
+    }
+    
     private fun updateLogsCount() {
         val count = requestLogger.getLogsCount()
         if (count > 0) {
@@ -140,9 +185,29 @@ class SettingsActivity : AppCompatActivity() {
             return
         }
 
+        // Validate and save engine pools (empty = one pool from the settings above)
+        val enginePools = binding.enginePoolsEditText.text.toString().trim()
+        try {
+            EnginePoolSpec.parseList(enginePools)
+        } catch (e: IllegalArgumentException) {
+            Toast.makeText(this, getString(R.string.invalid_engine_pools, e.message), Toast.LENGTH_LONG).show()
+            return
+        }
+
+        // Validate and save model memory budget (0 = automatic)
+        val modelMemoryBudgetText = binding.modelMemoryBudgetEditText.text.toString()
+        val modelMemoryBudget = modelMemoryBudgetText.toIntOrNull()
+
+        if (modelMemoryBudget == null || modelMemoryBudget < 0) {
+            Toast.makeText(this, R.string.invalid_model_memory_budget, Toast.LENGTH_LONG).show()
+            return
+        }
+
         settingsManager.setCustomPort(port)
         settingsManager.setMaxConcurrency(maxConcurrency)
         settingsManager.setMaxContextLength(maxContextLength)
+        settingsManager.setEnginePools(enginePools)
+        settingsManager.setModelMemoryBudgetMb(modelMemoryBudget)
         
         // Save feature toggles
         settingsManager.setWebChatEnabled(binding.webChatSwitch.isChecked)
@@ -163,6 +228,16 @@ class SettingsActivity : AppCompatActivity() {
         // Save multimodal setting
         settingsManager.setMultimodalEnabled(binding.multimodalSwitch.isChecked)
         
+        // Save response cache setting
+        settingsManager.setResponseCacheEnabled(binding.responseCacheSwitch.isChecked)
+        settingsManager.setThermalThrottlingEnabled(binding.thermalThrottlingSwitch.isChecked)
+        val contextPolicy = when (binding.contextPolicyRadioGroup.checkedRadioButtonId) {
+            R.id.contextSlidingWindowRadio -> ContextManager.Policy.SLIDING_WINDOW
+            R.id.contextSummarizeRadio -> ContextManager.Policy.SUMMARIZE
+            else -> ContextManager.Policy.DROP_OLDEST
+        }
+        settingsManager.setContextPolicy(contextPolicy)
+        
         Toast.makeText(this, R.string.settings_saved, Toast.LENGTH_SHORT).show()
         
         // Return to main activity
@@ -170,7 +245,14 @@ class SettingsActivity : AppCompatActivity() {
     }
     
     private fun exportLogs() {
-        val file = requestLogger.exportLogsToJson()
+        // The export waits for queued log writes, so it runs off the main thread
+        requestLogger.exportLogsToJson { file ->
+            runOnUiThread { shareExportedLogs(file) }
+        }
+    }
+    
+    private fun shareExportedLogs(file: File?) {
+        if (isFinishing || isDestroyed) return
         if (file != null) {
             try {
                 // Share the exported file
@@ -203,9 +285,13 @@ class SettingsActivity : AppCompatActivity() {
     }
     
     private fun clearLogs() {
-        requestLogger.clearLogs()
-        updateLogsCount()
-        Toast.makeText(this, R.string.logs_cleared, Toast.LENGTH_SHORT).show()
+        requestLogger.clearLogs {
+            runOnUiThread {
+                if (isFinishing || isDestroyed) return@runOnUiThread
+                updateLogsCount()
+                Toast.makeText(this, R.string.logs_cleared, Toast.LENGTH_SHORT).show()
+            }
+        }
     }
     
     private fun openLicenses() {
@@ -10,6 +10,7 @@ class SettingsManager(context: Context) {
     private val prefs: SharedPreferences = context.getSharedPreferences(PREFS_NAME, Context.MODE_PRIVATE)
     
     companion object {
+        private const val TAG = "SettingsManager"
         private const val PREFS_NAME = "hostai_settings"
         private const val KEY_CUSTOM_PORT = "custom_port"
         private const val KEY_WEB_CHAT_ENABLED = "web_chat_enabled"
@@ -20,7 +21,13 @@ class SettingsManager(context: Context) {
         private const val KEY_BACKEND = "backend"
         private const val KEY_MAX_CONCURRENCY = "max_concurrency"
         private const val KEY_MAX_CONTEXT_LENGTH = "max_context_length"
+        private const val KEY_ENGINE_POOLS = "engine_pools"
+        private const val KEY_MODEL_MEMORY_BUDGET_MB = "model_memory_budget_mb"
         private const val KEY_MULTIMODAL_ENABLED = "multimodal_enabled"
+        private const val KEY_LOG_LEVEL = "log_level"
+        private const val KEY_RESPONSE_CACHE_ENABLED = "response_cache_enabled"
+        private const val KEY_THERMAL_THROTTLING_ENABLED = "thermal_throttling_enabled"
+        private const val KEY_CONTEXT_POLICY = "context_policy"
 
         const val BACKEND_CPU = "cpu"
         const val BACKEND_GPU = "gpu"
@@ -29,6 +36,7 @@ class SettingsManager(context: Context) {
         const val DEFAULT_PORT = 8080
         const val DEFAULT_MAX_CONCURRENCY = 1
         const val DEFAULT_MAX_CONTEXT_LENGTH = 2048
+        val DEFAULT_LOG_LEVEL = LogManager.LogLevel.INFO
     }
     
     /**
@@ -164,6 +172,49 @@ class SettingsManager(context: Context) {
         prefs.edit().putInt(KEY_MAX_CONTEXT_LENGTH, length).apply()
     }
 
+    /**
+     * Get the engine pools setting, e.g. "short:2:gpu:1024,long:1:cpu:4096"
+     * (default: empty = one pool from Max Concurrency, Backend and Max Context Length)
+     */
+    fun getEnginePools(): String {
+        return prefs.getString(KEY_ENGINE_POOLS, "") ?: ""
+    }
+
+    /**
+     * Set the engine pools setting (validate with EnginePoolSpec.parseList first)
+     */
+    fun setEnginePools(pools: String) {
+        prefs.edit().putString(KEY_ENGINE_POOLS, pools.trim()).apply()
+    }
+
+    /**
+     * Engine pools to create for a model: the Engine Pools setting, or a single
+     * "default" pool of Max Concurrency engines if it is empty or invalid
+     */
+    fun getEnginePoolSpecs(): List<EnginePoolSpec> {
+        val specs = try {
+            EnginePoolSpec.parseList(getEnginePools())
+        } catch (e: IllegalArgumentException) {
+            LogManager.w(TAG, "Ignoring invalid engine pools setting: ${e.message}")
+            emptyList()
+        }
+        return specs.ifEmpty { listOf(EnginePoolSpec("default", getMaxConcurrency().coerceAtLeast(1))) }
+    }
+
+    /**
+     * Get the memory budget in MB shared by all loaded models (default: 0 = half of device RAM)
+     */
+    fun getModelMemoryBudgetMb(): Int {
+        return prefs.getInt(KEY_MODEL_MEMORY_BUDGET_MB, 0)
+    }
+
+    /**
+     * Set the memory budget in MB shared by all loaded models (0 for automatic)
+     */
+    fun setModelMemoryBudgetMb(budgetMb: Int) {
+        prefs.edit().putInt(KEY_MODEL_MEMORY_BUDGET_MB, budgetMb).apply()
+    }
+
     /**
      * Check if multimodal mode is enabled (default: false).
      * Enable only for multimodal models (e.g. Gemma-3N) that include vision/audio components.
@@ -179,4 +230,62 @@ class SettingsManager(context: Context) {
     fun setMultimodalEnabled(enabled: Boolean) {
         prefs.edit().putBoolean(KEY_MULTIMODAL_ENABLED, enabled).apply()
     }
+
+    /**
+     * Get the minimum level recorded by [LogManager] (default: INFO).
+     * DEBUG adds per-request and per-token detail at a small throughput cost.
+     */
+    fun getLogLevel(): LogManager.LogLevel {
+        val stored = prefs.getString(KEY_LOG_LEVEL, null) ?: return DEFAULT_LOG_LEVEL
+        return LogManager.LogLevel.values().firstOrNull { it.name == stored } ?: DEFAULT_LOG_LEVEL
+    }
+
+    /**
+     * Set the minimum level recorded by [LogManager]
+     */
+    fun setLogLevel(level: LogManager.LogLevel) {
+        prefs.edit().putString(KEY_LOG_LEVEL, level.name).apply()
+    }
+
+    /**
+     * Check if the response cache for deterministic requests is enabled (default: false)
+     */
+    fun isResponseCacheEnabled(): Boolean {
+        return prefs.getBoolean(KEY_RESPONSE_CACHE_ENABLED, false)
+    }
+
+    /**
+     * Set response cache enabled state
+     */
+    fun setResponseCacheEnabled(enabled: Boolean) {
+        prefs.edit().putBoolean(KEY_RESPONSE_CACHE_ENABLED, enabled).apply()
+    }
+
+    /**
+     * Check if throttling when the device is hot is enabled (default: true)
+     */
+    fun isThermalThrottlingEnabled(): Boolean {
+        return prefs.getBoolean(KEY_THERMAL_THROTTLING_ENABLED, true)
+    }
+
+    /**
+     * Set thermal throttling enabled state
+     */
+    fun setThermalThrottlingEnabled(enabled: Boolean) {
+        prefs.edit().putBoolean(KEY_THERMAL_THROTTLING_ENABLED, enabled).apply()
+    }
+
+    /**
+     * Get how chat histories longer than the context are shortened (default: drop oldest turns)
+     */
+    fun getContextPolicy(): ContextManager.Policy {
+        return ContextManager.Policy.fromValue(prefs.getString(KEY_CONTEXT_POLICY, null))
+    }
+
+    /**
+     * Set the context policy
+     */
+    fun setContextPolicy(policy: ContextManager.Policy) {
+        prefs.edit().putString(KEY_CONTEXT_POLICY, policy.value).apply()
+    }
 }
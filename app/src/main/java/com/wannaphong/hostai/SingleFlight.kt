@@ -0,0 +1,184 @@
+package com.wannaphong.hostai
+
+import kotlinx.coroutines.CompletableDeferred
+import kotlinx.coroutines.runBlocking
+import java.io.IOException
+import java.util.concurrent.ConcurrentHashMap
+
+/**
+ * Coalesces identical deterministic requests that are running at the same time.
+ *
+ * The first request for a key becomes the leader of a [Flight] and runs the
+ * generation; requests with the same key that arrive before it finishes join the
+ * flight instead of taking an engine.  Streaming joiners receive the tokens produced
+ * so far and then every new token as the leader's generation emits it; non-streaming
+ * joiners wait for the final text.  Keys come from [ResponseCache.keyFor], so only
+ * requests whose output is reproducible (temperature 0 or a fixed seed) are coalesced.
+ *
+ * Thread-safe.
+ */
+class SingleFlight {
+    private val flights = ConcurrentHashMap<String, Flight>()
+
+    companion object {
+        private const val TAG = "SingleFlight"
+        private val WORD_BOUNDARY = Regex("(?<=\\s)")
+    }
+
+    /**
+     * Join the in-flight generation for [key], or start a new flight.
+     * A joiner counts as listening from here on, so the leader keeps generating for
+     * it; it must then call [Flight.subscribe] with `joined = true`, [Flight.await],
+     * or [Flight.leave] exactly once.
+     * @return The flight and whether the caller is its leader (and must run the
+     *   generation and call [Flight.finish] or [Flight.fail])
+     */
+    fun join(key: String): Pair<Flight, Boolean> {
+        val fresh = Flight(key)
+        val existing = flights.putIfAbsent(key, fresh)
+        return if (existing == null) {
+            fresh to true
+        } else {
+            existing.expectJoiner()
+            LogManager.i(TAG, "Request joined in-flight generation ${key.take(12)}…")
+            existing to false
+        }
+    }
+
+    /**
+     * One running generation and the requests attached to it.
+     *
+     * Tokens are delivered to subscribers while holding the flight's lock, so each
+     * subscriber sees the prefix and the live tokens in order, and a slow client
+     * paces the generation exactly as it would without coalescing.
+     */
+    inner class Flight internal constructor(private val key: String) {
+        private val lock = Any()
+        private val tokens = ArrayList<String>()
+        private val text = StringBuilder()
+        private val subscribers = ArrayList<(String) -> Unit>()
+        private var waiters = 0
+        // Joiners that have not subscribed, started waiting or left yet
+        private var joining = 0
+        private var finished = false
+        private val result = CompletableDeferred<String?>()
+
+        /**
+         * Token callback for the leader's generation.  Fans [token] out to every
+         * subscriber, dropping those that fail (disconnected clients).
+         * @throws IOException when nobody is listening any more, which stops the generation
+         */
+        fun emit(token: String) {
+            synchronized(lock) {
+                if (finished) return
+                tokens.add(token)
+                text.append(token)
+                deliver(token)
+                if (subscribers.isEmpty() && waiters == 0 && joining == 0) {
+                    throw IOException("All clients of the shared generation disconnected")
+                }
+            }
+        }
+
+        /**
+         * Receive the tokens generated so far, then each new token, through [onToken].
+         * If the leader does not stream, the final text is delivered in word-sized
+         * chunks when it is ready.
+         * @param joined Whether the caller joined through [join] (not the leader)
+         */
+        fun subscribe(onToken: (String) -> Unit, joined: Boolean = false) {
+            synchronized(lock) {
+                if (joined) joining--
+                val prefix = if (tokens.isEmpty() && finished) splitText(text.toString()) else tokens
+                try {
+                    prefix.forEach(onToken)
+                } catch (e: Exception) {
+                    return
+                }
+                if (!finished) subscribers.add(onToken)
+            }
+        }
+
+        /**
+         * Block until the flight finishes; called by a joiner.
+         * @return The full generated text, or null if the leader failed
+         */
+        fun await(): String? {
+            synchronized(lock) {
+                joining--
+                waiters++
+            }
+            return try {
+                runBlocking { result.await() }
+            } finally {
+                synchronized(lock) { waiters-- }
+            }
+        }
+
+        /**
+         * Withdraw a joiner that gives up before subscribing or waiting.
+         */
+        fun leave() {
+            synchronized(lock) { joining-- }
+        }
+
+        internal fun expectJoiner() {
+            synchronized(lock) { joining++ }
+        }
+
+        /**
+         * Suspend until the flight finishes; used by streaming joiners, which receive
+         * the tokens through [subscribe].
+         */
+        suspend fun awaitResult(): String? = result.await()
+
+        /**
+         * Complete the flight with [finalText], or with the streamed tokens when null.
+         * Later requests with the same key start a new generation.
+         */
+        fun finish(finalText: String? = null) {
+            flights.remove(key, this)
+            synchronized(lock) {
+                if (finished) return
+                finished = true
+                if (finalText != null && tokens.isEmpty()) {
+                    text.append(finalText)
+                    splitText(finalText).forEach { deliver(it) }
+                }
+                subscribers.clear()
+            }
+            result.complete(text.toString())
+        }
+
+        /**
+         * Complete the flight without a result; joiners report an error.
+         * No-op if the flight already finished.
+         */
+        fun fail() {
+            flights.remove(key, this)
+            synchronized(lock) {
+                if (finished) return
+                finished = true
+                subscribers.clear()
+            }
+            result.complete(null)
+        }
+
+        // Must be called with [lock] held
+        private fun deliver(token: String) {
+            val iterator = subscribers.iterator()
+            while (iterator.hasNext()) {
+                val subscriber = iterator.next()
+                try {
+                    subscriber(token)
+                } catch (e: Exception) {
+                    iterator.remove()
+                }
+            }
+        }
+
+        private fun splitText(value: String): List<String> {
+            return WORD_BOUNDARY.split(value).filter { it.isNotEmpty() }
+        }
+    }
+}
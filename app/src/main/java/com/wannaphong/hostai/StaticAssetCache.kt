@@ -0,0 +1,92 @@
+package com.wannaphong.hostai
+
+import android.content.Context
+import java.io.ByteArrayOutputStream
+import java.security.MessageDigest
+import java.util.zip.GZIPOutputStream
+
+/**
+ * The app's bundled web assets (chat UI page, animations, icons), loaded once into
+ * memory with a strong ETag and, for text formats, a gzip-compressed copy.
+ *
+ * Serving from memory keeps the web chat page off the storage I/O path that model
+ * loading and logging use, and ETags let browsers revalidate with a 304 instead of
+ * downloading the page again.  The map is built in the constructor and never
+ * modified, so lookups need no locking.
+ */
+class StaticAssetCache(context: Context) {
+
+    /**
+     * One asset.  [gzipped] is null when compression would not make it smaller
+     * (e.g. images).  Each representation has its own strong ETag: [gzipEtag] is
+     * [etag] with a `-gz` suffix.
+     */
+    class Asset(
+        val name: String,
+        val mimeType: String,
+        val bytes: ByteArray,
+        val gzipped: ByteArray?,
+        val etag: String
+    ) {
+        val gzipEtag: String = etag.dropLast(1) + "-gz\""
+    }
+
+    private val assets: Map<String, Asset>
+
+    companion object {
+        private const val TAG = "StaticAssetCache"
+        // Only keep a gzip copy if it saves at least this fraction of the size
+        private const val MIN_GZIP_SAVING = 0.1
+
+        fun mimeTypeFor(fileName: String): String = when {
+            fileName.endsWith(".ico") -> "image/x-icon"
+            fileName.endsWith(".json") -> "application/json"
+            fileName.endsWith(".html") -> "text/html; charset=utf-8"
+            fileName.endsWith(".css") -> "text/css"
+            fileName.endsWith(".js") -> "application/javascript"
+            else -> "application/octet-stream"
+        }
+
+        private fun isCompressible(mimeType: String): Boolean {
+            return mimeType.startsWith("text/") || mimeType == "application/json" ||
+                mimeType == "application/javascript"
+        }
+    }
+
+    init {
+        val loaded = HashMap<String, Asset>()
+        val names = context.assets.list("") ?: emptyArray()
+        var totalBytes = 0L
+        for (name in names) {
+            val bytes = try {
+                context.assets.open(name).use { it.readBytes() }
+            } catch (e: Exception) {
+                // Directories (e.g. images/, webkit/) cannot be opened as files
+                continue
+            }
+            val mimeType = mimeTypeFor(name)
+            val gzipped = if (isCompressible(mimeType)) {
+                gzip(bytes).takeIf { it.size < bytes.size * (1 - MIN_GZIP_SAVING) }
+            } else {
+                null
+            }
+            loaded[name] = Asset(name, mimeType, bytes, gzipped, etagFor(bytes))
+            totalBytes += bytes.size + (gzipped?.size ?: 0)
+        }
+        assets = loaded
+        LogManager.i(TAG, "Cached ${assets.size} asset(s), ${totalBytes / 1024} KB")
+    }
+
+    fun get(name: String): Asset? = assets[name]
+
+    private fun gzip(bytes: ByteArray): ByteArray {
+        val output = ByteArrayOutputStream(bytes.size / 2)
+        GZIPOutputStream(output).use { it.write(bytes) }
+        return output.toByteArray()
+    }
+
+    private fun etagFor(bytes: ByteArray): String {
+        val digest = MessageDigest.getInstance("SHA-256").digest(bytes)
+        return "\"" + digest.take(16).joinToString("") { "%02x".format(it) } + "\""
+    }
+}
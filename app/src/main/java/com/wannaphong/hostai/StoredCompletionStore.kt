@@ -0,0 +1,348 @@
+package com.wannaphong.hostai
+
+import android.content.ContentValues
+import android.content.Context
+import android.database.Cursor
+import android.database.sqlite.SQLiteDatabase
+import android.database.sqlite.SQLiteOpenHelper
+import android.util.LruCache
+import com.google.gson.Gson
+import com.google.gson.GsonBuilder
+import com.google.gson.reflect.TypeToken
+
+/**
+ * Persistent store for chat completions created with store=true.
+ *
+ * Completions live in SQLite so they survive restarts and do not accumulate in
+ * memory; only the most recently used [MAX_CACHED_COMPLETIONS] are kept in an LRU
+ * cache.  Metadata key/value pairs are stored in their own indexed table so list
+ * filters such as `metadata[topic]=billing` are index lookups, and blob references
+ * (see [BlobStore]) are recorded so the blob sweep never removes media that a stored
+ * completion still needs.  The table is capped at [MAX_STORED_COMPLETIONS] rows,
+ * dropping the oldest.
+ *
+ * Thread-safe: SQLiteDatabase serialises access and LruCache is synchronised.
+ */
+class StoredCompletionStore(context: Context) :
+    SQLiteOpenHelper(context.applicationContext, DATABASE_NAME, null, DATABASE_VERSION) {
+
+    /**
+     * One page of [list] results; [hasMore] is true when further items follow the last one.
+     */
+    data class Page(
+        val data: List<StoredCompletion>,
+        val hasMore: Boolean
+    )
+
+    private val gson: Gson = GsonBuilder().disableHtmlEscaping().create()
+    private val cache = LruCache<String, StoredCompletion>(MAX_CACHED_COMPLETIONS)
+    private val messagesType = object : TypeToken<List<Map<String, Any>>>() {}.type
+    private val metadataType = object : TypeToken<Map<String, Any>>() {}.type
+
+    companion object {
+        private const val TAG = "StoredCompletionStore"
+        private const val DATABASE_NAME = "stored_completions.db"
+        private const val DATABASE_VERSION = 1
+        private const val MAX_CACHED_COMPLETIONS = 64
+        const val MAX_STORED_COMPLETIONS = 10_000
+
+        private const val TABLE_COMPLETIONS = "completions"
+        private const val TABLE_METADATA = "completion_metadata"
+        private const val TABLE_BLOBS = "completion_blobs"
+        private const val COMPLETION_COLUMNS = "id, object, created, model, messages, response, metadata"
+
+        private val BLOB_REF_PATTERN = Regex(Regex.escape(BlobStore.REF_PREFIX) + "([0-9a-f]{64})")
+    }
+
+    override fun onConfigure(db: SQLiteDatabase) {
+        db.setForeignKeyConstraintsEnabled(true)
+        db.enableWriteAheadLogging()
+    }
+
+    override fun onCreate(db: SQLiteDatabase) {
+        db.execSQL(
+            """
+            CREATE TABLE $TABLE_COMPLETIONS (
+                id TEXT PRIMARY KEY,
+                object TEXT NOT NULL,
+                created INTEGER NOT NULL,
+                model TEXT NOT NULL,
+                messages TEXT NOT NULL,
+                response TEXT NOT NULL,
+                metadata TEXT
+            )
+            """.trimIndent()
+        )
+        db.execSQL("CREATE INDEX idx_completions_created ON $TABLE_COMPLETIONS(created)")
+        db.execSQL("CREATE INDEX idx_completions_model_created ON $TABLE_COMPLETIONS(model, created)")
+        db.execSQL(
+            """
+            CREATE TABLE $TABLE_METADATA (
+                completion_id TEXT NOT NULL REFERENCES $TABLE_COMPLETIONS(id) ON DELETE CASCADE,
+                key TEXT NOT NULL,
+                value TEXT NOT NULL,
+                PRIMARY KEY (completion_id, key)
+            )
+            """.trimIndent()
+        )
+        db.execSQL("CREATE INDEX idx_metadata_key_value ON $TABLE_METADATA(key, value)")
+        db.execSQL(
+            """
+            CREATE TABLE $TABLE_BLOBS (
+                completion_id TEXT NOT NULL REFERENCES $TABLE_COMPLETIONS(id) ON DELETE CASCADE,
+                hash TEXT NOT NULL,
+                PRIMARY KEY (completion_id, hash)
+            )
+            """.trimIndent()
+        )
+        db.execSQL("CREATE INDEX idx_blobs_hash ON $TABLE_BLOBS(hash)")
+    }
+
+    override fun onUpgrade(db: SQLiteDatabase, oldVersion: Int, newVersion: Int) {
+        // Version 1 is the first schema; nothing to migrate yet.
+    }
+
+    /**
+     * Insert or replace a stored completion, then drop the oldest rows beyond the cap.
+     */
+    fun put(completion: StoredCompletion) {
+        val messagesJson = gson.toJson(completion.messages)
+        val db = writableDatabase
+        db.beginTransaction()
+        try {
+            deleteChildren(db, completion.id)
+            val values = ContentValues().apply {
+                put("id", completion.id)
+                put("object", completion.obj)
+                put("created", completion.created)
+                put("model", completion.model)
+                put("messages", messagesJson)
+                put("response", completion.responseContent)
+                put("metadata", completion.metadata?.let { gson.toJson(it) })
+            }
+            db.insertWithOnConflict(TABLE_COMPLETIONS, null, values, SQLiteDatabase.CONFLICT_REPLACE)
+            insertMetadataRows(db, completion.id, completion.metadata)
+
+            BLOB_REF_PATTERN.findAll(messagesJson).map { it.groupValues[1] }.toSet().forEach { hash ->
+                val blobValues = ContentValues().apply {
+                    put("completion_id", completion.id)
+                    put("hash", hash)
+                }
+                db.insertWithOnConflict(TABLE_BLOBS, null, blobValues, SQLiteDatabase.CONFLICT_IGNORE)
+            }
+
+            pruneOldest(db)
+            db.setTransactionSuccessful()
+        } finally {
+            db.endTransaction()
+        }
+        cache.put(completion.id, completion)
+    }
+
+    /**
+     * Get a stored completion by ID, from the LRU cache when possible.
+     */
+    fun get(id: String): StoredCompletion? {
+        cache.get(id)?.let { return it }
+        val completion = readableDatabase.rawQuery(
+            "SELECT $COMPLETION_COLUMNS FROM $TABLE_COMPLETIONS WHERE id = ?",
+            arrayOf(id)
+        ).use { cursor ->
+            if (cursor.moveToFirst()) readCompletion(cursor) else null
+        }
+        completion?.let { cache.put(id, it) }
+        return completion
+    }
+
+    /**
+     * List stored completions ordered by creation time with cursor pagination.
+     *
+     * @param after    ID of the last item of the previous page (exclusive cursor)
+     * @param limit    Maximum number of items to return
+     * @param ascending Oldest first when true, newest first otherwise
+     * @param model    Only completions produced by this model, if set
+     * @param metadata Only completions whose metadata contains all these pairs
+     */
+    fun list(
+        after: String? = null,
+        limit: Int = 20,
+        ascending: Boolean = true,
+        model: String? = null,
+        metadata: Map<String, String> = emptyMap()
+    ): Page {
+        val db = readableDatabase
+        val where = mutableListOf<String>()
+        val args = mutableListOf<String>()
+
+        if (model != null) {
+            where.add("model = ?")
+            args.add(model)
+        }
+        for ((key, value) in metadata) {
+            where.add("id IN (SELECT completion_id FROM $TABLE_METADATA WHERE key = ? AND value = ?)")
+            args.add(key)
+            args.add(value)
+        }
+        if (after != null) {
+            val anchor = db.rawQuery(
+                "SELECT created, rowid FROM $TABLE_COMPLETIONS WHERE id = ?",
+                arrayOf(after)
+            ).use { cursor ->
+                if (cursor.moveToFirst()) cursor.getLong(0) to cursor.getLong(1) else null
+            } ?: return Page(emptyList(), false)
+            val op = if (ascending) ">" else "<"
+            // Numbers come from the database, so inlining them is safe
+            where.add("(created $op ${anchor.first} OR (created = ${anchor.first} AND rowid $op ${anchor.second}))")
+        }
+
+        val direction = if (ascending) "ASC" else "DESC"
+        val sql = buildString {
+            append("SELECT $COMPLETION_COLUMNS FROM $TABLE_COMPLETIONS")
+            if (where.isNotEmpty()) append(" WHERE ").append(where.joinToString(" AND "))
+            append(" ORDER BY created $direction, rowid $direction LIMIT ${limit + 1}")
+        }
+
+        val rows = db.rawQuery(sql, args.toTypedArray()).use { cursor ->
+            val result = mutableListOf<StoredCompletion>()
+            while (cursor.moveToNext()) result.add(readCompletion(cursor))
+            result
+        }
+        return Page(rows.take(limit), rows.size > limit)
+    }
+
+    /**
+     * Replace the metadata of a stored completion.
+     * @return The updated completion, or null if it does not exist
+     */
+    fun updateMetadata(id: String, metadata: Map<String, Any>): StoredCompletion? {
+        val existing = get(id) ?: return null
+        val db = writableDatabase
+        db.beginTransaction()
+        try {
+            val values = ContentValues().apply { put("metadata", gson.toJson(metadata)) }
+            db.update(TABLE_COMPLETIONS, values, "id = ?", arrayOf(id))
+            db.delete(TABLE_METADATA, "completion_id = ?", arrayOf(id))
+            insertMetadataRows(db, id, metadata)
+            db.setTransactionSuccessful()
+        } finally {
+            db.endTransaction()
+        }
+        val updated = existing.copy(metadata = metadata)
+        cache.put(id, updated)
+        return updated
+    }
+
+    /**
+     * Delete a stored completion.
+     * @return true if a row was removed
+     */
+    fun delete(id: String): Boolean {
+        val db = writableDatabase
+        db.beginTransaction()
+        val removed = try {
+            deleteChildren(db, id)
+            val count = db.delete(TABLE_COMPLETIONS, "id = ?", arrayOf(id))
+            db.setTransactionSuccessful()
+            count > 0
+        } finally {
+            db.endTransaction()
+        }
+        cache.remove(id)
+        return removed
+    }
+
+    /**
+     * Delete every stored completion.
+     * @return Number of completions removed
+     */
+    fun clear(): Int {
+        val db = writableDatabase
+        db.beginTransaction()
+        val count = try {
+            db.delete(TABLE_METADATA, null, null)
+            db.delete(TABLE_BLOBS, null, null)
+            val removed = db.delete(TABLE_COMPLETIONS, null, null)
+            db.setTransactionSuccessful()
+            removed
+        } finally {
+            db.endTransaction()
+        }
+        cache.evictAll()
+        return count
+    }
+
+    /**
+     * Drop the in-memory cache (the database is untouched), e.g. under memory pressure.
+     */
+    fun trimMemory() {
+        cache.evictAll()
+    }
+
+    /**
+     * Number of stored completions.
+     */
+    fun count(): Int {
+        return readableDatabase.rawQuery("SELECT COUNT(*) FROM $TABLE_COMPLETIONS", null).use { cursor ->
+            if (cursor.moveToFirst()) cursor.getInt(0) else 0
+        }
+    }
+
+    /**
+     * Hashes of every blob referenced by a stored completion; passed to [BlobStore.sweep].
+     */
+    fun referencedBlobHashes(): Set<String> {
+        return readableDatabase.rawQuery("SELECT DISTINCT hash FROM $TABLE_BLOBS", null).use { cursor ->
+            val hashes = mutableSetOf<String>()
+            while (cursor.moveToNext()) hashes.add(cursor.getString(0))
+            hashes
+        }
+    }
+
+    private fun deleteChildren(db: SQLiteDatabase, id: String) {
+        db.delete(TABLE_METADATA, "completion_id = ?", arrayOf(id))
+        db.delete(TABLE_BLOBS, "completion_id = ?", arrayOf(id))
+    }
+
+    private fun insertMetadataRows(db: SQLiteDatabase, id: String, metadata: Map<String, Any>?) {
+        metadata?.forEach { (key, value) ->
+            val values = ContentValues().apply {
+                put("completion_id", id)
+                put("key", key)
+                put("value", value.toString())
+            }
+            db.insertWithOnConflict(TABLE_METADATA, null, values, SQLiteDatabase.CONFLICT_REPLACE)
+        }
+    }
+
+    private fun pruneOldest(db: SQLiteDatabase) {
+        val staleIds = db.rawQuery(
+            "SELECT id FROM $TABLE_COMPLETIONS ORDER BY created DESC, rowid DESC LIMIT -1 OFFSET $MAX_STORED_COMPLETIONS",
+            null
+        ).use { cursor ->
+            val ids = mutableListOf<String>()
+            while (cursor.moveToNext()) ids.add(cursor.getString(0))
+            ids
+        }
+        for (id in staleIds) {
+            deleteChildren(db, id)
+            db.delete(TABLE_COMPLETIONS, "id = ?", arrayOf(id))
+            cache.remove(id)
+        }
+        if (staleIds.isNotEmpty()) {
+            LogManager.i(TAG, "Pruned ${staleIds.size} oldest stored completion(s)")
+        }
+    }
+
+    private fun readCompletion(cursor: Cursor): StoredCompletion {
+        val metadataJson = if (cursor.isNull(6)) null else cursor.getString(6)
+        return StoredCompletion(
+            id = cursor.getString(0),
+            obj = cursor.getString(1),
+            created = cursor.getLong(2),
+            model = cursor.getString(3),
+            messages = gson.fromJson<List<Map<String, Any>>>(cursor.getString(4), messagesType) ?: emptyList(),
+            responseContent = cursor.getString(5),
+            metadata = metadataJson?.let { gson.fromJson<Map<String, Any>>(it, metadataType) }
+        )
+    }
+}
@@ -115,8 +115,15 @@ class StoredCompletionsActivity : AppCompatActivity() {
             return
         }
         
-        val completions = apiServer.getStoredCompletions()
-        
+        // The store is SQLite, so query it off the main thread
+        apiServer.loadStoredCompletions { result ->
+            runOnUiThread {
+                if (!isFinishing && !isDestroyed) showCompletions(result?.first ?: emptyList(), result?.second ?: 0)
+            }
+        }
+    }
+    
+    private fun showCompletions(completions: List<StoredCompletion>, total: Int) {
         if (completions.isEmpty()) {
             binding.emptyStateText.visibility = View.VISIBLE
             binding.emptyStateText.text = "No stored completions.\n\nCreate completions with store=true parameter."
@@ -131,7 +138,7 @@ class StoredCompletionsActivity : AppCompatActivity() {
             adapter.updateCompletions(completions)
         }
         
-        binding.countText.text = "${completions.size} completion(s)"
+        binding.countText.text = "$total completion(s)"
     }
     
     private fun showCompletionDetails(completion: StoredCompletion) {
@@ -180,23 +187,27 @@ class StoredCompletionsActivity : AppCompatActivity() {
     
     private fun exportAllCompletions() {
         val apiServer = apiServerService?.getApiServer() ?: return
-        val completions = apiServer.getStoredCompletions()
-        
-        if (completions.isEmpty()) {
-            Toast.makeText(this, "No completions to export", Toast.LENGTH_SHORT).show()
-            return
-        }
-        
-        try {
-            val timestamp = SimpleDateFormat("yyyyMMdd_HHmmss", Locale.US).format(Date())
-            val fileName = "completions_$timestamp.json"
-            val file = File(getExternalFilesDir(null), fileName)
-            FileOutputStream(file).use { output ->
-                output.write(gson.toJson(completions).toByteArray())
+        // Query and write on the store's background thread; only the toast runs on the UI thread
+        apiServer.loadStoredCompletions { result ->
+            val completions = result?.first ?: emptyList()
+            val message = if (completions.isEmpty()) {
+                "No completions to export"
+            } else {
+                try {
+                    val timestamp = SimpleDateFormat("yyyyMMdd_HHmmss", Locale.US).format(Date())
+                    val fileName = "completions_$timestamp.json"
+                    val file = File(getExternalFilesDir(null), fileName)
+                    FileOutputStream(file).use { output ->
+                        output.write(gson.toJson(completions).toByteArray())
+                    }
+                    "Exported ${completions.size} completion(s) to:\n${file.absolutePath}"
+                } catch (e: Exception) {
+                    "Export failed: ${e.message}"
+                }
+            }
+            runOnUiThread {
+                if (!isFinishing && !isDestroyed) Toast.makeText(this, message, Toast.LENGTH_LONG).show()
             }
-            Toast.makeText(this, "Exported ${completions.size} completion(s) to:\n${file.absolutePath}", Toast.LENGTH_LONG).show()
-        } catch (e: Exception) {
-            Toast.makeText(this, "Export failed: ${e.message}", Toast.LENGTH_LONG).show()
         }
     }
     
@@ -206,11 +217,20 @@ class StoredCompletionsActivity : AppCompatActivity() {
             .setMessage("Delete completion ${completion.id}?")
             .setPositiveButton("Delete") { _, _ ->
                 val apiServer = apiServerService?.getApiServer()
-                if (apiServer?.deleteStoredCompletion(completion.id) == true) {
-                    Toast.makeText(this, "Deleted", Toast.LENGTH_SHORT).show()
-                    loadCompletions()
-                } else {
+                if (apiServer == null) {
                     Toast.makeText(this, "Delete failed", Toast.LENGTH_SHORT).show()
+                    return@setPositiveButton
+                }
+                apiServer.deleteStoredCompletion(completion.id) { removed ->
+                    runOnUiThread {
+                        if (isFinishing || isDestroyed) return@runOnUiThread
+                        if (removed) {
+                            Toast.makeText(this, "Deleted", Toast.LENGTH_SHORT).show()
+                            loadCompletions()
+                        } else {
+                            Toast.makeText(this, "Delete failed", Toast.LENGTH_SHORT).show()
+                        }
+                    }
                 }
             }
             .setNegativeButton("Cancel", null)
@@ -219,15 +239,25 @@ class StoredCompletionsActivity : AppCompatActivity() {
     
     private fun showClearAllConfirmation() {
         val apiServer = apiServerService?.getApiServer() ?: return
-        val count = apiServer.getStoredCompletions().size
-        
+        apiServer.countStoredCompletions { count ->
+            runOnUiThread {
+                if (!isFinishing && !isDestroyed) confirmClearAll(apiServer, count ?: 0)
+            }
+        }
+    }
+    
+    private fun confirmClearAll(apiServer: OpenAIApiServer, count: Int) {
         AlertDialog.Builder(this)
             .setTitle("Clear All Completions")
             .setMessage("Delete all $count stored completion(s)?")
             .setPositiveButton("Clear All") { _, _ ->
-                val cleared = apiServer.clearAllStoredCompletions()
-                Toast.makeText(this, "Cleared $cleared completion(s)", Toast.LENGTH_SHORT).show()
-                loadCompletions()
+                apiServer.clearAllStoredCompletions { cleared ->
+                    runOnUiThread {
+                        if (isFinishing || isDestroyed) return@runOnUiThread
+                        Toast.makeText(this, "Cleared ${cleared ?: 0} completion(s)", Toast.LENGTH_SHORT).show()
+                        loadCompletions()
+                    }
+                }
             }
             .setNegativeButton("Cancel", null)
             .show()
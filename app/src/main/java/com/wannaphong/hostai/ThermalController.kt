@@ -0,0 +1,244 @@
+package com.wannaphong.hostai
+
+import android.content.Context
+import android.os.Build
+import android.os.PowerManager
+import java.util.concurrent.atomic.AtomicLong
+
+/**
+ * Where [ThermalController] reads the device's thermal state from.
+ */
+interface ThermalSource {
+    /** Current status, one of the PowerManager.THERMAL_STATUS_* values (0 = none). */
+    fun status(): Int
+
+    /**
+     * Forecast thermal headroom in [forecastSeconds] (1.0 = severe throttling), or
+     * null if unknown.
+     */
+    fun headroom(forecastSeconds: Int): Float?
+}
+
+/**
+ * [ThermalSource] backed by PowerManager.  Thermal status needs Android 10 and the
+ * headroom forecast Android 11; older devices always report no throttling.
+ */
+class PowerManagerThermalSource(context: Context) : ThermalSource {
+    private val powerManager = context.getSystemService(Context.POWER_SERVICE) as PowerManager
+
+    override fun status(): Int {
+        if (Build.VERSION.SDK_INT < Build.VERSION_CODES.Q) return 0
+        return powerManager.currentThermalStatus
+    }
+
+    override fun headroom(forecastSeconds: Int): Float? {
+        if (Build.VERSION.SDK_INT < Build.VERSION_CODES.R) return null
+        return powerManager.getThermalHeadroom(forecastSeconds).takeIf { !it.isNaN() }
+    }
+}
+
+/**
+ * Adapts the server to the device's temperature so that throughput stays steady
+ * instead of collapsing when the SoC throttles.
+ *
+ * The thermal status is read every [POLL_INTERVAL_MS] by the server and mapped to a
+ * [Throttle] level, which decides:
+ * - Admitted concurrency: how many requests may run at once (the server withholds
+ *   the other permits of its request semaphore).
+ * - A cap on max_tokens per request, so that one long generation cannot keep the
+ *   device hot while others queue behind it.
+ * - The backend for engines created while hot: GPU engines are created on CPU at
+ *   [Throttle.SEVERE] and above, because the GPU is the first component the OS
+ *   clocks down and its tokens/s then drops furthest.
+ *
+ * The level rises as soon as the status (or the headroom forecast, which lets the
+ * server slow down before throttling starts) gets worse, but falls only one step at
+ * a time and only after the device has stayed cooler for [COOL_DOWN_MS].  Without
+ * this hysteresis the server would speed up as soon as the status dropped, heat up
+ * again, and oscillate.
+ *
+ * The source and clock are injectable; on device use [getInstance].  Thread-safe.
+ */
+class ThermalController(
+    private val source: ThermalSource,
+    private val clock: () -> Long = System::currentTimeMillis
+) {
+    /** How hard the server is throttled, from the thermal status. */
+    enum class Throttle {
+        /** Status none or light: no limits. */
+        NONE,
+        /** Status moderate, or severe throttling forecast. */
+        MODERATE,
+        /** Status severe. */
+        SEVERE,
+        /** Status critical, emergency or shutdown. */
+        CRITICAL
+    }
+
+    /**
+     * What the server should do at [throttle].
+     * @property concurrencyLimit Requests admitted at once, or null for no limit
+     * @property maxTokensCap Largest max_tokens per request, or null for no cap
+     * @property avoidGpu Whether new engines should use CPU instead of GPU
+     */
+    data class Decision(
+        val throttle: Throttle,
+        val concurrencyLimit: Int?,
+        val maxTokensCap: Int?,
+        val avoidGpu: Boolean
+    )
+
+    /**
+     * State for /metrics.
+     * @property status Last PowerManager.THERMAL_STATUS_* value read
+     * @property headroom Last headroom forecast, or null if unavailable
+     * @property since When the current throttle level was entered (epoch ms)
+     */
+    data class Snapshot(
+        val status: Int,
+        val headroom: Float?,
+        val decision: Decision,
+        val since: Long,
+        val changes: Long,
+        val cappedRequests: Long
+    )
+
+    @Volatile var decision = decisionFor(Throttle.NONE, SettingsManager.DEFAULT_MAX_CONCURRENCY)
+        private set
+    @Volatile private var lastStatus = 0
+    @Volatile private var lastHeadroom: Float? = null
+    private var since = clock()
+    // When the status first dropped below the current level, or 0 while it has not
+    private var coolingSince = 0L
+    private var changes = 0L
+    private val cappedRequests = AtomicLong(0)
+
+    companion object {
+        private const val TAG = "ThermalController"
+
+        /** How often the server should call [update]. */
+        const val POLL_INTERVAL_MS = 10_000L
+        // How long the device must stay cooler before the level falls one step
+        const val COOL_DOWN_MS = 2 * 60 * 1000L
+        // Headroom forecast window, and the forecast above which to pre-throttle
+        private const val FORECAST_SECONDS = 30
+        private const val PRE_THROTTLE_HEADROOM = 0.95f
+
+        // PowerManager.THERMAL_STATUS_* (constants need API 29)
+        private const val STATUS_MODERATE = 2
+        private const val STATUS_SEVERE = 3
+        private const val STATUS_CRITICAL = 4
+
+        private const val MODERATE_MAX_TOKENS = 1024
+        private const val SEVERE_MAX_TOKENS = 512
+        private const val CRITICAL_MAX_TOKENS = 256
+
+        @Volatile
+        private var instance: ThermalController? = null
+
+        fun getInstance(context: Context): ThermalController {
+            return instance ?: synchronized(this) {
+                instance ?: ThermalController(PowerManagerThermalSource(context.applicationContext)).also { instance = it }
+            }
+        }
+
+        fun throttleFor(status: Int, headroom: Float?): Throttle {
+            val fromStatus = when {
+                status >= STATUS_CRITICAL -> Throttle.CRITICAL
+                status >= STATUS_SEVERE -> Throttle.SEVERE
+                status >= STATUS_MODERATE -> Throttle.MODERATE
+                else -> Throttle.NONE
+            }
+            if (fromStatus == Throttle.NONE && headroom != null && headroom >= PRE_THROTTLE_HEADROOM) {
+                return Throttle.MODERATE
+            }
+            return fromStatus
+        }
+
+        /** The decision at [throttle] for a server that admits [maxConcurrency] requests. */
+        fun decisionFor(throttle: Throttle, maxConcurrency: Int): Decision = when (throttle) {
+            Throttle.NONE -> Decision(throttle, null, null, avoidGpu = false)
+            Throttle.MODERATE -> Decision(throttle, ((maxConcurrency + 1) / 2).coerceAtLeast(1), MODERATE_MAX_TOKENS, avoidGpu = false)
+            Throttle.SEVERE -> Decision(throttle, 1, SEVERE_MAX_TOKENS, avoidGpu = true)
+            Throttle.CRITICAL -> Decision(throttle, 1, CRITICAL_MAX_TOKENS, avoidGpu = true)
+        }
+    }
+
+    /**
+     * Read the thermal source and move the throttle level (up at once, down one step
+     * after [COOL_DOWN_MS] of cooler readings).
+     * @return The current decision
+     */
+    @Synchronized
+    fun update(maxConcurrency: Int): Decision {
+        val status = try {
+            source.status()
+        } catch (e: Exception) {
+            LogManager.w(TAG, "Could not read thermal status: ${e.message}")
+            lastStatus
+        }
+        val headroom = try {
+            source.headroom(FORECAST_SECONDS)
+        } catch (e: Exception) {
+            null
+        }
+        lastStatus = status
+        lastHeadroom = headroom
+
+        val current = decision.throttle
+        val measured = throttleFor(status, headroom)
+        val now = clock()
+        val next = when {
+            measured > current -> {
+                coolingSince = 0L
+                measured
+            }
+            measured < current -> {
+                if (coolingSince == 0L) coolingSince = now
+                if (now - coolingSince >= COOL_DOWN_MS) {
+                    // Start the next cool-down from here, so each step down waits again
+                    coolingSince = now
+                    Throttle.values()[current.ordinal - 1]
+                } else {
+                    current
+                }
+            }
+            else -> {
+                coolingSince = 0L
+                current
+            }
+        }
+
+        val nextDecision = decisionFor(next, maxConcurrency)
+        if (next != current) {
+            since = now
+            changes++
+            LogManager.i(TAG, "Thermal status $status${headroom?.let { " (headroom %.2f)".format(it) } ?: ""}: " +
+                "throttle $current -> $next, concurrency ${nextDecision.concurrencyLimit ?: maxConcurrency}, " +
+                "max_tokens cap ${nextDecision.maxTokensCap ?: "none"}")
+        }
+        decision = nextDecision
+        return nextDecision
+    }
+
+    /** [maxTokens] limited to the current cap. */
+    fun capMaxTokens(maxTokens: Int): Int {
+        val cap = decision.maxTokensCap ?: return maxTokens
+        if (maxTokens <= cap) return maxTokens
+        cappedRequests.incrementAndGet()
+        LogManager.d(TAG) { "Capping max_tokens $maxTokens to $cap (throttle ${decision.throttle})" }
+        return cap
+    }
+
+    /** The backend to create new engines on instead of [configured] (a SettingsManager.BACKEND_* value). */
+    fun backendFor(configured: String): String {
+        if (configured == SettingsManager.BACKEND_GPU && decision.avoidGpu) {
+            LogManager.w(TAG, "Device is hot (throttle ${decision.throttle}); creating engines on CPU instead of GPU")
+            return SettingsManager.BACKEND_CPU
+        }
+        return configured
+    }
+
+    @Synchronized
+    fun snapshot(): Snapshot = Snapshot(lastStatus, lastHeadroom, decision, since, changes, cappedRequests.get())
+}